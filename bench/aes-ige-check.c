@@ -0,0 +1,130 @@
+/*
+ * Checks aes_ige bit for bit against OpenSSL's AES_ige_encrypt
+ *
+ * Covers both directions, lengths from one block to several pages, buffers and
+ * keys at every alignment, in place operation and messages processed in
+ * pieces. Exits with 1 on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/aes.h>
+
+#include "crypto.h"
+
+#define MAX_LEN (1 << 17)
+
+static unsigned char plain[MAX_LEN + 16], in[MAX_LEN + 16], out[MAX_LEN + 16], ref[MAX_LEN + 16];
+static int checks;
+
+static void fail (const char *what, int enc, int len, int off) {
+  printf ("FAIL %s: %s, len = %d, offset = %d\n", what, enc == AES_ENCRYPT ? "encrypt" : "decrypt", len, off);
+  exit (1);
+}
+
+static void random_bytes (unsigned char *p, int len) {
+  int i;
+  for (i = 0; i < len; i++) {
+    p[i] = lrand48 ();
+  }
+}
+
+/**
+ * Compare one message of len bytes, with the input at in + off and the output
+ * at out + (off * 7) % 16, in place if inplace is set
+ */
+static void check_one (int enc, int len, int off, int inplace) {
+  unsigned char key[32], iv[32], iv_ref[32];
+  random_bytes (key, 32);
+  random_bytes (iv, 32);
+  memcpy (iv_ref, iv, 32);
+  random_bytes (plain, len);
+
+  // the key struct itself at an odd address
+  char *kbuf = malloc (sizeof (struct aes_ige_key) + 16);
+  struct aes_ige_key *K = (void *)(kbuf + 1 + off % 15);
+  aes_ige_set_key (K, key, enc);
+  AES_KEY R;
+  if (enc == AES_ENCRYPT) {
+    AES_set_encrypt_key (key, 256, &R);
+  } else {
+    AES_set_decrypt_key (key, 256, &R);
+  }
+
+  AES_ige_encrypt (plain, ref, len, &R, iv_ref, enc);
+
+  unsigned char *src = in + off;
+  unsigned char *dst = inplace ? src : out + (off * 7) % 16;
+  memcpy (src, plain, len);
+  aes_ige (K, src, dst, len, iv);
+  if (memcmp (dst, ref, len)) { fail (inplace ? "in place" : "output", enc, len, off); }
+  if (memcmp (iv, iv_ref, 32)) { fail ("iv", enc, len, off); }
+
+  aes_ige_clear (K);
+  free (kbuf);
+  checks ++;
+}
+
+/**
+ * Process a message in pieces of random block counts, the iv carries the
+ * chain from one piece to the next
+ */
+static void check_pieces (int enc, int len) {
+  unsigned char key[32], iv[32], iv_ref[32];
+  random_bytes (key, 32);
+  random_bytes (iv, 32);
+  memcpy (iv_ref, iv, 32);
+  random_bytes (plain, len);
+
+  struct aes_ige_key K;
+  aes_ige_set_key (&K, key, enc);
+  AES_KEY R;
+  if (enc == AES_ENCRYPT) {
+    AES_set_encrypt_key (key, 256, &R);
+  } else {
+    AES_set_decrypt_key (key, 256, &R);
+  }
+  AES_ige_encrypt (plain, ref, len, &R, iv_ref, enc);
+
+  int pos = 0;
+  while (pos < len) {
+    int n = 16 * (1 + lrand48 () % 64);
+    if (n > len - pos) { n = len - pos; }
+    aes_ige (&K, plain + pos, out + pos, n, iv);
+    pos += n;
+  }
+  if (memcmp (out, ref, len)) { fail ("pieces", enc, len, 0); }
+  if (memcmp (iv, iv_ref, 32)) { fail ("pieces iv", enc, len, 0); }
+  aes_ige_clear (&K);
+  checks ++;
+}
+
+int main (void) {
+  srand48 (1);
+  printf ("AES-NI kernel: %s\n", aes_ige_accel () ? "yes" : "no, checking the OpenSSL path");
+  int enc;
+  for (enc = 0; enc < 2; enc ++) {
+    int mode = enc ? AES_ENCRYPT : AES_DECRYPT;
+    int len, off;
+    for (len = 16; len <= 1024; len += 16) {
+      for (off = 0; off < 16; off ++) {
+        check_one (mode, len, off, 0);
+        check_one (mode, len, off, 1);
+      }
+    }
+    for (len = 2048; len <= MAX_LEN; len *= 2) {
+      for (off = 0; off < 16; off += 5) {
+        check_one (mode, len, off, 0);
+        check_one (mode, len, off, 1);
+      }
+    }
+    int i;
+    for (i = 0; i < 200; i++) {
+      check_one (mode, 16 * (1 + lrand48 () % (MAX_LEN / 16)), lrand48 () % 16, lrand48 () & 1);
+      check_pieces (mode, 16 * (1 + lrand48 () % (MAX_LEN / 16)));
+    }
+  }
+  printf ("OK, %d messages match\n", checks);
+  return 0;
+}
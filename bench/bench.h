@@ -0,0 +1,24 @@
+/*
+ * Helpers shared by the programs in bench/
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <time.h>
+
+/**
+ * CPU time of the calling thread in seconds, benchmarks report per core
+ */
+static inline double bench_cpu_time (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static inline double bench_wall_time (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Wakeups, system calls and CPU time per message of the event loop backends
+ *
+ *   bench/event-loop-bench [backend] [messages] [connections] [burst] [gap_us]
+ *
+ * A writer thread sends messages of MSG_SIZE bytes round robin over socket
+ * pairs, burst messages at a time with gap_us microseconds in between, like
+ * updates and file parts arriving on the connections of a few DCs. The loop
+ * thread reads them through the backend. Without a backend name all built in
+ * backends are measured one after another.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "event-loop.h"
+#include "bench.h"
+
+#define MSG_SIZE 256
+
+/*
+ * The loop runs without telegram instances, the parts of event-loop.c that
+ * drive them are never reached
+ */
+struct mtproto_connection;
+double get_double_time (void) { return bench_wall_time (); }
+double next_timer_in (struct telegram *instance) { return 1e100; }
+void work_timers (struct telegram *instance) { abort (); }
+void telegram_flush (struct telegram *instance) { abort (); }
+void mtproto_free_closed (struct telegram *tg, int force) { abort (); }
+void mtp_read_input (struct mtproto_connection *mtp) { abort (); }
+int mtp_write_output (struct mtproto_connection *mtp) { abort (); }
+struct mtproto_connection *telegram_add_proxy (struct telegram *tg, struct proxy_request *req, int fd, void *handle) { abort (); }
+int telegram_crypto_fd (struct telegram *instance) { abort (); }
+void telegram_crypto_ready (struct telegram *instance) { abort (); }
+void telegram_session_failed (struct proxy_request *req) { abort (); }
+
+struct bench_run {
+  int messages;
+  int conns;
+  int burst;
+  int gap_us;
+  int *fds;
+  long long received;
+  long long reads;
+};
+
+static void *writer (void *arg) {
+  struct bench_run *R = arg;
+  static char msg[MSG_SIZE];
+  int i;
+  for (i = 0; i < R->messages; i++) {
+    int fd = R->fds[2 * (i % R->conns) + 1];
+    int r = write (fd, msg, MSG_SIZE);
+    assert (r == MSG_SIZE);
+    if (R->gap_us && (i + 1) % R->burst == 0) {
+      usleep (R->gap_us);
+    }
+  }
+  return 0;
+}
+
+static void reader (struct event_loop *loop, struct event_source *s, int events) {
+  struct bench_run *R = s->data;
+  static char buf[1 << 16];
+  while (1) {
+    R->reads ++;
+    int r = read (s->fd, buf, sizeof (buf));
+    if (r <= 0) {
+      assert (r < 0 && errno == EAGAIN);
+      break;
+    }
+    R->received += r;
+  }
+}
+
+static int run (const char *name, struct bench_run *R) {
+  struct event_loop *loop = event_loop_new (name);
+  if (!loop) {
+    fprintf (stderr, "no %s backend\n", name);
+    return -1;
+  }
+  R->received = 0;
+  R->reads = 0;
+  R->fds = malloc (sizeof (int) * 2 * R->conns);
+  struct event_source **src = malloc (sizeof (void *) * R->conns);
+  int i;
+  for (i = 0; i < R->conns; i++) {
+    int r = socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, R->fds + 2 * i);
+    assert (r == 0);
+    // the writer blocks when the loop falls behind instead of dropping messages
+    r = fcntl (R->fds[2 * i + 1], F_SETFL, 0);
+    assert (r == 0);
+    src[i] = event_loop_add (loop, R->fds[2 * i], EV_READ, reader, R);
+    assert (src[i]);
+  }
+
+  pthread_t th;
+  double wall = bench_wall_time ();
+  double cpu = bench_cpu_time ();
+  pthread_create (&th, 0, writer, R);
+  while (R->received < (long long) R->messages * MSG_SIZE) {
+    int r = event_loop_run_once (loop, 1.0);
+    assert (r >= 0);
+  }
+  cpu = bench_cpu_time () - cpu;
+  wall = bench_wall_time () - wall;
+  pthread_join (th, 0);
+
+  struct event_loop_stats st;
+  event_loop_get_stats (loop, &st);
+  double m = R->messages;
+  printf ("%-9s %8.3f wakeups  %8.3f events  %8.3f backend syscalls  %8.3f reads  %8.0f ns cpu  per message, %.2f s\n",
+      loop->backend->name, st.wakeups / m, st.events / m, st.syscalls / m, R->reads / m, 1e9 * cpu / m, wall);
+
+  for (i = 0; i < R->conns; i++) {
+    event_loop_del (loop, src[i]);
+    close (R->fds[2 * i]);
+    close (R->fds[2 * i + 1]);
+  }
+  event_loop_free (loop);
+  free (src);
+  free (R->fds);
+  return 0;
+}
+
+int main (int argc, char **argv) {
+  const char *name = argc > 1 && strcmp (argv[1], "all") ? argv[1] : 0;
+  struct bench_run R;
+  memset (&R, 0, sizeof (R));
+  R.messages = argc > 2 ? atoi (argv[2]) : 200000;
+  R.conns = argc > 3 ? atoi (argv[3]) : 8;
+  R.burst = argc > 4 ? atoi (argv[4]) : 16;
+  R.gap_us = argc > 5 ? atoi (argv[5]) : 50;
+  assert (R.messages > 0 && R.conns > 0 && R.burst > 0);
+  printf ("%d messages of %d bytes over %d connections, bursts of %d every %d us\n",
+      R.messages, MSG_SIZE, R.conns, R.burst, R.gap_us);
+  if (name) {
+    return run (name, &R) < 0;
+  }
+  const char *names[] = {
+#ifdef HAVE_LIBURING
+    "io_uring",
+#endif
+    "epoll",
+    0
+  };
+  int i;
+  for (i = 0; names[i]; i++) {
+    run (names[i], &R);
+  }
+  return 0;
+}
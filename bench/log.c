@@ -0,0 +1,43 @@
+/*
+ * Logging for the programs in bench/, which run without libpurple. Only
+ * warnings and worse are printed, on stderr.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "msglog.h"
+
+static void log_print (const char *format, va_list ap) {
+  vfprintf (stderr, format, ap);
+}
+
+void hexdump (int *in_ptr, int *in_end) {
+}
+
+void debug (const char *format, ...) {
+}
+
+void info (const char *format, ...) {
+}
+
+void warning (const char *format, ...) {
+  va_list ap;
+  va_start (ap, format);
+  log_print (format, ap);
+  va_end (ap);
+}
+
+void failure (const char *format, ...) {
+  va_list ap;
+  va_start (ap, format);
+  log_print (format, ap);
+  va_end (ap);
+}
+
+void fatal (const char *format, ...) {
+  va_list ap;
+  va_start (ap, format);
+  log_print (format, ap);
+  va_end (ap);
+}
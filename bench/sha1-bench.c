@@ -0,0 +1,86 @@
+/*
+ * Hashing cost per message against OpenSSL's SHA1 in ns per message per core
+ *
+ *   bench/sha1-bench [seconds per run]
+ *
+ * A message costs one SHA1 of its plaintext for msg_key and four 48 byte
+ * SHA1s for the derivation of the AES key and iv, as in aes_encrypt_message
+ * and init_aes_auth. The sizes are those of short text messages, acks and
+ * typical rpc answers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <openssl/sha.h>
+
+#include "crypto.h"
+#include "bench.h"
+
+static unsigned char msg[1 << 14];
+static unsigned char kdf[4][48];
+
+static void hash_message (int accel, int len, unsigned char out[5][20]) {
+  if (accel) {
+    const unsigned char *in[4] = {kdf[0], kdf[1], kdf[2], kdf[3]};
+    unsigned char *o[4] = {out[1], out[2], out[3], out[4]};
+    sha1 (msg, len, out[0]);
+    sha1_x4 (in, 48, o);
+  } else {
+    int i;
+    SHA1 (msg, len, out[0]);
+    for (i = 0; i < 4; i++) {
+      SHA1 (kdf[i], 48, out[i + 1]);
+    }
+  }
+}
+
+static double run (int accel, int len, double seconds) {
+  unsigned char out[5][20];
+  long long n = 0;
+  double start = bench_cpu_time (), now;
+  do {
+    int i;
+    for (i = 0; i < 64; i++) {
+      hash_message (accel, len, out);
+      // chain the hashes so that no run can be skipped
+      msg[0] ^= out[0][0];
+      kdf[0][0] ^= out[1][0];
+    }
+    n += 64;
+    now = bench_cpu_time ();
+  } while (now - start < seconds);
+  return 1e9 * (now - start) / n;
+}
+
+int main (int argc, char **argv) {
+  double seconds = argc > 1 ? atof (argv[1]) : 0.5;
+  static const int sizes[] = {48, 128, 512, 2048, 1 << 14};
+  int i, j;
+  srand48 (1);
+  for (i = 0; i < (int) sizeof (msg); i++) {
+    msg[i] = lrand48 ();
+  }
+  for (i = 0; i < 4; i++) {
+    for (j = 0; j < 48; j++) {
+      kdf[i][j] = lrand48 ();
+    }
+  }
+  // the numbers mean nothing if the hashes differ
+  for (i = 0; i < (int)(sizeof (sizes) / sizeof (sizes[0])); i++) {
+    unsigned char a[5][20], b[5][20];
+    hash_message (1, sizes[i], a);
+    hash_message (0, sizes[i], b);
+    assert (!memcmp (a, b, sizeof (a)));
+  }
+
+  printf ("SHA extensions: %s\n", sha1_accel () ? "yes" : "no, sha1 runs OpenSSL");
+  printf ("%8s %12s %12s %8s\n", "bytes", "sha1", "OpenSSL", "speedup");
+  for (i = 0; i < (int)(sizeof (sizes) / sizeof (sizes[0])); i++) {
+    double a = run (1, sizes[i], seconds);
+    double b = run (0, sizes[i], seconds);
+    printf ("%8d %9.0f ns %9.0f ns %7.2fx\n", sizes[i], a, b, b / a);
+  }
+  return 0;
+}
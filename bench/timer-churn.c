@@ -0,0 +1,100 @@
+/*
+ * Arm and cancel churn on the timer wheel with many outstanding timers
+ *
+ *   bench/timer-churn [timers] [seconds]
+ *
+ * Every timer stands for a query waiting for its answer. Per tick of simulated
+ * time a batch of them is answered (cancelled and armed again for the next
+ * query) or re-armed after a resend, then the wheel runs the tick and the
+ * timers that expire arm themselves again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "timers.h"
+#include "bench.h"
+
+struct bench_timer {
+  struct event_timer ev;
+  long long fired;
+};
+
+static struct timer_wheel W;
+static long long now;
+
+// a timeout between 0.5 and 32 seconds, like the range of query timeouts
+static long long random_timeout (void) {
+  return now + 1 + TIMER_HZ / 2 + lrand48 () % (32 * TIMER_HZ);
+}
+
+static int bench_alarm (void *self) {
+  struct bench_timer *T = self;
+  T->fired ++;
+  T->ev.expires = random_timeout ();
+  timer_wheel_insert (&W, &T->ev, now);
+  return 0;
+}
+
+int main (int argc, char **argv) {
+  int n = argc > 1 ? atoi (argv[1]) : 10000;
+  double seconds = argc > 2 ? atof (argv[2]) : 1;
+  srand48 (1);
+  struct bench_timer *T = calloc (n, sizeof (*T));
+  int i;
+  now = 1;
+  for (i = 0; i < n; i++) {
+    T[i].ev.alarm = bench_alarm;
+    T[i].ev.self = &T[i];
+    T[i].ev.expires = random_timeout ();
+    timer_wheel_insert (&W, &T[i].ev, now);
+  }
+
+  // a tenth of the timers is touched per tick
+  int batch = n / 10 + 1;
+  int *pick = malloc (sizeof (int) * batch);
+  long long rearms = 0, cancels = 0, ticks = 0, fired = 0;
+  double t_arm = 0, t_cancel = 0, t_run = 0;
+  double start = bench_cpu_time ();
+  while (bench_cpu_time () - start < seconds) {
+    for (i = 0; i < batch; i++) {
+      pick[i] = lrand48 () % n;
+    }
+    // answered queries, the timer goes and the next query arms it again
+    double t0 = bench_cpu_time ();
+    for (i = 0; i < batch / 2; i++) {
+      timer_wheel_remove (&W, &T[pick[i]].ev);
+    }
+    double t1 = bench_cpu_time ();
+    for (i = 0; i < batch; i++) {
+      T[pick[i]].ev.expires = random_timeout ();
+      timer_wheel_insert (&W, &T[pick[i]].ev, now);
+    }
+    double t2 = bench_cpu_time ();
+    // the event loop sleeps until the next tick that has work
+    long long next = timer_wheel_next (&W);
+    assert (next > now);
+    now = next <= now + 1 ? now + 1 : next;
+    timer_wheel_run (&W, now);
+    double t3 = bench_cpu_time ();
+    assert (W.count == n);
+    cancels += batch / 2;
+    rearms += batch;
+    ticks ++;
+    t_cancel += t1 - t0;
+    t_arm += t2 - t1;
+    t_run += t3 - t2;
+  }
+  for (i = 0; i < n; i++) {
+    fired += T[i].fired;
+  }
+  printf ("%d outstanding timers, %lld ticks of %.1f s simulated\n", n, ticks, (double) now / TIMER_HZ);
+  printf ("arm / re-arm:  %8.1f ns  (%lld)\n", 1e9 * t_arm / rearms, rearms);
+  printf ("cancel:        %8.1f ns  (%lld)\n", 1e9 * t_cancel / cancels, cancels);
+  printf ("run per tick:  %8.1f ns  (%lld timers fired)\n", 1e9 * t_run / ticks, fired);
+  timer_wheel_clear (&W);
+  free (pick);
+  free (T);
+  return 0;
+}
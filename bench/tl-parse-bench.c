@@ -0,0 +1,337 @@
+/*
+ * Parse throughput of the generated TL code in MB/s and ns per object
+ *
+ *   bench/tl-parse-bench [seconds per run]
+ *
+ * The input is a mix of MessageMedia objects as they come with messages: photos
+ * with three sizes, videos, documents, geo points and contacts. It is parsed
+ * three ways, skipped with fetch_skip_message_media, decoded with
+ * fetch_tl_message_media and decoded field by field with a fetch_* call and
+ * its bounds check per field, the way structures.c did it by hand.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mtproto-client.h"
+#include "constants.h"
+#include "tl-skip.h"
+#include "bench.h"
+
+#define MAX_SIZES 8
+#define OBJECTS 4096
+
+static int buf[OBJECTS * 64];
+static int *buf_end;
+
+/*
+ * Serialization of the input
+ */
+
+static int *out;
+
+static void put_int (int x) { *out++ = x; }
+static void put_long (long long x) { memcpy (out, &x, 8); out += 2; }
+static void put_double (double x) { memcpy (out, &x, 8); out += 2; }
+
+static void put_string (const char *s, int len) {
+  unsigned char *p = (void *) out;
+  assert (len < 254);
+  p[0] = len;
+  memcpy (p + 1, s, len);
+  int ints = (len + 4) >> 2;
+  memset (p + 1 + len, 0, 4 * ints - len - 1);
+  out += ints;
+}
+
+static void put_str (const char *s) { put_string (s, strlen (s)); }
+
+static void put_file_location (int n) {
+  put_int (CODE_file_location);
+  put_int (2);
+  put_long (0x1234567800LL + n);
+  put_int (n);
+  put_long (0x5eed0000LL ^ n);
+}
+
+static void put_photo_size (const char *type, int n, int cached) {
+  if (cached) {
+    static char thumb[200];
+    put_int (CODE_photo_cached_size);
+    put_str (type);
+    put_file_location (n);
+    put_int (90);
+    put_int (60);
+    put_string (thumb, sizeof (thumb));
+  } else {
+    put_int (CODE_photo_size);
+    put_str (type);
+    put_file_location (n);
+    put_int (800);
+    put_int (600);
+    put_int (60000 + n);
+  }
+}
+
+static void put_media (int n) {
+  switch (n % 5) {
+  case 0:
+    put_int (CODE_message_media_photo);
+    put_int (CODE_photo);
+    put_long (n);
+    put_long (-n);
+    put_int (1000 + n);
+    put_int (1400000000 + n);
+    put_str ("a caption of a photo");
+    put_int (CODE_geo_point_empty);
+    put_int (CODE_vector);
+    put_int (3);
+    put_photo_size ("s", n, 1);
+    put_photo_size ("m", n, 0);
+    put_photo_size ("x", n, 0);
+    break;
+  case 1:
+    put_int (CODE_message_media_video);
+    put_int (CODE_video);
+    put_long (n);
+    put_long (-n);
+    put_int (1000 + n);
+    put_int (1400000000 + n);
+    put_str ("");
+    put_int (30);
+    put_int (1 << 20);
+    put_photo_size ("s", n, 1);
+    put_int (2);
+    put_int (640);
+    put_int (480);
+    break;
+  case 2:
+    put_int (CODE_message_media_document);
+    put_int (CODE_document);
+    put_long (n);
+    put_long (-n);
+    put_int (1000 + n);
+    put_int (1400000000 + n);
+    put_str ("report.pdf");
+    put_str ("application/pdf");
+    put_int (123456);
+    put_int (CODE_photo_size_empty);
+    put_str ("");
+    put_int (2);
+    break;
+  case 3:
+    put_int (CODE_message_media_geo);
+    put_int (CODE_geo_point);
+    put_double (37.6 + n);
+    put_double (55.7 - n);
+    break;
+  default:
+    put_int (CODE_message_media_contact);
+    put_str ("+15550000000");
+    put_str ("First");
+    put_str ("Last");
+    put_int (1000 + n);
+  }
+}
+
+/*
+ * Field by field decoding
+ */
+
+static void hand_str (struct mtproto_connection *mtp, struct tl_str *S) {
+  S->len = prefetch_strlen (mtp);
+  S->data = fetch_str (mtp, S->len);
+}
+
+static void hand_file_location (struct mtproto_connection *mtp, struct tl_file_location *L) {
+  L->magic = fetch_int (mtp);
+  if (L->magic == CODE_file_location) {
+    L->dc_id = fetch_int (mtp);
+  }
+  L->volume_id = fetch_long (mtp);
+  L->local_id = fetch_int (mtp);
+  L->secret = fetch_long (mtp);
+}
+
+static void hand_photo_size (struct mtproto_connection *mtp, struct tl_photo_size *S) {
+  S->magic = fetch_int (mtp);
+  hand_str (mtp, &S->type);
+  if (S->magic == CODE_photo_size_empty) { return; }
+  hand_file_location (mtp, &S->location);
+  S->w = fetch_int (mtp);
+  S->h = fetch_int (mtp);
+  if (S->magic == CODE_photo_size) {
+    S->size = fetch_int (mtp);
+  } else {
+    hand_str (mtp, &S->bytes);
+  }
+}
+
+static void hand_geo (struct mtproto_connection *mtp, struct tl_geo_point *G) {
+  G->magic = fetch_int (mtp);
+  if (G->magic == CODE_geo_point) {
+    G->long_ = fetch_double (mtp);
+    G->lat = fetch_double (mtp);
+  }
+}
+
+static void hand_media (struct mtproto_connection *mtp, struct tl_message_media *M, struct tl_photo_size *sizes) {
+  int i;
+  M->magic = fetch_int (mtp);
+  switch (M->magic) {
+  case CODE_message_media_photo:
+    M->photo.magic = fetch_int (mtp);
+    M->photo.id = fetch_long (mtp);
+    M->photo.access_hash = fetch_long (mtp);
+    M->photo.user_id = fetch_int (mtp);
+    M->photo.date = fetch_int (mtp);
+    hand_str (mtp, &M->photo.caption);
+    hand_geo (mtp, &M->photo.geo);
+    assert (fetch_int (mtp) == CODE_vector);
+    M->photo.sizes.n = fetch_int (mtp);
+    M->photo.sizes.data = mtp->in_ptr;
+    assert (M->photo.sizes.n <= MAX_SIZES);
+    for (i = 0; i < M->photo.sizes.n; i++) {
+      hand_photo_size (mtp, &sizes[i]);
+    }
+    break;
+  case CODE_message_media_video:
+    M->video.magic = fetch_int (mtp);
+    M->video.id = fetch_long (mtp);
+    M->video.access_hash = fetch_long (mtp);
+    M->video.user_id = fetch_int (mtp);
+    M->video.date = fetch_int (mtp);
+    hand_str (mtp, &M->video.caption);
+    M->video.duration = fetch_int (mtp);
+    M->video.size = fetch_int (mtp);
+    hand_photo_size (mtp, &M->video.thumb);
+    M->video.dc_id = fetch_int (mtp);
+    M->video.w = fetch_int (mtp);
+    M->video.h = fetch_int (mtp);
+    break;
+  case CODE_message_media_document:
+    M->document.magic = fetch_int (mtp);
+    M->document.id = fetch_long (mtp);
+    M->document.access_hash = fetch_long (mtp);
+    M->document.user_id = fetch_int (mtp);
+    M->document.date = fetch_int (mtp);
+    hand_str (mtp, &M->document.file_name);
+    hand_str (mtp, &M->document.mime_type);
+    M->document.size = fetch_int (mtp);
+    hand_photo_size (mtp, &M->document.thumb);
+    M->document.dc_id = fetch_int (mtp);
+    break;
+  case CODE_message_media_geo:
+    hand_geo (mtp, &M->geo);
+    break;
+  case CODE_message_media_contact:
+    hand_str (mtp, &M->phone_number);
+    hand_str (mtp, &M->first_name);
+    hand_str (mtp, &M->last_name);
+    M->user_id = fetch_int (mtp);
+    break;
+  default:
+    assert (0);
+  }
+}
+
+/*
+ * Generated decoding, the photo sizes are decoded from the vector like the
+ * callers do
+ */
+
+static void tl_media (struct mtproto_connection *mtp, struct tl_message_media *M, struct tl_photo_size *sizes) {
+  fetch_tl_message_media (mtp, M);
+  if (M->magic == CODE_message_media_photo) {
+    int *end = mtp->in_end, *next = mtp->in_ptr;
+    int i;
+    mtp->in_ptr = M->photo.sizes.data;
+    mtp->in_end = next;
+    assert (M->photo.sizes.n <= MAX_SIZES);
+    for (i = 0; i < M->photo.sizes.n; i++) {
+      fetch_tl_photo_size (mtp, &sizes[i]);
+    }
+    mtp->in_ptr = next;
+    mtp->in_end = end;
+  }
+}
+
+enum { MODE_SKIP, MODE_DECODE, MODE_HAND };
+
+static long long checksum;
+
+static void parse_all (struct mtproto_connection *mtp, int mode) {
+  struct tl_message_media M;
+  struct tl_photo_size sizes[MAX_SIZES];
+  mtp->in_ptr = buf;
+  mtp->in_end = buf_end;
+  while (mtp->in_ptr < mtp->in_end) {
+    switch (mode) {
+    case MODE_SKIP:
+      fetch_skip_message_media (mtp);
+      break;
+    case MODE_DECODE:
+      tl_media (mtp, &M, sizes);
+      checksum += M.magic + M.photo.id;
+      break;
+    default:
+      hand_media (mtp, &M, sizes);
+      checksum += M.magic + M.photo.id;
+    }
+  }
+  assert (mtp->in_ptr == mtp->in_end);
+}
+
+static double run (struct mtproto_connection *mtp, int mode, double seconds) {
+  long long n = 0;
+  double start = bench_cpu_time (), now;
+  do {
+    parse_all (mtp, mode);
+    n ++;
+    now = bench_cpu_time ();
+  } while (now - start < seconds);
+  return (now - start) / n;
+}
+
+int main (int argc, char **argv) {
+  double seconds = argc > 1 ? atof (argv[1]) : 0.5;
+  int i, j;
+  out = buf;
+  for (i = 0; i < OBJECTS; i++) {
+    put_media (i);
+  }
+  buf_end = out;
+  assert (buf_end <= buf + sizeof (buf) / sizeof (int));
+
+  static struct mtproto_connection mtp;
+  // the numbers mean nothing if the decoders disagree
+  mtp.in_ptr = buf;
+  mtp.in_end = buf_end;
+  struct mtproto_connection hand = mtp;
+  while (mtp.in_ptr < mtp.in_end) {
+    struct tl_message_media A, B;
+    struct tl_photo_size sa[MAX_SIZES], sb[MAX_SIZES];
+    memset (&A, 0, sizeof (A));
+    memset (&B, 0, sizeof (B));
+    memset (sa, 0, sizeof (sa));
+    memset (sb, 0, sizeof (sb));
+    tl_media (&mtp, &A, sa);
+    hand_media (&hand, &B, sb);
+    assert (mtp.in_ptr == hand.in_ptr);
+    assert (!memcmp (&A, &B, sizeof (A)));
+    for (j = 0; j < MAX_SIZES; j++) {
+      assert (!memcmp (&sa[j], &sb[j], sizeof (sa[j])));
+    }
+  }
+
+  double bytes = 4.0 * (buf_end - buf);
+  printf ("%d objects, %.0f KB\n", OBJECTS, bytes / 1024);
+  static const char *names[] = {"fetch_skip_message_media", "fetch_tl_message_media", "field by field"};
+  for (i = MODE_SKIP; i <= MODE_HAND; i++) {
+    double t = run (&mtp, i, seconds);
+    printf ("%-26s %7.0f MB/s %7.1f ns per object\n", names[i], bytes / t / (1 << 20), 1e9 * t / OBJECTS);
+  }
+  return checksum == 42;
+}
@@ -39,9 +39,18 @@
 
 #define MAX_LOG_EVENT_SIZE (1 << 17)
 
-int binlog_enabled = 0;
 
-void *alloc_log_event (struct binlog *bl, int l UU) {
+void *alloc_log_event (struct binlog *bl, int l) {
+  assert (l >= 0);
+  if (bl->binlog_buffer_size < l) {
+    int n = bl->binlog_buffer_size ? bl->binlog_buffer_size : 1024;
+    while (n < l) { n *= 2; }
+    if (bl->binlog_buffer) {
+      tfree (bl->binlog_buffer, bl->binlog_buffer_size);
+    }
+    bl->binlog_buffer = talloc (n);
+    bl->binlog_buffer_size = n;
+  }
   return bl->binlog_buffer;
 }
 
@@ -54,7 +63,7 @@ void replay_log_event (struct telegram *instance) {
   assert (bl->rptr < bl->wptr);
   int op = *bl->rptr;
 
-  if (verbosity >= 2) {
+  if (instance->verbosity >= 2) {
     debug ("log_pos %lld, op 0x%08x\n", bl->binlog_pos, op);
   }
 
@@ -186,7 +195,7 @@ void replay_log_event (struct telegram *instance) {
         if (P) {
           U->print_name = create_print_name (bl, U->id, "!", P->user.first_name, P->user.last_name, 0);
         } else {
-          static char buf[100];
+          char buf[100];
           tsnprintf (buf, 99, "user#%d", U->user_id);
           U->print_name = create_print_name (bl, U->id, "!", buf, 0, 0);
         }
@@ -243,7 +252,7 @@ void replay_log_event (struct telegram *instance) {
         if (P) {
           U->print_name = create_print_name (bl, U->id, "!", P->user.first_name, P->user.last_name, 0);
         } else {
-          static char buf[100];
+          char buf[100];
           tsnprintf (buf, 99, "user#%d", U->user_id);
           U->print_name = create_print_name (bl, U->id, "!", buf, 0, 0);
         }
@@ -411,7 +420,7 @@ void replay_log_event (struct telegram *instance) {
       if (Us) {
         U->print_name = create_print_name (bl, id, "!", Us->user.first_name, Us->user.last_name, 0);
       } else {
-        static char buf[100];
+        char buf[100];
         tsnprintf (buf, 99, "user#%d", U->user_id);
         U->print_name = create_print_name (bl, id, "!", buf, 0, 0);
       }
@@ -1050,7 +1059,7 @@ void replay_log_event (struct telegram *instance) {
 
     assert (0);
   }
-  if (verbosity >= 2) {
+  if (instance->verbosity >= 2) {
     debug ("Event end\n");
   }
   bl->in_replay_log = 0;
@@ -1082,7 +1091,7 @@ void bl_do_set_auth_key_id (struct telegram *instance, int num, unsigned char *b
   struct mtproto_connection *self = instance->connection;
   struct binlog *bl = instance->bl;
 
-  static unsigned char sha1_buffer[20];
+  unsigned char sha1_buffer[20];
   SHA1 (buf, 256, sha1_buffer);
   long long fingerprint = *(long long *)(sha1_buffer + 12);
   int *ev = alloc_log_event (bl, 8 + 8 + 256);
@@ -0,0 +1,621 @@
+/*
+ * Bulk crypto kernels
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <openssl/aes.h>
+#include <openssl/sha.h>
+
+#include "crypto.h"
+#include "msglog.h"
+#include "tools.h"
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define HAVE_AESNI_KERNEL 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// -1 until the CPU has been checked
+static int aesni_state = -1;
+
+#ifdef HAVE_AESNI_KERNEL
+
+#define AESNI __attribute__ ((target ("aes,sse2")))
+
+static AESNI __m128i key_expand_a (__m128i k, __m128i t) {
+  t = _mm_shuffle_epi32 (t, 0xff);
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  return _mm_xor_si128 (k, t);
+}
+
+static AESNI __m128i key_expand_b (__m128i a, __m128i k) {
+  __m128i t = _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (a, 0), 0xaa);
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  return _mm_xor_si128 (k, t);
+}
+
+// the round constant has to be an immediate
+#define KEY_ROUND(i, rcon) \
+  a = key_expand_a (a, _mm_aeskeygenassist_si128 (b, rcon)); \
+  rk[i] = a; \
+  if (i < 14) { b = key_expand_b (a, b); rk[i + 1] = b; }
+
+static AESNI void aesni_set_key (struct aes_ige_key *K, const unsigned char key[32], int enc) {
+  __m128i rk[15];
+  __m128i a = _mm_loadu_si128 ((const __m128i *) key);
+  __m128i b = _mm_loadu_si128 ((const __m128i *) (key + 16));
+  rk[0] = a;
+  rk[1] = b;
+  KEY_ROUND (2, 0x01);
+  KEY_ROUND (4, 0x02);
+  KEY_ROUND (6, 0x04);
+  KEY_ROUND (8, 0x08);
+  KEY_ROUND (10, 0x10);
+  KEY_ROUND (12, 0x20);
+  KEY_ROUND (14, 0x40);
+
+  // the key may live in memory that talloc did not align to 16 bytes
+  __m128i *out = (__m128i *) K->rk;
+  int i;
+  if (enc == AES_ENCRYPT) {
+    for (i = 0; i < 15; i++) { _mm_storeu_si128 (out + i, rk[i]); }
+  } else {
+    // equivalent inverse cipher
+    _mm_storeu_si128 (out, rk[14]);
+    for (i = 1; i < 14; i++) { _mm_storeu_si128 (out + i, _mm_aesimc_si128 (rk[14 - i])); }
+    _mm_storeu_si128 (out + 14, rk[0]);
+  }
+  memset (rk, 0, sizeof (rk));
+}
+
+static AESNI void aesni_ige (const struct aes_ige_key *K, const unsigned char *in, unsigned char *out,
+    size_t len, unsigned char iv[32]) {
+  const __m128i *rk = (const __m128i *) K->rk;
+#define RK(i) _mm_loadu_si128 (rk + i)
+  __m128i k0 = RK(0), k1 = RK(1), k2 = RK(2), k3 = RK(3), k4 = RK(4), k5 = RK(5), k6 = RK(6), k7 = RK(7);
+  __m128i k8 = RK(8), k9 = RK(9), k10 = RK(10), k11 = RK(11), k12 = RK(12), k13 = RK(13), k14 = RK(14);
+#undef RK
+  // previous cipher text and plain text block
+  __m128i c = _mm_loadu_si128 ((const __m128i *) iv);
+  __m128i p = _mm_loadu_si128 ((const __m128i *) (iv + 16));
+
+  if (K->enc == AES_ENCRYPT) {
+    for (; len >= 16; len -= 16, in += 16, out += 16) {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) in);
+      __m128i y = _mm_xor_si128 (_mm_xor_si128 (x, c), k0);
+      y = _mm_aesenc_si128 (y, k1);
+      y = _mm_aesenc_si128 (y, k2);
+      y = _mm_aesenc_si128 (y, k3);
+      y = _mm_aesenc_si128 (y, k4);
+      y = _mm_aesenc_si128 (y, k5);
+      y = _mm_aesenc_si128 (y, k6);
+      y = _mm_aesenc_si128 (y, k7);
+      y = _mm_aesenc_si128 (y, k8);
+      y = _mm_aesenc_si128 (y, k9);
+      y = _mm_aesenc_si128 (y, k10);
+      y = _mm_aesenc_si128 (y, k11);
+      y = _mm_aesenc_si128 (y, k12);
+      y = _mm_aesenc_si128 (y, k13);
+      y = _mm_xor_si128 (_mm_aesenclast_si128 (y, k14), p);
+      _mm_storeu_si128 ((__m128i *) out, y);
+      c = y;
+      p = x;
+    }
+  } else {
+    for (; len >= 16; len -= 16, in += 16, out += 16) {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) in);
+      __m128i y = _mm_xor_si128 (_mm_xor_si128 (x, p), k0);
+      y = _mm_aesdec_si128 (y, k1);
+      y = _mm_aesdec_si128 (y, k2);
+      y = _mm_aesdec_si128 (y, k3);
+      y = _mm_aesdec_si128 (y, k4);
+      y = _mm_aesdec_si128 (y, k5);
+      y = _mm_aesdec_si128 (y, k6);
+      y = _mm_aesdec_si128 (y, k7);
+      y = _mm_aesdec_si128 (y, k8);
+      y = _mm_aesdec_si128 (y, k9);
+      y = _mm_aesdec_si128 (y, k10);
+      y = _mm_aesdec_si128 (y, k11);
+      y = _mm_aesdec_si128 (y, k12);
+      y = _mm_aesdec_si128 (y, k13);
+      y = _mm_xor_si128 (_mm_aesdeclast_si128 (y, k14), c);
+      _mm_storeu_si128 ((__m128i *) out, y);
+      c = x;
+      p = y;
+    }
+  }
+  _mm_storeu_si128 ((__m128i *) iv, c);
+  _mm_storeu_si128 ((__m128i *) (iv + 16), p);
+}
+
+/**
+ * Compare the kernel against OpenSSL once before trusting it
+ */
+static int aesni_self_test (void) {
+  unsigned char key[32], iv[32], iv2[32], plain[64], a[64], b[64];
+  int i;
+  for (i = 0; i < 32; i++) { key[i] = i * 7 + 1; iv[i] = 255 - i; }
+  for (i = 0; i < 64; i++) { plain[i] = i * 13; }
+
+  struct aes_ige_key K;
+  AES_KEY ref;
+  aesni_set_key (&K, key, AES_ENCRYPT);
+  K.enc = AES_ENCRYPT;
+  AES_set_encrypt_key (key, 256, &ref);
+  memcpy (iv2, iv, 32);
+  aesni_ige (&K, plain, a, 64, iv2);
+  memcpy (iv2, iv, 32);
+  AES_ige_encrypt (plain, b, 64, &ref, iv2, AES_ENCRYPT);
+  if (memcmp (a, b, 64)) { return 0; }
+
+  aesni_set_key (&K, key, AES_DECRYPT);
+  K.enc = AES_DECRYPT;
+  memcpy (iv2, iv, 32);
+  aesni_ige (&K, b, a, 64, iv2);
+  return !memcmp (a, plain, 64);
+}
+#endif
+
+int aes_ige_accel (void) {
+  if (aesni_state < 0) {
+    int ok = 0;
+#ifdef HAVE_AESNI_KERNEL
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES)) {
+      ok = aesni_self_test ();
+      if (!ok) {
+        warning ("AES-NI kernel does not match OpenSSL, using OpenSSL\n");
+      }
+    }
+#endif
+    aesni_state = ok;
+  }
+  return aesni_state;
+}
+
+void aes_ige_set_key (struct aes_ige_key *K, const unsigned char key[32], int enc) {
+  K->enc = enc;
+  K->accel = aes_ige_accel ();
+#ifdef HAVE_AESNI_KERNEL
+  if (K->accel) {
+    aesni_set_key (K, key, enc);
+    return;
+  }
+#endif
+  if (enc == AES_ENCRYPT) {
+    AES_set_encrypt_key (key, 256, &K->key);
+  } else {
+    AES_set_decrypt_key (key, 256, &K->key);
+  }
+}
+
+void aes_ige (const struct aes_ige_key *K, const unsigned char *in, unsigned char *out, size_t len,
+    unsigned char iv[32]) {
+  assert (!(len & 15));
+#ifdef HAVE_AESNI_KERNEL
+  if (K->accel) {
+    aesni_ige (K, in, out, len, iv);
+    return;
+  }
+#endif
+  AES_ige_encrypt (in, out, len, &K->key, iv, K->enc);
+}
+
+void aes_ige_clear (struct aes_ige_key *K) {
+  memset (K, 0, sizeof (*K));
+}
+
+// -1 until the CPU has been checked
+static int shani_state = -1;
+
+#ifdef HAVE_AESNI_KERNEL
+
+#define SHANI __attribute__ ((target ("sha,sse4.1,ssse3")))
+
+/*
+ * Four rounds of each of the n lanes. M holds the message schedule of the block,
+ * the E values alternate between e0 and e1 like in the reference code.
+ */
+#define SHA1_ROUND4(r) \
+  for (j = 0; j < n; j++) { \
+    __m128i *M = msg[j]; \
+    if (r == 0) { \
+      e0[j] = _mm_add_epi32 (e0[j], M[0]); \
+    } else if (r & 1) { \
+      e1[j] = _mm_sha1nexte_epu32 (e1[j], M[r & 3]); \
+    } else { \
+      e0[j] = _mm_sha1nexte_epu32 (e0[j], M[r & 3]); \
+    } \
+    if (r & 1) { \
+      e0[j] = abcd[j]; \
+    } else { \
+      e1[j] = abcd[j]; \
+    } \
+    if (r >= 3 && r <= 18) { M[(r + 1) & 3] = _mm_sha1msg2_epu32 (M[(r + 1) & 3], M[r & 3]); } \
+    abcd[j] = _mm_sha1rnds4_epu32 (abcd[j], (r & 1) ? e1[j] : e0[j], (r) / 5); \
+    if (r >= 1 && r <= 16) { M[(r + 3) & 3] = _mm_sha1msg1_epu32 (M[(r + 3) & 3], M[r & 3]); } \
+    if (r >= 2 && r <= 17) { M[(r + 2) & 3] = _mm_xor_si128 (M[(r + 2) & 3], M[r & 3]); } \
+  }
+
+/**
+ * Compress one 64 byte block of each of the n lanes
+ */
+static inline __attribute__ ((always_inline)) SHANI void shani_compress (int n, __m128i *abcd, __m128i *e, const unsigned char **block) {
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd_save[4], e0[4], e1[4], msg[4][4];
+  int i, j;
+  for (j = 0; j < n; j++) {
+    abcd_save[j] = abcd[j];
+    e0[j] = e[j];
+    for (i = 0; i < 4; i++) {
+      msg[j][i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (block[j] + 16 * i)), mask);
+    }
+  }
+  SHA1_ROUND4 (0);  SHA1_ROUND4 (1);  SHA1_ROUND4 (2);  SHA1_ROUND4 (3);
+  SHA1_ROUND4 (4);  SHA1_ROUND4 (5);  SHA1_ROUND4 (6);  SHA1_ROUND4 (7);
+  SHA1_ROUND4 (8);  SHA1_ROUND4 (9);  SHA1_ROUND4 (10); SHA1_ROUND4 (11);
+  SHA1_ROUND4 (12); SHA1_ROUND4 (13); SHA1_ROUND4 (14); SHA1_ROUND4 (15);
+  SHA1_ROUND4 (16); SHA1_ROUND4 (17); SHA1_ROUND4 (18); SHA1_ROUND4 (19);
+  for (j = 0; j < n; j++) {
+    // after round 79 the E value is in e0
+    e[j] = _mm_sha1nexte_epu32 (e0[j], e[j]);
+    abcd[j] = _mm_add_epi32 (abcd[j], abcd_save[j]);
+  }
+}
+
+static SHANI void shani_init (__m128i *abcd, __m128i *e) {
+  *abcd = _mm_set_epi32 (0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476);
+  *e = _mm_set_epi32 (0xc3d2e1f0, 0, 0, 0);
+}
+
+static SHANI void shani_final (__m128i abcd, __m128i e, unsigned char out[20]) {
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  _mm_storeu_si128 ((__m128i *) out, _mm_shuffle_epi8 (abcd, mask));
+  unsigned x = _mm_extract_epi32 (e, 3);
+  out[16] = x >> 24;
+  out[17] = x >> 16;
+  out[18] = x >> 8;
+  out[19] = x;
+}
+
+/**
+ * Fill the last one or two blocks of a message of total bytes, returns their number
+ */
+static int sha1_pad (unsigned char tail[128], const unsigned char *data, size_t rest, size_t total) {
+  memcpy (tail, data, rest);
+  tail[rest] = 0x80;
+  int blocks = rest < 56 ? 1 : 2;
+  memset (tail + rest + 1, 0, 64 * blocks - rest - 9);
+  unsigned long long bits = (unsigned long long) total * 8;
+  int i;
+  for (i = 0; i < 8; i++) {
+    tail[64 * blocks - 1 - i] = bits >> (8 * i);
+  }
+  return blocks;
+}
+
+static SHANI void shani_sha1 (const unsigned char *data, size_t len, unsigned char out[20]) {
+  __m128i abcd, e;
+  shani_init (&abcd, &e);
+  size_t total = len;
+  for (; len >= 64; len -= 64, data += 64) {
+    shani_compress (1, &abcd, &e, &data);
+  }
+  unsigned char tail[128];
+  int blocks = sha1_pad (tail, data, len, total);
+  const unsigned char *p = tail;
+  shani_compress (1, &abcd, &e, &p);
+  if (blocks == 2) {
+    p += 64;
+    shani_compress (1, &abcd, &e, &p);
+  }
+  shani_final (abcd, e, out);
+}
+
+static SHANI void shani_sha1_x4 (const unsigned char *data[4], int len, unsigned char *out[4]) {
+  __m128i abcd[4], e[4];
+  unsigned char tail[4][128];
+  const unsigned char *p[4];
+  int j;
+  for (j = 0; j < 4; j++) {
+    shani_init (&abcd[j], &e[j]);
+    sha1_pad (tail[j], data[j], len, len);
+    p[j] = tail[j];
+  }
+  shani_compress (4, abcd, e, p);
+  for (j = 0; j < 4; j++) {
+    shani_final (abcd[j], e[j], out[j]);
+  }
+}
+
+static int shani_self_test (void) {
+  unsigned char buf[200], a[20], b[20];
+  int i;
+  for (i = 0; i < 200; i++) { buf[i] = i * 31 + 7; }
+  // lengths around both padding cases and more than one block
+  static const int lens[] = {0, 3, 55, 56, 63, 64, 119, 120, 200};
+  for (i = 0; i < (int) (sizeof (lens) / sizeof (lens[0])); i++) {
+    shani_sha1 (buf, lens[i], a);
+    SHA1 (buf, lens[i], b);
+    if (memcmp (a, b, 20)) { return 0; }
+  }
+  return 1;
+}
+#endif
+
+int sha1_accel (void) {
+  if (shani_state < 0) {
+    int ok = 0;
+#ifdef HAVE_AESNI_KERNEL
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3) &&
+        __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+      ok = shani_self_test ();
+      if (!ok) {
+        warning ("SHA extension kernel does not match OpenSSL, using OpenSSL\n");
+      }
+    }
+#endif
+    shani_state = ok;
+  }
+  return shani_state;
+}
+
+void sha1 (const unsigned char *data, size_t len, unsigned char out[20]) {
+#ifdef HAVE_AESNI_KERNEL
+  if (sha1_accel ()) {
+    shani_sha1 (data, len, out);
+    return;
+  }
+#endif
+  SHA1 (data, len, out);
+}
+
+void sha1_x4 (const unsigned char *data[4], int len, unsigned char *out[4]) {
+  assert (len >= 0 && len < 56);
+#ifdef HAVE_AESNI_KERNEL
+  if (sha1_accel ()) {
+    shani_sha1_x4 (data, len, out);
+    return;
+  }
+#endif
+  int j;
+  for (j = 0; j < 4; j++) {
+    SHA1 (data[j], len, out[j]);
+  }
+}
+
+/*
+ * Worker pool
+ */
+
+struct crypto_pool {
+  pthread_mutex_t lock;
+  // signals new jobs to the workers and finished jobs to crypto_stream_drop
+  pthread_cond_t cond;
+  pthread_cond_t finished;
+  pthread_t threads[CRYPTO_THREADS_MAX];
+  int threads_num;
+  int stop;
+  struct crypto_job *queue_head, *queue_tail;
+  struct crypto_stream *ready;
+  // wakes up the event loop
+  int wake_fd[2];
+  int wake_pending;
+};
+
+/**
+ * List S as having finished jobs, called with the lock held
+ */
+static void crypto_stream_mark (struct crypto_pool *P, struct crypto_stream *S) {
+  if (S->ready) { return; }
+  S->ready = 1;
+  S->next_ready = P->ready;
+  P->ready = S;
+  if (!P->wake_pending) {
+    P->wake_pending = 1;
+    char c = 0;
+    if (write (P->wake_fd[1], &c, 1) < 0) {
+      // the pipe is full, the loop is awake anyway
+    }
+  }
+}
+
+static void *crypto_worker (void *arg) {
+  struct crypto_pool *P = arg;
+  pthread_mutex_lock (&P->lock);
+  while (1) {
+    while (!P->queue_head && !P->stop) {
+      pthread_cond_wait (&P->cond, &P->lock);
+    }
+    if (!P->queue_head) { break; }
+    struct crypto_job *J = P->queue_head;
+    P->queue_head = J->next;
+    if (!P->queue_head) { P->queue_tail = 0; }
+    pthread_mutex_unlock (&P->lock);
+
+    J->work (J);
+
+    pthread_mutex_lock (&P->lock);
+    J->finished = 1;
+    if (J->stream->head == J) {
+      crypto_stream_mark (P, J->stream);
+    }
+    pthread_cond_broadcast (&P->finished);
+  }
+  pthread_mutex_unlock (&P->lock);
+  return 0;
+}
+
+struct crypto_pool *crypto_pool_new (void) {
+  struct crypto_pool *P = talloc0 (sizeof (*P));
+  pthread_mutex_init (&P->lock, 0);
+  pthread_cond_init (&P->cond, 0);
+  pthread_cond_init (&P->finished, 0);
+  assert (pipe (P->wake_fd) >= 0);
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl (P->wake_fd[i], F_SETFL, fcntl (P->wake_fd[i], F_GETFL) | O_NONBLOCK);
+    fcntl (P->wake_fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  return P;
+}
+
+/**
+ * Workers are started with the first job, one per spare core
+ */
+static void crypto_pool_start (struct crypto_pool *P) {
+  int n = sysconf (_SC_NPROCESSORS_ONLN) - 1;
+  if (n > CRYPTO_THREADS_MAX) { n = CRYPTO_THREADS_MAX; }
+  if (n < 1) { n = 1; }
+  for (P->threads_num = 0; P->threads_num < n; P->threads_num ++) {
+    assert (!pthread_create (&P->threads[P->threads_num], 0, crypto_worker, P));
+  }
+  debug ("crypto pool: %d workers\n", n);
+}
+
+static struct crypto_job **crypto_stream_take (struct crypto_stream *S, struct crypto_job **tail);
+void crypto_pool_free (struct crypto_pool *P) {
+  // the workers finish the queued jobs before they exit
+  pthread_mutex_lock (&P->lock);
+  P->stop = 1;
+  pthread_cond_broadcast (&P->cond);
+  pthread_mutex_unlock (&P->lock);
+  int i;
+  for (i = 0; i < P->threads_num; i++) {
+    pthread_join (P->threads[i], 0);
+  }
+  // all jobs have finished, those not reaped yet are on the ready streams
+  struct crypto_job *J = 0, **tail = &J;
+  while (P->ready) {
+    struct crypto_stream *S = P->ready;
+    P->ready = S->next_ready;
+    S->ready = 0;
+    tail = crypto_stream_take (S, tail);
+  }
+  while (J) {
+    struct crypto_job *next = J->next;
+    J->free (J);
+    J = next;
+  }
+  close (P->wake_fd[0]);
+  close (P->wake_fd[1]);
+  pthread_mutex_destroy (&P->lock);
+  pthread_cond_destroy (&P->cond);
+  pthread_cond_destroy (&P->finished);
+  tfree (P, sizeof (*P));
+}
+
+int crypto_pool_fd (struct crypto_pool *P) {
+  return P->wake_fd[0];
+}
+
+void crypto_pool_submit (struct crypto_pool *P, struct crypto_stream *S, struct crypto_job *J) {
+  J->stream = S;
+  J->next = J->stream_next = 0;
+  J->finished = !J->work;
+  if (J->work && !P->threads_num) {
+    crypto_pool_start (P);
+  }
+  pthread_mutex_lock (&P->lock);
+  if (S->tail) {
+    S->tail->stream_next = J;
+  } else {
+    S->head = J;
+  }
+  S->tail = J;
+  if (J->work) {
+    if (P->queue_tail) {
+      P->queue_tail->next = J;
+    } else {
+      P->queue_head = J;
+    }
+    P->queue_tail = J;
+    pthread_cond_signal (&P->cond);
+  } else if (S->head == J) {
+    crypto_stream_mark (P, S);
+  }
+  pthread_mutex_unlock (&P->lock);
+}
+
+/**
+ * Unlink the finished jobs at the head of S and append them to *tail, called
+ * with the lock held
+ */
+static struct crypto_job **crypto_stream_take (struct crypto_stream *S, struct crypto_job **tail) {
+  while (S->head && S->head->finished) {
+    struct crypto_job *J = S->head;
+    S->head = J->stream_next;
+    if (!S->head) { S->tail = 0; }
+    J->next = 0;
+    *tail = J;
+    tail = &J->next;
+  }
+  return tail;
+}
+
+static int crypto_run_done (struct crypto_job *J) {
+  int n = 0;
+  while (J) {
+    // done may free the job
+    struct crypto_job *next = J->next;
+    J->done (J);
+    J = next;
+    n ++;
+  }
+  return n;
+}
+
+int crypto_pool_reap (struct crypto_pool *P) {
+  char buf[64];
+  while (read (P->wake_fd[0], buf, sizeof (buf)) > 0) { }
+
+  struct crypto_job *done = 0, **tail = &done;
+  pthread_mutex_lock (&P->lock);
+  P->wake_pending = 0;
+  while (P->ready) {
+    struct crypto_stream *S = P->ready;
+    P->ready = S->next_ready;
+    S->ready = 0;
+    tail = crypto_stream_take (S, tail);
+  }
+  pthread_mutex_unlock (&P->lock);
+  return crypto_run_done (done);
+}
+
+int crypto_stream_reap (struct crypto_pool *P, struct crypto_stream *S) {
+  struct crypto_job *done = 0;
+  pthread_mutex_lock (&P->lock);
+  crypto_stream_take (S, &done);
+  pthread_mutex_unlock (&P->lock);
+  return crypto_run_done (done);
+}
+
+struct crypto_job *crypto_stream_drop (struct crypto_pool *P, struct crypto_stream *S) {
+  pthread_mutex_lock (&P->lock);
+  struct crypto_job *J;
+  for (J = S->head; J; J = J->stream_next) {
+    while (!J->finished) {
+      pthread_cond_wait (&P->finished, &P->lock);
+    }
+  }
+  if (S->ready) {
+    struct crypto_stream **ptr = &P->ready;
+    while (*ptr != S) { ptr = &(*ptr)->next_ready; }
+    *ptr = S->next_ready;
+    S->ready = 0;
+  }
+  J = S->head;
+  S->head = S->tail = 0;
+  pthread_mutex_unlock (&P->lock);
+  return J;
+}
@@ -0,0 +1,135 @@
+#ifndef __CRYPTO_H__
+#define __CRYPTO_H__
+
+/*
+ * Bulk crypto kernels
+ *
+ * SHA1 uses the SHA extensions where the CPU has them and OpenSSL otherwise.
+ *
+ * AES-256-IGE as used by MTProto, secret chats and file parts. IGE chains every
+ * block to the previous plain and cipher text, so a single stream cannot be
+ * spread over several blocks at once; the gain comes from running each block
+ * through AES-NI instead of the table based OpenSSL implementation. CPUs without
+ * AES-NI use OpenSSL.
+ *
+ * Large jobs run on a small pool of worker threads, their results are handed
+ * back to the event loop in the order they were submitted per stream.
+ */
+
+#include <stddef.h>
+#include <openssl/aes.h>
+
+struct aes_ige_key {
+  // expanded round keys of the AES-NI kernel, decryption keys if !enc, only
+  // accessed unaligned since the struct may sit in talloc'd memory
+  unsigned char rk[15 * 16];
+  AES_KEY key;
+  int enc;
+  int accel;
+};
+
+/**
+ * Expand the 256 bit key for encryption (AES_ENCRYPT) or decryption (AES_DECRYPT)
+ */
+void aes_ige_set_key (struct aes_ige_key *K, const unsigned char key[32], int enc);
+
+/**
+ * En- or decrypt len bytes, a multiple of 16, from in to out, which may be the
+ * same buffer. iv holds the previous cipher and plain text block and is updated
+ * just like AES_ige_encrypt does, so long messages can be processed in pieces.
+ */
+void aes_ige (const struct aes_ige_key *K, const unsigned char *in, unsigned char *out, size_t len,
+    unsigned char iv[32]);
+
+/**
+ * Wipe the expanded key
+ */
+void aes_ige_clear (struct aes_ige_key *K);
+
+/**
+ * Whether the AES-NI kernel is in use
+ */
+int aes_ige_accel (void);
+
+/**
+ * SHA1 of len bytes, same as OpenSSL's SHA1
+ */
+void sha1 (const unsigned char *data, size_t len, unsigned char out[20]);
+
+/**
+ * Four independent SHA1s of len bytes each, at most 55, as needed for the AES
+ * key derivation of MTProto. The hashes are computed side by side.
+ */
+void sha1_x4 (const unsigned char *data[4], int len, unsigned char *out[4]);
+
+/**
+ * Whether the SHA extensions are in use
+ */
+int sha1_accel (void);
+
+// jobs smaller than this are not worth the handoff and run inline
+#define CRYPTO_OFFLOAD_MIN (1 << 15)
+#define CRYPTO_THREADS_MAX 4
+
+struct crypto_job;
+struct crypto_pool;
+
+/**
+ * Work for the pool. work runs on a worker thread and may only touch the job,
+ * done runs on the event loop after the done of all earlier jobs of the stream.
+ * A job without work only keeps its place in the stream. free releases a job
+ * and its payload that is never delivered because the pool goes away.
+ */
+struct crypto_job {
+  void (*work) (struct crypto_job *J);
+  void (*done) (struct crypto_job *J);
+  void (*free) (struct crypto_job *J);
+  struct crypto_stream *stream;
+  struct crypto_job *next;
+  struct crypto_job *stream_next;
+  int finished;
+};
+
+/**
+ * Jobs whose results must be delivered in order, e.g. the frames of a connection
+ */
+struct crypto_stream {
+  struct crypto_job *head, *tail;
+  // listed as having finished jobs
+  int ready;
+  struct crypto_stream *next_ready;
+};
+
+struct crypto_pool *crypto_pool_new (void);
+
+/**
+ * Stop the workers once all queued jobs ran, the jobs that were not reaped are
+ * freed without calling done
+ */
+void crypto_pool_free (struct crypto_pool *P);
+
+/**
+ * Readable whenever jobs have finished, the event loop should then call
+ * crypto_pool_reap
+ */
+int crypto_pool_fd (struct crypto_pool *P);
+
+void crypto_pool_submit (struct crypto_pool *P, struct crypto_stream *S, struct crypto_job *J);
+
+/**
+ * Call done for all finished jobs whose predecessors are done, returns their number
+ */
+int crypto_pool_reap (struct crypto_pool *P);
+
+/**
+ * Same for the jobs of S only
+ */
+int crypto_stream_reap (struct crypto_pool *P, struct crypto_stream *S);
+
+/**
+ * Wait for all jobs of S and remove them without calling done, returns them
+ * linked by stream_next so that the owner can free them
+ */
+struct crypto_job *crypto_stream_drop (struct crypto_pool *P, struct crypto_stream *S);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * io_uring backend of the event loop
+ *
+ * Every source has at most one one-shot poll request in flight. Requests for all
+ * sources are queued in the submission ring and go to the kernel together with
+ * the wait for completions, so a wakeup that serves many connections costs a
+ * single system call.
+ */
+#ifdef HAVE_LIBURING
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <liburing.h>
+
+#include "event-loop.h"
+#include "tools.h"
+#include "msglog.h"
+
+#define URING_ENTRIES 256
+
+struct uring_state {
+  struct io_uring ring;
+};
+
+static struct io_uring_sqe *uring_get_sqe (struct event_loop *loop) {
+  struct uring_state *st = loop->backend_data;
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&st->ring);
+  if (!sqe) {
+    // submission ring full, hand the queued requests to the kernel first
+    loop->stats.syscalls ++;
+    io_uring_submit (&st->ring);
+    sqe = io_uring_get_sqe (&st->ring);
+  }
+  assert (sqe);
+  return sqe;
+}
+
+static unsigned poll_mask (int events) {
+  return ((events & EV_READ) ? POLLIN | POLLRDHUP : 0) | ((events & EV_WRITE) ? POLLOUT : 0);
+}
+
+static void uring_arm (struct event_loop *loop, struct event_source *s) {
+  struct io_uring_sqe *sqe = uring_get_sqe (loop);
+  io_uring_prep_poll_add (sqe, s->fd, poll_mask (s->events));
+  io_uring_sqe_set_data (sqe, s);
+  s->armed = 1;
+}
+
+static int uring_init (struct event_loop *loop) {
+  struct uring_state *st = talloc0 (sizeof (struct uring_state));
+  if (io_uring_queue_init (URING_ENTRIES, &st->ring, 0) < 0) {
+    tfree (st, sizeof (struct uring_state));
+    return -1;
+  }
+  loop->backend_data = st;
+  return 0;
+}
+
+static void uring_destroy (struct event_loop *loop) {
+  struct uring_state *st = loop->backend_data;
+  io_uring_queue_exit (&st->ring);
+  tfree (st, sizeof (struct uring_state));
+  loop->backend_data = 0;
+}
+
+static int uring_update (struct event_loop *loop, struct event_source *s) {
+  if (!s->armed) {
+    if (s->events) {
+      uring_arm (loop, s);
+    }
+    return 0;
+  }
+  // If the poll already completed the update fails, the completion is still
+  // waiting in the ring and the source is rearmed with its new mask from there.
+  struct io_uring_sqe *sqe = uring_get_sqe (loop);
+  if (s->events) {
+    io_uring_prep_poll_update (sqe, (unsigned long)s, (unsigned long)s, poll_mask (s->events),
+        IORING_POLL_UPDATE_EVENTS);
+  } else {
+    io_uring_prep_poll_remove (sqe, (unsigned long)s);
+  }
+  io_uring_sqe_set_data (sqe, 0);
+  return 0;
+}
+
+static void uring_remove (struct event_loop *loop, struct event_source *s) {
+  if (!s->armed) { return; }
+  // s->armed is cleared when the completion of the cancelled poll arrives
+  struct io_uring_sqe *sqe = uring_get_sqe (loop);
+  io_uring_prep_poll_remove (sqe, (unsigned long)s);
+  io_uring_sqe_set_data (sqe, 0);
+}
+
+static int uring_wait (struct event_loop *loop, double timeout) {
+  struct uring_state *st = loop->backend_data;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts;
+  ts.tv_sec = (long long)timeout;
+  ts.tv_nsec = (long long)((timeout - ts.tv_sec) * 1e9);
+
+  loop->stats.syscalls ++;
+  int r = io_uring_submit_and_wait_timeout (&st->ring, &cqe, 1, &ts, 0);
+  if (r < 0 && r != -ETIME && r != -EINTR) {
+    errno = -r;
+    return -1;
+  }
+
+  // collect first, handlers may queue new requests
+  struct {
+    struct event_source *s;
+    int events;
+  } ready[URING_ENTRIES];
+  int n = 0;
+  unsigned head;
+  unsigned seen = 0;
+  io_uring_for_each_cqe (&st->ring, head, cqe) {
+    seen ++;
+    struct event_source *s = io_uring_cqe_get_data (cqe);
+    if (!s) { continue; }
+    s->armed = 0;
+    int events = 0;
+    if (cqe->res > 0) {
+      if (cqe->res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR)) { events |= EV_READ; }
+      if (cqe->res & (POLLOUT | POLLERR)) { events |= EV_WRITE; }
+    }
+    ready[n].s = s;
+    ready[n].events = events;
+    if (++ n == URING_ENTRIES) { break; }
+  }
+  io_uring_cq_advance (&st->ring, seen);
+
+  int i;
+  for (i = 0; i < n; i++) {
+    struct event_source *s = ready[i].s;
+    if (ready[i].events) {
+      event_loop_dispatch (loop, s, ready[i].events);
+    }
+    if (!s->closed && !s->armed && s->events) {
+      uring_arm (loop, s);
+    }
+  }
+  return n;
+}
+
+const struct event_backend uring_backend = {
+  .name = "io_uring",
+  .init = uring_init,
+  .destroy = uring_destroy,
+  .update = uring_update,
+  .remove = uring_remove,
+  .wait = uring_wait
+};
+
+#endif
@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "include.h"
+#include "event-loop.h"
+#include "telegram.h"
+#include "net.h"
+#include "mtproto-client.h"
+#include "queries.h"
+#include "tools.h"
+#include "msglog.h"
+
+#define EVENT_LOOP_MAX_WAIT 10.0
+
+struct event_loop *event_loop_new (const char *name) {
+  const struct event_backend *backends[] = {
+#ifdef HAVE_LIBURING
+    &uring_backend,
+#endif
+    &epoll_backend,
+    0
+  };
+  struct event_loop *loop = talloc0 (sizeof (struct event_loop));
+  int i;
+  for (i = 0; backends[i]; i++) {
+    if (name && strcmp (name, backends[i]->name)) { continue; }
+    loop->backend = backends[i];
+    if (loop->backend->init (loop) >= 0) {
+      debug ("event loop: using %s backend\n", loop->backend->name);
+      return loop;
+    }
+    warning ("event loop: cannot initialize %s backend\n", loop->backend->name);
+  }
+  tfree (loop, sizeof (struct event_loop));
+  return 0;
+}
+
+static void free_dead_sources (struct event_loop *loop) {
+  struct event_source **p = &loop->dead;
+  while (*p) {
+    struct event_source *s = *p;
+    if (s->armed) {
+      p = &s->next_dead;
+    } else {
+      *p = s->next_dead;
+      tfree (s, sizeof (struct event_source));
+    }
+  }
+}
+
+void event_loop_free (struct event_loop *loop) {
+  loop->backend->destroy (loop);
+  while (loop->dead) {
+    struct event_source *s = loop->dead;
+    loop->dead = s->next_dead;
+    tfree (s, sizeof (struct event_source));
+  }
+  if (loop->instances) {
+    tfree (loop->instances, loop->instances_size * sizeof (void *));
+  }
+  tfree (loop, sizeof (struct event_loop));
+}
+
+struct event_source *event_loop_add (struct event_loop *loop, int fd, int events,
+    event_handler_t handler, void *data) {
+  struct event_source *s = talloc0 (sizeof (struct event_source));
+  s->fd = fd;
+  s->events = events;
+  s->handler = handler;
+  s->data = data;
+  if (loop->backend->update (loop, s) < 0) {
+    tfree (s, sizeof (struct event_source));
+    return 0;
+  }
+  return s;
+}
+
+void event_loop_set_events (struct event_loop *loop, struct event_source *s, int events) {
+  assert (!s->closed);
+  if (s->events == events) { return; }
+  s->events = events;
+  if (loop->backend->update (loop, s) < 0) {
+    warning ("event loop: cannot watch fd %d: %m\n", s->fd);
+  }
+}
+
+/**
+ * Stop watching s. The source is freed once the backend cannot report it anymore,
+ * so it is safe to call this from any handler.
+ */
+void event_loop_del (struct event_loop *loop, struct event_source *s) {
+  assert (!s->closed);
+  s->closed = 1;
+  loop->backend->remove (loop, s);
+  s->next_dead = loop->dead;
+  loop->dead = s;
+}
+
+void event_loop_dispatch (struct event_loop *loop, struct event_source *s, int events) {
+  if (s->closed) { return; }
+  events &= s->events;
+  if (!events) { return; }
+  loop->stats.events ++;
+  s->handler (loop, s, events);
+}
+
+int event_loop_run_once (struct event_loop *loop, double max_wait) {
+  double now = get_double_time ();
+  double next = now + max_wait;
+  int i;
+  for (i = 0; i < loop->instances_num; i++) {
+    double t = next_timer_in (loop->instances[i]);
+    if (t < next) { next = t; }
+  }
+  int r = loop->backend->wait (loop, next > now ? next - now : 0);
+  loop->stats.wakeups ++;
+  free_dead_sources (loop);
+
+  now = get_double_time ();
+  for (i = 0; i < loop->instances_num; i++) {
+    struct telegram *tg = loop->instances[i];
+    if (next_timer_in (tg) > now) { continue; }
+    loop->stats.timer_runs ++;
+    work_timers (tg);
+    telegram_flush (tg);
+    mtproto_free_closed (tg, 0);
+  }
+  return r;
+}
+
+void event_loop_run (struct event_loop *loop) {
+  loop->stop = 0;
+  while (!loop->stop) {
+    if (event_loop_run_once (loop, EVENT_LOOP_MAX_WAIT) < 0) {
+      warning ("event loop: %s wait failed: %m\n", loop->backend->name);
+      break;
+    }
+  }
+}
+
+void event_loop_stop (struct event_loop *loop) {
+  loop->stop = 1;
+}
+
+void event_loop_get_stats (struct event_loop *loop, struct event_loop_stats *st) {
+  *st = loop->stats;
+}
+
+static void crypto_ready (struct event_loop *loop UU, struct event_source *s, int events UU) {
+  telegram_crypto_ready (s->data);
+}
+
+void event_loop_attach (struct event_loop *loop, struct telegram *tg) {
+  assert (!tg->loop);
+  if (loop->instances_num == loop->instances_size) {
+    int size = loop->instances_size ? 2 * loop->instances_size : 16;
+    loop->instances = trealloc (loop->instances, loop->instances_size * sizeof (void *),
+        size * sizeof (void *));
+    loop->instances_size = size;
+  }
+  loop->instances[loop->instances_num ++] = tg;
+  tg->loop = loop;
+  tg->crypto_src = event_loop_add (loop, telegram_crypto_fd (tg), EV_READ, crypto_ready, tg);
+}
+
+void event_loop_detach (struct event_loop *loop, struct telegram *tg) {
+  int i;
+  for (i = 0; i < loop->instances_num; i++) {
+    if (loop->instances[i] == tg) {
+      loop->instances[i] = loop->instances[-- loop->instances_num];
+      break;
+    }
+  }
+  if (tg->crypto_src) {
+    event_loop_del (loop, tg->crypto_src);
+    tg->crypto_src = 0;
+  }
+  tg->loop = 0;
+}
+
+/*
+ * Connections of attached instances
+ */
+
+struct loop_handle {
+  struct event_loop *loop;
+  struct event_source *src;
+  struct telegram *tg;
+  struct proxy_request *req;
+  struct mtproto_connection *mtp;
+};
+
+static void connection_ready (struct event_loop *loop, struct event_source *s, int events) {
+  struct loop_handle *h = s->data;
+  struct telegram *tg = h->tg;
+  if (!h->mtp) { return; }
+
+  if (events & EV_WRITE) {
+    if (mtp_write_output (h->mtp) == 0) {
+      event_loop_set_events (loop, s, s->events & ~EV_WRITE);
+    }
+  }
+  if (events & EV_READ) {
+    mtp_read_input (h->mtp);
+  }
+  // processing of the answer may have inserted new queries
+  telegram_flush (tg);
+  // this may close the connection and free h
+  mtproto_free_closed (tg, 0);
+}
+
+/**
+ * The connection of req could not be established
+ */
+static void proxy_request_failed (struct telegram *tg, struct proxy_request *req) {
+  if (req->type == REQ_SESSION) {
+    // additional sessions are optional, the main session keeps working
+    telegram_session_failed (req);
+    return;
+  }
+  tfree (req, sizeof (struct proxy_request));
+  tg->config->on_error (tg, "cannot connect to data center");
+}
+
+static void connection_established (struct event_loop *loop, struct event_source *s, int events UU) {
+  struct loop_handle *h = s->data;
+  struct telegram *tg = h->tg;
+  int err = 0;
+  socklen_t len = sizeof (err);
+  if (getsockopt (s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+    err = errno;
+  }
+  if (err) {
+    warning ("event loop: cannot connect to %s:%d: %s\n", h->req->DC->ip, h->req->DC->port, strerror (err));
+    struct proxy_request *req = h->req;
+    event_loop_del (loop, s);
+    close (s->fd);
+    tfree (h, sizeof (struct loop_handle));
+    proxy_request_failed (tg, req);
+    return;
+  }
+
+  s->handler = connection_ready;
+  h->mtp = telegram_add_proxy (tg, h->req, s->fd, h);
+  event_loop_set_events (loop, s, EV_READ | (h->mtp->connection->out_bytes ? EV_WRITE : 0));
+}
+
+static int connect_nonblocking (const char *ip, int port) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  memset (&addr, 0, sizeof (addr));
+  struct sockaddr_in *a4 = (void *)&addr;
+  struct sockaddr_in6 *a6 = (void *)&addr;
+  if (inet_pton (AF_INET, ip, &a4->sin_addr) == 1) {
+    a4->sin_family = AF_INET;
+    a4->sin_port = htons (port);
+    addr_len = sizeof (*a4);
+  } else if (inet_pton (AF_INET6, ip, &a6->sin6_addr) == 1) {
+    a6->sin6_family = AF_INET6;
+    a6->sin6_port = htons (port);
+    addr_len = sizeof (*a6);
+  } else {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket (addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) { return -1; }
+  int flags = 1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof (flags));
+  if (connect (fd, (struct sockaddr *)&addr, addr_len) < 0 && errno != EINPROGRESS) {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * proxy_request_cb of instances driven by an event loop, connects directly to
+ * the requested data center
+ */
+void event_loop_proxy_request (struct telegram *tg, struct proxy_request *req) {
+  struct event_loop *loop = tg->loop;
+  assert (loop);
+  req->extra = tg;
+
+  int fd = connect_nonblocking (req->DC->ip, req->DC->port);
+  if (fd < 0) {
+    warning ("event loop: cannot connect to %s:%d: %m\n", req->DC->ip, req->DC->port);
+    proxy_request_failed (tg, req);
+    return;
+  }
+
+  struct loop_handle *h = talloc0 (sizeof (struct loop_handle));
+  h->loop = loop;
+  h->tg = tg;
+  h->req = req;
+  h->src = event_loop_add (loop, fd, EV_WRITE, connection_established, h);
+  if (!h->src) {
+    warning ("event loop: cannot watch fd %d: %m\n", fd);
+    close (fd);
+    tfree (h, sizeof (struct loop_handle));
+    proxy_request_failed (tg, req);
+  }
+}
+
+void event_loop_proxy_close (void *handle) {
+  struct loop_handle *h = handle;
+  debug ("event loop: closing fd %d\n", h->src->fd);
+  int fd = h->src->fd;
+  event_loop_del (h->loop, h->src);
+  close (fd);
+  tfree (h, sizeof (struct loop_handle));
+}
+
+void event_loop_on_output (void *handle) {
+  struct loop_handle *h = handle;
+  // output queued while connecting is picked up once the connection is established
+  if (!h->mtp) { return; }
+  event_loop_set_events (h->loop, h->src, h->src->events | EV_WRITE);
+}
+
+/*
+ * epoll backend
+ */
+
+#define EPOLL_MAX_EVENTS 256
+
+struct epoll_state {
+  int epfd;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+};
+
+static int epoll_init (struct event_loop *loop) {
+  int fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (fd < 0) { return -1; }
+  struct epoll_state *st = talloc0 (sizeof (struct epoll_state));
+  st->epfd = fd;
+  loop->backend_data = st;
+  return 0;
+}
+
+static void epoll_destroy (struct event_loop *loop) {
+  struct epoll_state *st = loop->backend_data;
+  close (st->epfd);
+  tfree (st, sizeof (struct epoll_state));
+  loop->backend_data = 0;
+}
+
+static int epoll_update (struct event_loop *loop, struct event_source *s) {
+  struct epoll_state *st = loop->backend_data;
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = ((s->events & EV_READ) ? EPOLLIN | EPOLLRDHUP : 0) | ((s->events & EV_WRITE) ? EPOLLOUT : 0);
+  ev.data.ptr = s;
+  loop->stats.syscalls ++;
+  if (epoll_ctl (st->epfd, s->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+    return -1;
+  }
+  s->armed = 1;
+  return 0;
+}
+
+static void epoll_remove (struct event_loop *loop, struct event_source *s) {
+  struct epoll_state *st = loop->backend_data;
+  if (!s->armed) { return; }
+  loop->stats.syscalls ++;
+  epoll_ctl (st->epfd, EPOLL_CTL_DEL, s->fd, 0);
+  s->armed = 0;
+}
+
+static int epoll_wait_events (struct event_loop *loop, double timeout) {
+  struct epoll_state *st = loop->backend_data;
+  int ms = timeout * 1000 >= INT_MAX ? INT_MAX : (int)(timeout * 1000 + 0.999);
+  loop->stats.syscalls ++;
+  int n = epoll_wait (st->epfd, st->events, EPOLL_MAX_EVENTS, ms);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  int i;
+  for (i = 0; i < n; i++) {
+    int e = st->events[i].events;
+    int events = 0;
+    // errors and hangups are reported through the handler that reads or writes
+    if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) { events |= EV_READ; }
+    if (e & (EPOLLOUT | EPOLLERR)) { events |= EV_WRITE; }
+    event_loop_dispatch (loop, st->events[i].data.ptr, events);
+  }
+  return n;
+}
+
+const struct event_backend epoll_backend = {
+  .name = "epoll",
+  .init = epoll_init,
+  .destroy = epoll_destroy,
+  .update = epoll_update,
+  .remove = epoll_remove,
+  .wait = epoll_wait_events
+};
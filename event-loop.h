@@ -0,0 +1,131 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+/*
+ * Event loop
+ *
+ * Drives fd readiness and the timers of any number of telegram instances without
+ * the libpurple main loop. The readiness notification is done by an exchangeable
+ * backend, epoll is always available, io_uring when built with USE_LIBURING.
+ */
+
+#define EV_READ 1
+#define EV_WRITE 2
+
+struct event_loop;
+struct event_source;
+struct telegram;
+struct proxy_request;
+
+typedef void (*event_handler_t) (struct event_loop *loop, struct event_source *s, int events);
+
+/**
+ * A file descriptor watched by the loop
+ */
+struct event_source {
+  int fd;
+  // EV_READ and/or EV_WRITE
+  int events;
+  event_handler_t handler;
+  void *data;
+
+  // set while the backend may still report the source
+  int armed;
+  int closed;
+  struct event_source *next_dead;
+};
+
+/**
+ * Readiness notification backend
+ */
+struct event_backend {
+  const char *name;
+  int (*init) (struct event_loop *loop);
+  void (*destroy) (struct event_loop *loop);
+
+  /**
+   * Start watching s or apply a change of s->events
+   */
+  int (*update) (struct event_loop *loop, struct event_source *s);
+
+  /**
+   * Stop watching s, the backend clears s->armed once it is done with it
+   */
+  void (*remove) (struct event_loop *loop, struct event_source *s);
+
+  /**
+   * Wait at most timeout seconds and call the handlers of all ready sources,
+   * returns the number of dispatched events or -1 on error
+   */
+  int (*wait) (struct event_loop *loop, double timeout);
+};
+
+struct event_loop_stats {
+  // returns from the backend wait
+  long long wakeups;
+  // dispatched fd events
+  long long events;
+  // instances that had expired timers
+  long long timer_runs;
+  // system calls made by the backend
+  long long syscalls;
+};
+
+struct event_loop {
+  const struct event_backend *backend;
+  void *backend_data;
+
+  struct telegram **instances;
+  int instances_num;
+  int instances_size;
+
+  struct event_source *dead;
+  int stop;
+  struct event_loop_stats stats;
+};
+
+extern const struct event_backend epoll_backend;
+#ifdef HAVE_LIBURING
+extern const struct event_backend uring_backend;
+#endif
+
+/**
+ * Create a loop using the backend called name, or the best available one if
+ * name is NULL
+ */
+struct event_loop *event_loop_new (const char *name);
+void event_loop_free (struct event_loop *loop);
+
+struct event_source *event_loop_add (struct event_loop *loop, int fd, int events,
+    event_handler_t handler, void *data);
+void event_loop_set_events (struct event_loop *loop, struct event_source *s, int events);
+void event_loop_del (struct event_loop *loop, struct event_source *s);
+
+/**
+ * Dispatch events and expired timers once, waiting at most max_wait seconds
+ */
+int event_loop_run_once (struct event_loop *loop, double max_wait);
+void event_loop_run (struct event_loop *loop);
+void event_loop_stop (struct event_loop *loop);
+
+/**
+ * Called by the backends for every ready source
+ */
+void event_loop_dispatch (struct event_loop *loop, struct event_source *s, int events);
+
+void event_loop_get_stats (struct event_loop *loop, struct event_loop_stats *st);
+
+/**
+ * Let the loop drive the connections and timers of tg
+ *
+ * The telegram_config of tg must use event_loop_proxy_request,
+ * event_loop_proxy_close and event_loop_on_output as callbacks.
+ */
+void event_loop_attach (struct event_loop *loop, struct telegram *tg);
+void event_loop_detach (struct event_loop *loop, struct telegram *tg);
+
+void event_loop_proxy_request (struct telegram *tg, struct proxy_request *req);
+void event_loop_proxy_close (void *handle);
+void event_loop_on_output (void *handle);
+
+#endif
@@ -0,0 +1,365 @@
+# Generates the fetch_skip_* and fetch_tl_* functions from a TL schema
+#
+#   awk -f gen_skip_c.awk skip.tl > tl-skip.c
+#   awk -v header=1 -f gen_skip_c.awk skip.tl > tl-skip.h
+#
+# Every type gets a skipper that checks the constructor and steps over its
+# fields. Runs of int, long and double fields are skipped at once, types whose
+# constructors all have the same fixed size are skipped by size and so are
+# vectors of them.
+#
+# Every type also gets a decoder that fills a struct tl_<type> with the fields of
+# all its constructors and the constructor in magic. Only the members of that
+# constructor are set, the struct is not cleared first as it holds the members of
+# every constructor. Runs of int, long and double fields are read from one span.
+# Strings and vectors are not copied, they point into the input and are only
+# valid as long as it is.
+function code(c) {
+  gsub (/[A-Z]/, "_&", c);
+  gsub (/[.]/, "_", c);
+  return "CODE_" tolower(c);
+}
+function snake(t) {
+  gsub (/[A-Z]/, "_&", t);
+  sub (/^_/, "", t);
+  return tolower(t);
+}
+function skipper(t) {
+  return "fetch_skip_" snake(t);
+}
+function decoder(t) {
+  return "fetch_tl_" snake(t);
+}
+# name of a field in C, fields may be named like C keywords
+function member(n) {
+  if (n in keyword) { return n "_"; }
+  return n;
+}
+function ctype(t) {
+  if (t == "int") { return "int"; }
+  if (t == "long") { return "long long"; }
+  if (t == "double") { return "double"; }
+  if (t == "string" || t == "bytes") { return "struct tl_str"; }
+  if (vector_of(t) != "") { return "struct tl_vector"; }
+  return "struct tl_" snake(t);
+}
+function flush_span() {
+  if (span_num) {
+    print "    fetch_span (mtp, " span_ints ");";
+    for (q = 0; q < span_num; q++) {
+      print "    R->" span_field[q] " = span_" span_type[q] " (mtp);";
+    }
+    span_num = 0;
+    span_ints = 0;
+  }
+}
+# print struct tl_<t> after the structs it contains
+function print_struct(t,   j, c, i, ft, n, k) {
+  if (t in printed) { return; }
+  printed[t] = 1;
+  for (j = 0; j < cons_num[t]; j++) {
+    c = cons[t, j];
+    for (i = 0; i < fields_num[c]; i++) {
+      ft = field[c, i];
+      if (ft in cons_num) { print_struct(ft); }
+    }
+  }
+  print "";
+  print "struct tl_" snake(t) " {";
+  print "  unsigned magic;";
+  for (k = 0; k < members_num[t]; k++) {
+    n = members[t, k];
+    print "  " ctype(member_type[t, n]) " " member(n) ";";
+  }
+  print "};";
+}
+# size of a field in ints, -1 if it has to be parsed
+function field_size(t) {
+  if (t in base) { return base[t]; }
+  if (t in size) { return size[t]; }
+  return -1;
+}
+function vector_of(t) {
+  if (t !~ /^Vector<.*>$/) { return ""; }
+  return substr (t, 8, length (t) - 8);
+}
+function flush_skip() {
+  if (pending) {
+    print "    fetch_skip (mtp, " pending ");";
+    pending = 0;
+  }
+}
+function license() {
+  print "/*";
+  print "    This file is part of telegram-client.";
+  print "";
+  print "    Telegram-client is free software: you can redistribute it and/or modify";
+  print "    it under the terms of the GNU General Public License as published by";
+  print "    the Free Software Foundation, either version 2 of the License, or";
+  print "    (at your option) any later version.";
+  print "";
+  print "    Telegram-client is distributed in the hope that it will be useful,";
+  print "    but WITHOUT ANY WARRANTY; without even the implied warranty of";
+  print "    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the";
+  print "    GNU General Public License for more details.";
+  print "";
+  print "    You should have received a copy of the GNU General Public License";
+  print "    along with this telegram-client.  If not, see <http://www.gnu.org/licenses/>.";
+  print "";
+  print "    Copyright Vitaly Valtman 2013";
+  print "*/";
+  print "";
+  print "// Generated by gen_skip_c.awk from skip.tl, do not edit";
+}
+BEGIN {
+  base["int"] = 1;
+  base["long"] = 2;
+  base["double"] = 2;
+  base["string"] = -1;
+  base["bytes"] = -1;
+  keyword["long"] = 1;
+  keyword["int"] = 1;
+  keyword["double"] = 1;
+  keyword["char"] = 1;
+  keyword["short"] = 1;
+  keyword["default"] = 1;
+}
+/^[ \t]*(\/\/|$)/ { next; }
+{
+  if (split ($1, a, "#") != 2 || $(NF - 1) != "=" || $NF !~ /;$/) {
+    print "ERROR: cannot parse line " NR ": " $0 >"/dev/stderr";
+    exit 1;
+  }
+  t = $NF;
+  sub (/;$/, "", t);
+  if (!(t in cons_num)) {
+    types[types_num ++] = t;
+    cons_num[t] = 0;
+  }
+  c = a[1];
+  cons[t, cons_num[t] ++] = c;
+  fields_num[c] = 0;
+  for (i = 2; i < NF - 1; i++) {
+    if (split ($i, f, ":") != 2) {
+      print "ERROR: bad field " $i " in line " NR >"/dev/stderr";
+      exit 1;
+    }
+    field_name[c, fields_num[c]] = f[1];
+    field[c, fields_num[c] ++] = f[2];
+    # the struct of t holds the fields of all its constructors
+    if ((t, f[1]) in member_type) {
+      if (member_type[t, f[1]] != f[2]) {
+        print "ERROR: field " f[1] " of " t " has different types in line " NR >"/dev/stderr";
+        exit 1;
+      }
+    } else {
+      member_type[t, f[1]] = f[2];
+      members[t, members_num[t] ++] = f[1];
+    }
+  }
+}
+END {
+  # sizes of the fixed types, nested types may be defined later in the schema
+  do {
+    changed = 0;
+    for (k = 0; k < types_num; k++) {
+      t = types[k];
+      if (t in size) { continue; }
+      s = -2;
+      for (j = 0; j < cons_num[t] && s != -1; j++) {
+        c = cons[t, j];
+        cs = 1;
+        for (i = 0; i < fields_num[c]; i++) {
+          fs = field_size(field[c, i]);
+          if (fs < 0) { cs = -1; break; }
+          cs += fs;
+        }
+        if (s == -2) { s = cs; } else if (s != cs) { s = -1; }
+      }
+      if (s > 0) {
+        size[t] = s;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  license();
+  if (header) {
+    print "#ifndef __TL_SKIP_H__";
+    print "#define __TL_SKIP_H__";
+    print "";
+    print "struct mtproto_connection;";
+    print "";
+    print "struct tl_str {";
+    print "  int len;";
+    print "  char *data;";
+    print "};";
+    print "";
+    print "// the elements are left in the input at data, decode them from there";
+    print "struct tl_vector {";
+    print "  int n;";
+    print "  int *data;";
+    print "};";
+    for (k = 0; k < types_num; k++) {
+      print_struct(types[k]);
+    }
+    print "";
+    for (k = 0; k < types_num; k++) {
+      print "void " skipper(types[k]) " (struct mtproto_connection *mtp);";
+    }
+    print "";
+    for (k = 0; k < types_num; k++) {
+      t = types[k];
+      print "void " decoder(t) " (struct mtproto_connection *mtp, struct tl_" snake(t) " *R);";
+    }
+    print "";
+    print "#endif";
+    exit 0;
+  }
+
+  print "#include <assert.h>";
+  print "";
+  print "#include \"mtproto-client.h\"";
+  print "#include \"constants.h\"";
+  print "#include \"msglog.h\"";
+  print "#include \"tl-skip.h\"";
+  for (k = 0; k < types_num; k++) {
+    t = types[k];
+    print "";
+    print "void " skipper(t) " (struct mtproto_connection *mtp) {";
+    print "  unsigned x = fetch_int (mtp);";
+    if (t in size) {
+      s = "";
+      for (j = 0; j < cons_num[t]; j++) {
+        s = s (j ? " || " : "") "x == " code(cons[t, j]);
+      }
+      print "  assert (" s ");";
+      if (size[t] > 1) {
+        print "  fetch_skip (mtp, " (size[t] - 1) ");";
+      }
+      print "}";
+      continue;
+    }
+    # declarations for the vectors
+    need_n = 0;
+    need_i = 0;
+    for (j = 0; j < cons_num[t]; j++) {
+      c = cons[t, j];
+      for (i = 0; i < fields_num[c]; i++) {
+        v = vector_of(field[c, i]);
+        if (v == "") { continue; }
+        need_n = 1;
+        if (field_size(v) < 0) { need_i = 1; }
+      }
+    }
+    if (need_n) { print "  int n;"; }
+    if (need_i) { print "  int i;"; }
+    print "  switch (x) {";
+    for (j = 0; j < cons_num[t]; j++) {
+      c = cons[t, j];
+      print "  case " code(c) ":";
+      pending = 0;
+      for (i = 0; i < fields_num[c]; i++) {
+        ft = field[c, i];
+        v = vector_of(ft);
+        if (ft in base && base[ft] > 0) {
+          pending += base[ft];
+        } else if (ft == "string" || ft == "bytes") {
+          flush_skip();
+          print "    fetch_skip_str (mtp);";
+        } else if (v != "") {
+          flush_skip();
+          print "    assert (fetch_int (mtp) == (int)CODE_vector);";
+          print "    n = fetch_int (mtp);";
+          if (field_size(v) == 1) {
+            print "    assert (n >= 0 && n <= mtp->in_end - mtp->in_ptr);";
+            print "    fetch_skip (mtp, n);";
+          } else if (field_size(v) > 0) {
+            print "    assert (n >= 0 && n <= (mtp->in_end - mtp->in_ptr) / " field_size(v) ");";
+            print "    fetch_skip (mtp, n * " field_size(v) ");";
+          } else if (v in cons_num) {
+            print "    for (i = 0; i < n; i++) {";
+            print "      " skipper(v) " (mtp);";
+            print "    }";
+          } else {
+            print "ERROR: unknown type " v " in " c >"/dev/stderr";
+            exit 1;
+          }
+        } else if (ft in cons_num) {
+          flush_skip();
+          print "    " skipper(ft) " (mtp);";
+        } else {
+          print "ERROR: unknown type " ft " in " c >"/dev/stderr";
+          exit 1;
+        }
+      }
+      flush_skip();
+      print "    break;";
+    }
+    print "  default:";
+    print "    debug (\"" skipper(t) ": type = 0x%08x\\n\", x);";
+    print "    assert (0);";
+    print "  }";
+    print "}";
+  }
+  for (k = 0; k < types_num; k++) {
+    t = types[k];
+    print "";
+    print "void " decoder(t) " (struct mtproto_connection *mtp, struct tl_" snake(t) " *R) {";
+    need_i = 0;
+    for (j = 0; j < cons_num[t]; j++) {
+      c = cons[t, j];
+      for (i = 0; i < fields_num[c]; i++) {
+        v = vector_of(field[c, i]);
+        if (v != "" && field_size(v) < 0) { need_i = 1; }
+      }
+    }
+    if (need_i) { print "  int i;"; }
+    print "  R->magic = fetch_int (mtp);";
+    print "  switch (R->magic) {";
+    for (j = 0; j < cons_num[t]; j++) {
+      c = cons[t, j];
+      print "  case " code(c) ":";
+      span_num = 0;
+      span_ints = 0;
+      for (i = 0; i < fields_num[c]; i++) {
+        ft = field[c, i];
+        m = member(field_name[c, i]);
+        if (ft in base && base[ft] > 0) {
+          span_field[span_num] = m;
+          span_type[span_num ++] = ft;
+          span_ints += base[ft];
+        } else if (ft == "string" || ft == "bytes") {
+          flush_span();
+          print "    R->" m ".len = prefetch_strlen (mtp);";
+          print "    R->" m ".data = fetch_str (mtp, R->" m ".len);";
+        } else if (vector_of(ft) != "") {
+          flush_span();
+          v = vector_of(ft);
+          print "    assert (fetch_int (mtp) == (int)CODE_vector);";
+          print "    R->" m ".n = fetch_int (mtp);";
+          print "    R->" m ".data = mtp->in_ptr;";
+          if (field_size(v) > 0) {
+            print "    assert (R->" m ".n >= 0 && R->" m ".n <= (mtp->in_end - mtp->in_ptr) / " field_size(v) ");";
+            print "    fetch_skip (mtp, R->" m ".n * " field_size(v) ");";
+          } else {
+            print "    assert (R->" m ".n >= 0);";
+            print "    for (i = 0; i < R->" m ".n; i++) {";
+            print "      " skipper(v) " (mtp);";
+            print "    }";
+          }
+        } else {
+          flush_span();
+          print "    " decoder(ft) " (mtp, &R->" m ");";
+        }
+      }
+      flush_span();
+      print "    break;";
+    }
+    print "  default:";
+    print "    debug (\"" decoder(t) ": type = 0x%08x\\n\", R->magic);";
+    print "    assert (0);";
+    print "  }";
+    print "}";
+  }
+}
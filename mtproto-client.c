@@ -40,6 +40,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "telegram.h"
 #include "net.h"
@@ -57,19 +58,16 @@
 #define __builtin_bswap32(x) __swap32gen(x)
 #endif
 
-#define sha1 SHA1
 
 #include "mtproto-client.h"
 
 #define MAX_NET_RES        (1L << 16)
 int log_level = 2;
 
-
-int verbosity = 0;
 int allow_weak_random = 0;
 int disable_auto_accept = 0;
 
-int rpc_execute (struct connection *c, int op, int len);
+int rpc_execute (struct connection *c, int op, int len, char *Response);
 int rpc_becomes_ready (struct connection *c);
 int rpc_close (struct connection *c);
 
@@ -79,16 +77,10 @@ struct connection_methods auth_methods = {
   .close = rpc_close
 };
 
-long long precise_time;
-
 double get_utime (int clock_id) {
   struct timespec T;
   my_clock_gettime (clock_id, &T);
-  double res = T.tv_sec + (double) T.tv_nsec * 1e-9;
-  if (clock_id == CLOCK_REALTIME) {
-    precise_time = (long long) (res * (1LL << 32));
-  }
-  return res;
+  return T.tv_sec + (double) T.tv_nsec * 1e-9;
 }
 
 void secure_random (void *s, int l) {
@@ -102,15 +94,8 @@ void secure_random (void *s, int l) {
 }
 
 
-#define STATS_BUFF_SIZE        (64 << 10)
-int stats_buff_len;
-char stats_buff[STATS_BUFF_SIZE];
-
 #define MAX_RESPONSE_SIZE        (1L << 24)
 
-char Response[MAX_RESPONSE_SIZE];
-int Response_len;
-
 /*
  *
  *                STATE MACHINE
@@ -119,8 +104,11 @@ int Response_len;
 
 #define TG_SERVER_PUBKEY_FILENAME "/etc/telegram-purple/server.pub"
 char *rsa_public_key_name = 0; 
-RSA *pubKey;
-long long pk_fingerprint;
+
+// loaded once by the first connection and only read afterwards
+static RSA *pubKey;
+static long long pk_fingerprint;
+static pthread_once_t pubkey_once = PTHREAD_ONCE_INIT;
 
 static int rsa_load_public_key (const char *public_key_name) {
   pubKey = NULL;
@@ -154,13 +142,36 @@ int auth_work_start (struct connection *c);
  */
 
 
+static int *dh_buffer (int **b) {
+  if (!*b) {
+    *b = talloc (ENCRYPT_BUFFER_INTS * 4);
+  }
+  return *b;
+}
+
+static void dh_buffers_free (struct mtproto_connection *self) {
+  if (self->encrypt_buffer) {
+    tfree (self->encrypt_buffer, ENCRYPT_BUFFER_INTS * 4);
+    self->encrypt_buffer = 0;
+  }
+  if (self->decrypt_buffer) {
+    tfree (self->decrypt_buffer, DECRYPT_BUFFER_INTS * 4);
+    self->decrypt_buffer = 0;
+  }
+}
+
 int encrypt_packet_buffer (struct mtproto_connection *self) {
+  dh_buffer (&self->encrypt_buffer);
+  // the padding is written behind the packet
+  packet_reserve (self, 72);
   return pad_rsa_encrypt (self, (char *) self->packet_buffer, (self->packet_ptr - self->packet_buffer) * 4, (char *) self->encrypt_buffer, 
     ENCRYPT_BUFFER_INTS * 4, pubKey->n, pubKey->e);
 }
 
 int encrypt_packet_buffer_aes_unauth (struct mtproto_connection *self, const char server_nonce[16], const char hidden_client_nonce[32]) {
   init_aes_unauth (self, server_nonce, hidden_client_nonce, AES_ENCRYPT);
+  dh_buffer (&self->encrypt_buffer);
+  packet_reserve (self, 4);
   return pad_aes_encrypt (self, (char *) self->packet_buffer, (self->packet_ptr - self->packet_buffer) * 4, 
     (char *) self->encrypt_buffer, ENCRYPT_BUFFER_INTS * 4);
 }
@@ -198,25 +209,33 @@ int rpc_send_packet (struct connection *c) {
   return 1;
 }
 
-int rpc_send_message (struct connection *c, void *data, int len) {
-  struct mtproto_connection *self = c->mtconnection;
-
-  //debug("rpc_send_message(...)\n");
+/**
+ * Reserve room for an abridged frame of len bytes at the end of the output chain
+ * and write its length prefix, the returned pointer is where the payload goes.
+ */
+char *rpc_reserve_frame (struct connection *c, int len, int *prefix_len) {
   assert (len > 0 && !(len & 0xfc000003));
   int total_len = len >> 2;
+  char *dest = reserve_out (c, len + 4);
   if (total_len < 0x7f) {
-    assert (write_out (c, &total_len, 1) == 1);
+    *dest = total_len;
+    *prefix_len = 1;
   } else {
     total_len = (total_len << 8) | 0x7f;
-    assert (write_out (c, &total_len, 4) == 4);
+    memcpy (dest, &total_len, 4);
+    *prefix_len = 4;
   }
+  return dest + *prefix_len;
+}
+
+void rpc_commit_frame (struct connection *c, int len, int prefix_len) {
+  struct mtproto_connection *self = c->mtconnection;
+  commit_out (c, len + prefix_len);
   c->out_packet_num ++;
-  assert (write_out (c, data, len) == len);
   flush_out (c);
 
   self->total_packets_sent ++;
-  self->total_data_sent += total_len;
-  return 1;
+  self->total_data_sent += len >> 2;
 }
 
 int send_req_pq_packet (struct connection *c) {
@@ -330,6 +349,7 @@ int process_respq_answer (struct connection *c, char *packet, int len) {
   }
   // create inner part (P_Q_inner_data)
   clear_packet (self);
+  packet_reserve (self, 5);
   self->packet_ptr += 5;
   out_int (self, CODE_p_q_inner_data);
   out_cstring (self, packet + 57, clen);
@@ -463,7 +483,7 @@ int check_DH_params (struct mtproto_connection *self, BIGNUM *p, int g) {
 }
 
 int check_g (unsigned char p[256], BIGNUM *g) {
-  static unsigned char s[256];
+  unsigned char s[256];
   memset (s, 0, 256);
   assert (BN_num_bytes (g) <= 256);
   BN_bn2bin (g, s);
@@ -499,7 +519,7 @@ int check_g (unsigned char p[256], BIGNUM *g) {
 }
 
 int check_g_bn (BIGNUM *p, BIGNUM *g) {
-  static unsigned char s[256];
+  unsigned char s[256];
   memset (s, 0, 256);
   assert (BN_num_bytes (p) <= 256);
   BN_bn2bin (p, s);
@@ -524,6 +544,7 @@ int process_dh_answer (struct connection *c, char *packet, int len) {
   self->in_end = (int *)(packet + len);
   int l = prefetch_strlen (self);
   assert (l > 0);
+  dh_buffer (&self->decrypt_buffer);
   l = pad_aes_decrypt (self, fetch_str (self, l), l, (char *) self->decrypt_buffer, DECRYPT_BUFFER_INTS * 4 - 16);
   assert (self->in_ptr == self->in_end);
   assert (l >= 60);
@@ -543,7 +564,7 @@ int process_dh_answer (struct connection *c, char *packet, int len) {
 
   assert (check_DH_params (self, &self->dh_prime, g) >= 0);
 
-  static char sha1_buffer[20];
+  char sha1_buffer[20];
   sha1 ((unsigned char *) self->decrypt_buffer + 20, (self->in_ptr - self->decrypt_buffer - 5) * 4, (unsigned char *) sha1_buffer);
   assert (!memcmp (self->decrypt_buffer, sha1_buffer, 20));
   assert ((char *) self->in_end - (char *) self->in_ptr < 16);
@@ -554,6 +575,7 @@ int process_dh_answer (struct connection *c, char *packet, int len) {
 
   // Build set_client_DH_params answer
   clear_packet (self);
+  packet_reserve (self, 5);
   self->packet_ptr += 5;
   out_int (self, CODE_client_DH_inner_data);
   out_ints (self, (int *) self->nonce, 4);
@@ -615,7 +637,7 @@ int process_auth_complete (struct connection *c, char *packet, int len) {
   assert (*(int *) (packet + 20) == CODE_dh_gen_ok);
   assert (!memcmp (packet + 24, self->nonce, 16));
   assert (!memcmp (packet + 40, self->server_nonce, 16));
-  static unsigned char tmp[44], sha1_buffer[20];
+  unsigned char tmp[44], sha1_buffer[20];
   memcpy (tmp, self->new_nonce, 32);
   tmp[32] = 1;
   //GET_DC(c)->auth_key_id = *(long long *)(sha1_buffer + 12);
@@ -635,6 +657,7 @@ int process_auth_complete (struct connection *c, char *packet, int len) {
   //sleep (1);
 
   self->c_state = st_authorized;
+  dh_buffers_free (self);
   //return 1;
   debug ( "Auth success\n");
   self->auth_success ++;
@@ -666,28 +689,43 @@ long long generate_next_msg_id (struct mtproto_connection *self, struct dc *DC)
   return next_id;
 }
 
+/**
+ * Make room for a message of msg_ints ints in the encryption buffer
+ */
+static void enc_msg_reserve (struct mtproto_connection *self, int msg_ints) {
+  if (self->enc_msg && self->enc_msg_ints >= msg_ints) { return; }
+  int n = self->enc_msg_ints ? self->enc_msg_ints : PACKET_BUFFER_MIN;
+  while (n < msg_ints) { n *= 2; }
+  if (n > MAX_MESSAGE_INTS) { n = MAX_MESSAGE_INTS; }
+  if (self->enc_msg) {
+    tfree (self->enc_msg, sizeof (struct encrypted_message) + self->enc_msg_ints * 4);
+  }
+  self->enc_msg = talloc0 (sizeof (struct encrypted_message) + n * 4);
+  self->enc_msg_ints = n;
+}
+
 void init_enc_msg (struct mtproto_connection *self, struct session *S, int useful) {
   struct dc *DC = S->dc;
   assert (DC->auth_key_id);
-  self->enc_msg.auth_key_id = DC->auth_key_id;
+  self->enc_msg->auth_key_id = DC->auth_key_id;
 //  assert (DC->server_salt);
-  self->enc_msg.server_salt = DC->server_salt;
+  self->enc_msg->server_salt = DC->server_salt;
   if (!S->session_id) {
     secure_random (&S->session_id, 8);
   }
-  self->enc_msg.session_id = S->session_id;
+  self->enc_msg->session_id = S->session_id;
   //enc_msg.auth_key_id2 = auth_key_id;
-  self->enc_msg.msg_id = generate_next_msg_id (self, DC);
+  self->enc_msg->msg_id = generate_next_msg_id (self, DC);
   //enc_msg.msg_id -= 0x10000000LL * (lrand48 () & 15);
   //kprintf ("message id %016llx\n", enc_msg.msg_id);
-  self->enc_msg.seq_no = S->seq_no;
+  self->enc_msg->seq_no = S->seq_no;
   if (useful) {
-    self->enc_msg.seq_no |= 1;
+    self->enc_msg->seq_no |= 1;
   }
   S->seq_no += 2;
 };
 
-int aes_encrypt_message (struct mtproto_connection *self, struct dc *DC, struct encrypted_message *enc) {
+int aes_encrypt_message (struct mtproto_connection *self, struct dc *DC, struct encrypted_message *enc, char *to, int size) {
   unsigned char sha1_buffer[20];
   const int MINSZ = offsetof (struct encrypted_message, message);
   const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
@@ -695,13 +733,13 @@ int aes_encrypt_message (struct mtproto_connection *self, struct dc *DC, struct
   assert (enc->msg_len >= 0 && enc->msg_len <= MAX_MESSAGE_INTS * 4 - 16 && !(enc->msg_len & 3));
   sha1 ((unsigned char *) &enc->server_salt, enc_len, sha1_buffer);
   //printf ("enc_len is %d\n", enc_len);
-  if (verbosity >= 2) {
+  if (self->verbosity >= 2) {
     debug ( "sending message with sha1 %08x\n", *(int *)sha1_buffer);
   }
   memcpy (enc->msg_key, sha1_buffer + 4, 16);
   init_aes_auth (self, DC->auth_key, enc->msg_key, AES_ENCRYPT);
   //hexdump ((char *)enc, (char *)enc + enc_len + 24);
-  return pad_aes_encrypt (self, (char *) &enc->server_salt, enc_len, (char *) &enc->server_salt, MAX_MESSAGE_INTS * 4 + (MINSZ - UNENCSZ));
+  return pad_aes_encrypt (self, (char *) &enc->server_salt, enc_len, to, size);
 }
 
 long long encrypt_send_message (struct mtproto_connection *self, int *msg, int msg_ints, int useful) {
@@ -711,30 +749,49 @@ long long encrypt_send_message (struct mtproto_connection *self, int *msg, int m
   struct dc *DC = GET_DC(c);
   struct session *S = c->session;
   assert (S);
+  const int MINSZ = offsetof (struct encrypted_message, message);
   const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
   if (msg_ints <= 0 || msg_ints > MAX_MESSAGE_INTS - 4) {
     return -1;
   }
   if (msg) {
-    memcpy (self->enc_msg.message, msg, msg_ints * 4);
-    self->enc_msg.msg_len = msg_ints * 4;
+    // pad_aes_encrypt pads the message in place
+    enc_msg_reserve (self, msg_ints + 4);
+    memcpy (self->enc_msg->message, msg, msg_ints * 4);
+    self->enc_msg->msg_len = msg_ints * 4;
   } else {
-    if ((self->enc_msg.msg_len & 0x80000003) || self->enc_msg.msg_len > MAX_MESSAGE_INTS * 4 - 16) {
+    if (!self->enc_msg || (self->enc_msg->msg_len & 0x80000003) || self->enc_msg->msg_len > self->enc_msg_ints * 4 - 16) {
       return -1;
     }
   }
   init_enc_msg (self, S, useful);
 
+  // encrypt straight into the output chain, the frame is never copied again
+  int len = UNENCSZ + (((MINSZ - UNENCSZ) + self->enc_msg->msg_len + 15) & -16);
+  int prefix_len;
+  char *dest = rpc_reserve_frame (c, len, &prefix_len);
   //hexdump ((char *)msg, (char *)msg + (msg_ints * 4));
-  int l = aes_encrypt_message (self, DC, &self->enc_msg);
-  //hexdump ((char *)&enc_msg, (char *)&enc_msg + l  + 24);
-  assert (l > 0);
-  rpc_send_message (c, &self->enc_msg, l + UNENCSZ);
+  int l = aes_encrypt_message (self, DC, self->enc_msg, dest + UNENCSZ, len - UNENCSZ);
+  assert (l > 0 && l + UNENCSZ == len);
+  memcpy (dest, self->enc_msg, UNENCSZ);
+  rpc_commit_frame (c, len, prefix_len);
   
   return self->client_last_msg_id;
 }
 
 
+/**
+ * Allocate msg_id and seq_no of a message that is sent inside a container of
+ * the session of self
+ */
+long long reserve_msg_id (struct mtproto_connection *self, int useful, int *seq_no) {
+  struct session *S = self->connection->session;
+  long long msg_id = generate_next_msg_id (self, S->dc);
+  *seq_no = useful ? S->seq_no | 1 : S->seq_no;
+  S->seq_no += 2;
+  return msg_id;
+}
+
 int auth_work_start (struct connection *c UU) {
   return 1;
 }
@@ -895,11 +952,10 @@ void work_update (struct mtproto_connection *self, long long msg_id UU) {
   case CODE_update_read_messages:
     {
       debug ("CODE_update_read_message\n");
-      assert (fetch_int (self) == (int)CODE_vector);
-      int n = fetch_int (self);
+      int n = fetch_vector_span (self, 1);
       int i;
       for (i = 0; i < n; i++) {
-        int id = fetch_int (self);
+        int id = span_int (self);
         struct message *M = message_get (bl, id);
         if (M) {
           bl_do_set_unread (self->bl, self, M, 0);
@@ -997,16 +1053,14 @@ void work_update (struct mtproto_connection *self, long long msg_id UU) {
     break;
   case CODE_update_restore_messages:
     {
-      assert (fetch_int (self) == CODE_vector);
-      int n = fetch_int (self);
+      int n = fetch_vector_span (self, 1);
       fetch_skip (self, n);
       fetch_pts (self);
     }
     break;
   case CODE_update_delete_messages:
     {
-      assert (fetch_int (self) == CODE_vector);
-      int n = fetch_int (self);
+      int n = fetch_vector_span (self, 1);
       fetch_skip (self, n);
       fetch_pts (self);
     }
@@ -1021,15 +1075,14 @@ void work_update (struct mtproto_connection *self, long long msg_id UU) {
       if (C && (C->flags & FLAG_CREATED)) {
         if (x == CODE_chat_participants) {
           bl_do_set_chat_admin (self->bl, self, &C->chat, fetch_int (self));
-          assert (fetch_int (self) == CODE_vector);
-          n = fetch_int (self);
+          n = fetch_vector_span (self, 4);
           struct chat_user *users = talloc (12 * n);
           int i;
           for (i = 0; i < n; i++) {
-            assert (fetch_int (self) == (int)CODE_chat_participant);
-            users[i].user_id = fetch_int (self);
-            users[i].inviter_id = fetch_int (self);
-            users[i].date = fetch_int (self);
+            assert (span_int (self) == (int)CODE_chat_participant);
+            users[i].user_id = span_int (self);
+            users[i].inviter_id = span_int (self);
+            users[i].date = span_int (self);
           }
           int version = fetch_int (self);
           bl_do_set_chat_participants (self->bl, self, &C->chat, version, n, users);
@@ -1037,8 +1090,7 @@ void work_update (struct mtproto_connection *self, long long msg_id UU) {
       } else {
         if (x == CODE_chat_participants) {
           fetch_int (self); // admin_id
-          assert (fetch_int (self) == CODE_vector);
-          n = fetch_int (self);
+          n = fetch_vector_span (self, 4);
           fetch_skip (self, n * 4);
           fetch_int (self); // version
         }
@@ -1257,7 +1309,7 @@ void work_container (struct connection *c, long long msg_id UU) {
     //int seqno = fetch_int ();
     fetch_int (c->mtconnection); // seq_no
     if (id & 1) {
-      insert_msg_id (c->session, id);
+      insert_msg_id (c->instance, c->session, id);
     }
     int bytes = fetch_int (c->mtconnection);
     int *t = c->mtconnection->in_end;
@@ -1281,11 +1333,10 @@ void work_new_session_created (struct connection *c, long long msg_id UU) {
 void work_msgs_ack (struct connection *c UU, long long msg_id UU) {
   debug ( "work_msgs_ack: msg_id = %lld\n", msg_id);
   assert (fetch_int (c->mtconnection) == CODE_msgs_ack);
-  assert (fetch_int (c->mtconnection) == CODE_vector);
-  int n = fetch_int (c->mtconnection);
+  int n = fetch_vector_span (c->mtconnection, 2);
   int i;
   for (i = 0; i < n; i++) {
-    long long id = fetch_long (c->mtconnection);
+    long long id = span_long (c->mtconnection);
     debug ("ack for %lld\n", id);
     query_ack (c->instance, id);
   }
@@ -1303,50 +1354,125 @@ void work_rpc_result (struct connection *c UU, long long msg_id UU) {
   }
 }
 
-#define MAX_PACKED_SIZE (1 << 24)
-void work_packed (struct connection *c, long long msg_id) {
-  debug ("work_packet()\n");
-  assert (fetch_int (c->mtconnection) == CODE_gzip_packed);
-  static int in_gzip;
-  static int buf[MAX_PACKED_SIZE >> 2];
-  assert (!in_gzip);
-  in_gzip = 1;
+static void packed_reserve (struct mtproto_connection *self, int depth, int size) {
+  if (self->packed_size[depth] >= size) { return; }
+  int n = self->packed_size[depth] ? self->packed_size[depth] : (1 << 12);
+  while (n < size) { n *= 2; }
+  int *buf = talloc (n);
+  if (self->packed_buf[depth]) {
+    memcpy (buf, self->packed_buf[depth], self->packed_size[depth]);
+    tfree (self->packed_buf[depth], self->packed_size[depth]);
+  }
+  self->packed_buf[depth] = buf;
+  self->packed_size[depth] = n;
+}
 
-  int l = prefetch_strlen (c->mtconnection);
-  char *s = fetch_str (c->mtconnection, l);
+int fetch_packed_begin (struct mtproto_connection *self, struct packed_frame *F) {
+  int depth = self->packed_depth;
+  int l = prefetch_strlen (self);
+  if (depth >= MAX_PACKED_DEPTH || l < 0) {
+    warning ("dropping gzip_packed payload (depth = %d, len = %d)\n", depth, l);
+    self->in_ptr = self->in_end;
+    return -1;
+  }
+  unsigned char *s = (void *)fetch_str (self, l);
+
+  // the gzip trailer holds the size of the uncompressed data, it comes from the
+  // peer so it only sizes the first buffer within a sane ratio to the input
+  int isize = l >= 18 ? s[l - 4] | (s[l - 3] << 8) | (s[l - 2] << 16) | ((unsigned)s[l - 1] << 24) : 0;
+  if (isize <= 0 || isize > MAX_PACKED_SIZE) {
+    isize = 4 * l;
+  }
+  if (isize > PACKED_MAX_RATIO * l) {
+    isize = PACKED_MAX_RATIO * l;
+  }
+  packed_reserve (self, depth, isize);
+
+  if (!self->zstrm_ready) {
+    assert (inflateInit2 (&self->zstrm, 16 + MAX_WBITS) == Z_OK);
+    self->zstrm_ready = 1;
+  } else {
+    assert (inflateReset (&self->zstrm) == Z_OK);
+  }
+  z_stream *strm = &self->zstrm;
+  strm->next_in = s;
+  strm->avail_in = l;
+  int err;
+  while (1) {
+    strm->next_out = (unsigned char *)self->packed_buf[depth] + strm->total_out;
+    strm->avail_out = self->packed_size[depth] - strm->total_out;
+    err = inflate (strm, Z_NO_FLUSH);
+    if (err != Z_OK || strm->avail_out || self->packed_size[depth] >= MAX_PACKED_SIZE) {
+      break;
+    }
+    // the trailer lied or was missing, grow and go on
+    packed_reserve (self, depth, 2 * self->packed_size[depth]);
+  }
+  int total_out = strm->total_out;
+  if (err != Z_STREAM_END) {
+    warning ("dropping gzip_packed payload, inflate error = %d after %d bytes\n", err, total_out);
+    self->in_ptr = self->in_end;
+    return -1;
+  }
 
-  int total_out = tinflate (s, l, buf, MAX_PACKED_SIZE);
-  int *end = c->mtconnection->in_ptr;
-  int *eend = c->mtconnection->in_end;
+  F->in_ptr = self->in_ptr;
+  F->in_end = self->in_end;
   //assert (total_out % 4 == 0);
-  c->mtconnection->in_ptr = buf;
-  c->mtconnection->in_end = c->mtconnection->in_ptr + total_out / 4;
-  if (verbosity >= 4) {
+  self->in_ptr = self->packed_buf[depth];
+  self->in_end = self->in_ptr + total_out / 4;
+  self->packed_depth ++;
+  if (self->verbosity >= 4) {
     debug ( "Unzipped data: ");
-    hexdump_in (c->mtconnection);
+    hexdump_in (self);
+  }
+  return total_out;
+}
+
+void fetch_packed_end (struct mtproto_connection *self, struct packed_frame *F) {
+  int depth = -- self->packed_depth;
+  assert (depth >= 0);
+  self->in_ptr = F->in_ptr;
+  self->in_end = F->in_end;
+  if (self->packed_size[depth] > PACKED_KEEP_SIZE) {
+    // keep the scratch small, large payloads are rare
+    tfree (self->packed_buf[depth], self->packed_size[depth]);
+    self->packed_buf[depth] = 0;
+    self->packed_size[depth] = 0;
+  }
+}
+
+void work_packed (struct connection *c, long long msg_id) {
+  debug ("work_packet()\n");
+  assert (fetch_int (c->mtconnection) == CODE_gzip_packed);
+  struct packed_frame F;
+  if (fetch_packed_begin (c->mtconnection, &F) < 0) {
+    return;
   }
   rpc_execute_answer (c, msg_id);
-  c->mtconnection->in_ptr = end;
-  c->mtconnection->in_end = eend;
-  in_gzip = 0;
+  fetch_packed_end (c->mtconnection, &F);
 }
 
 void work_bad_server_salt (struct connection *c UU, long long msg_id UU) {
   debug ("work_bad_server_salt()\n");
   assert (fetch_int (c->mtconnection) == (int)CODE_bad_server_salt);
   long long id = fetch_long (c->mtconnection);
-  query_restart (c->instance, id);
   fetch_int (c->mtconnection); // seq_no
   fetch_int (c->mtconnection); // error_code
   long long new_server_salt = fetch_long (c->mtconnection);
   GET_DC(c)->server_salt = new_server_salt;
+  // id may be a single query or a container, both go out again with the new salt
+  query_restart (c->instance, id);
 }
 
 void work_pong (struct connection *c UU, long long msg_id UU) {
   debug ("work_pong()\n");
   assert (fetch_int (c->mtconnection) == CODE_pong);
-  fetch_long (c->mtconnection); // msg_id
+  long long id = fetch_long (c->mtconnection); // msg_id
   fetch_long (c->mtconnection); // ping_id
+  if (c->ping_time && id == c->ping_msg_id) {
+    query_rtt_sample (GET_DC(c), get_double_time () - c->ping_time);
+    c->ping_time = 0;
+  }
 }
 
 void work_detailed_info (struct connection *c UU, long long msg_id UU) {
@@ -1381,7 +1507,7 @@ void work_bad_msg_notification (struct connection *c UU, long long msg_id UU) {
 }
 
 void rpc_execute_answer (struct connection *c, long long msg_id UU) {
-  if (verbosity >= 5) {
+  if (c->instance->verbosity >= 5) {
     debug ("rpc_execute_answer: fd=%d\n", c->fd);
     hexdump_in (c->mtconnection);
   }
@@ -1438,22 +1564,46 @@ void rpc_execute_answer (struct connection *c, long long msg_id UU) {
   c->mtconnection->in_ptr = c->mtconnection->in_end; // Will not fail due to assertion in_ptr == in_end
 }
 
-int process_rpc_message (struct connection *c UU, struct encrypted_message *enc, int len) {
+/**
+ * Decrypt and verify a message, safe to call from the crypto pool. Returns -1
+ * if the message is malformed or its msg_key does not match.
+ */
+static int rpc_decrypt_message (const char auth_key[192], struct encrypted_message *enc, int len) {
   const int MINSZ = offsetof (struct encrypted_message, message);
   const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
-  debug ( "process_rpc_message(), len=%d\n", len);
-  assert (len >= MINSZ && (len & 15) == (UNENCSZ & 15));
+  unsigned char key[32], iv[32];
+  aes_auth_derive (auth_key, enc->msg_key, key, iv);
+  struct aes_ige_key aes_key;
+  aes_ige_set_key (&aes_key, key, AES_DECRYPT);
+  aes_ige (&aes_key, (void *)&enc->server_salt, (void *)&enc->server_salt, len - UNENCSZ, iv);
+  aes_ige_clear (&aes_key);
+  memset (key, 0, sizeof (key));
+  if ((enc->msg_len & 3) || enc->msg_len <= 0 || enc->msg_len > len - MINSZ || len - MINSZ - enc->msg_len > 12) {
+    return -1;
+  }
+  unsigned char sha1_buffer[20];
+  sha1 ((void *)&enc->server_salt, enc->msg_len + (MINSZ - UNENCSZ), sha1_buffer);
+  if (memcmp (&enc->msg_key, sha1_buffer + 4, 16)) {
+    return -1;
+  }
+  return 0;
+}
+
+static void rpc_check_message (struct connection *c, struct encrypted_message *enc, int len) {
+  const int MINSZ = offsetof (struct encrypted_message, message);
+  const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
+  assert (len >= MINSZ + 8 && (len & 15) == (UNENCSZ & 15));
   struct dc *DC = GET_DC(c);
   assert (enc->auth_key_id == DC->auth_key_id);
   assert (DC->auth_key_id);
-  init_aes_auth (c->mtconnection, DC->auth_key + 8, enc->msg_key, AES_DECRYPT);
-  int l = pad_aes_decrypt (c->mtconnection, (char *)&enc->server_salt, len - UNENCSZ, (char *)&enc->server_salt, len - UNENCSZ);
-  assert (l == len - UNENCSZ);
+}
+
+/**
+ * Process a message that has been decrypted and verified
+ */
+static int rpc_process_decrypted (struct connection *c, struct encrypted_message *enc) {
+  struct dc *DC = GET_DC(c);
   //assert (enc->auth_key_id2 == enc->auth_key_id);
-  assert (!(enc->msg_len & 3) && enc->msg_len > 0 && enc->msg_len <= len - MINSZ && len - MINSZ - enc->msg_len <= 12);
-  static unsigned char sha1_buffer[20];
-  sha1 ((void *)&enc->server_salt, enc->msg_len + (MINSZ - UNENCSZ), sha1_buffer);
-  assert (!memcmp (&enc->msg_key, sha1_buffer + 4, 16));
   //assert (enc->server_salt == server_salt); //in fact server salt can change
   if (DC->server_salt != enc->server_salt) {
     DC->server_salt = enc->server_salt;
@@ -1483,7 +1633,6 @@ int process_rpc_message (struct connection *c UU, struct encrypted_message *enc,
   //*(long long *)(longpoll_query + 3) = *(long long *)((char *)(&enc->msg_id) + 0x3c);
   //*(long long *)(longpoll_query + 5) = *(long long *)((char *)(&enc->msg_id) + 0x3c);
 
-  assert (l >= (MINSZ - UNENCSZ) + 8);
   //assert (enc->message[0] == CODE_rpc_result && *(long long *)(enc->message + 1) == client_last_msg_id);
   ++c->mtconnection->good_messages;
 
@@ -1491,7 +1640,7 @@ int process_rpc_message (struct connection *c UU, struct encrypted_message *enc,
   c->mtconnection->in_end = c->mtconnection->in_ptr + (enc->msg_len / 4);
 
   if (enc->msg_id & 1) {
-    insert_msg_id (c->session, enc->msg_id);
+    insert_msg_id (c->instance, c->session, enc->msg_id);
   }
   assert (c->session->session_id == enc->session_id);
   rpc_execute_answer (c, enc->msg_id);
@@ -1499,18 +1648,92 @@ int process_rpc_message (struct connection *c UU, struct encrypted_message *enc,
   return 0;
 }
 
+int process_rpc_message (struct connection *c, struct encrypted_message *enc, int len) {
+  debug ( "process_rpc_message(), len=%d\n", len);
+  rpc_check_message (c, enc, len);
+  assert (rpc_decrypt_message (GET_DC(c)->auth_key + 8, enc, len) >= 0);
+  return rpc_process_decrypted (c, enc);
+}
+
+/**
+ * A frame that waits for the crypto pool or for the frames before it
+ */
+struct rpc_frame {
+  struct crypto_job job;
+  struct connection *c;
+  char auth_key[192];
+  int result;
+  int len;
+  char data[] __attribute__ ((aligned (8)));
+};
+
+static void rpc_frame_free (struct rpc_frame *F) {
+  memset (F->auth_key, 0, sizeof (F->auth_key));
+  tfree (F, sizeof (struct rpc_frame) + F->len);
+}
+
+static void rpc_frame_work (struct crypto_job *J) {
+  struct rpc_frame *F = (void *)J;
+  F->result = rpc_decrypt_message (F->auth_key, (void *)F->data, F->len);
+}
+
+static void rpc_frame_done (struct crypto_job *J) {
+  struct rpc_frame *F = (void *)J;
+  struct connection *c = F->c;
+  if (!c->mtconnection->destroy) {
+    if (J->work) {
+      debug ("process_rpc_message(), len=%d, decrypted by the crypto pool\n", F->len);
+      assert (F->result >= 0);
+      rpc_process_decrypted (c, (void *)F->data);
+    } else {
+      process_rpc_message (c, (void *)F->data, F->len);
+    }
+  }
+  rpc_frame_free (F);
+}
+
+static void rpc_frame_discard (struct crypto_job *J) {
+  rpc_frame_free ((void *)J);
+}
+
+/**
+ * Hand a frame to the crypto pool, frames below CRYPTO_OFFLOAD_MIN are not
+ * worth the handoff and only keep their place behind the queued ones
+ */
+static void rpc_queue_message (struct connection *c, char *data, int len) {
+  struct mtproto_connection *self = c->mtconnection;
+  rpc_check_message (c, (void *)data, len);
+  struct rpc_frame *F = talloc (sizeof (struct rpc_frame) + len);
+  memset (&F->job, 0, sizeof (F->job));
+  F->job.work = len >= CRYPTO_OFFLOAD_MIN ? rpc_frame_work : 0;
+  F->job.done = rpc_frame_done;
+  F->job.free = rpc_frame_discard;
+  F->c = c;
+  memcpy (F->auth_key, GET_DC(c)->auth_key + 8, sizeof (F->auth_key));
+  F->result = 0;
+  F->len = len;
+  memcpy (F->data, data, len);
+  crypto_pool_submit (c->instance->crypto, &self->rx, &F->job);
+}
+
+static void rpc_drop_queued (struct mtproto_connection *self) {
+  struct crypto_job *J = crypto_stream_drop (self->instance->crypto, &self->rx);
+  while (J) {
+    struct crypto_job *next = J->stream_next;
+    rpc_frame_free ((void *)J);
+    J = next;
+  }
+}
 
-int rpc_execute (struct connection *c, int op, int len) {
+/**
+ * Handle one frame received on c. Response points to the frame payload inside the
+ * receive buffer of the connection and is decrypted and parsed in place, unless
+ * it goes to the crypto pool which works on a copy.
+ */
+int rpc_execute (struct connection *c, int op, int len, char *Response) {
   debug ("outbound rpc connection #%d : received rpc answer %d with %d content bytes\n", c->fd, op, len);
   struct mtproto_connection *self = c->mtconnection;
   struct telegram *instance = c->instance;
-  
-  /*  
-  if (op < 0) {
-    assert (read_in (c, Response, Response_len) == Response_len);
-    return 0;
-  }
-  */
 
   if (len >= MAX_RESPONSE_SIZE/* - 12*/ || len < 0/*12*/) {
     debug ( "answer too long (%d bytes), skipping\n", len);
@@ -1518,13 +1741,7 @@ int rpc_execute (struct connection *c, int op, int len) {
   }
 
   int Response_len = len;
-
-  if (verbosity >= 2) {
-    debug ("Response_len = %d\n", Response_len);
-  }
-  assert (read_in (c, Response, Response_len) == Response_len);
-  Response[Response_len] = 0;
-  if (verbosity >= 2) {
+  if (instance->verbosity >= 2) {
     debug ( "have %d Response bytes\n", Response_len);
   }
 
@@ -1553,7 +1770,13 @@ int rpc_execute (struct connection *c, int op, int len) {
       c->mtconnection->c_state = st_error;
       telegram_change_state (instance, STATE_ERROR, code);
     } else {
-      process_rpc_message (c, (void *)(Response/* + 8*/), Response_len/* - 12*/);
+      // frames must be processed in order, deliver the decrypted ones first
+      crypto_stream_reap (instance->crypto, &self->rx);
+      if (self->rx.head || Response_len >= CRYPTO_OFFLOAD_MIN) {
+        rpc_queue_message (c, Response, Response_len);
+      } else {
+        process_rpc_message (c, (void *)(Response/* + 8*/), Response_len/* - 12*/);
+      }
     }
     return 0;
   default:
@@ -1612,9 +1835,7 @@ int auth_is_success (struct mtproto_connection *m) {
 
 #define RANDSEED_PASSWORD_FILENAME     NULL
 #define RANDSEED_PASSWORD_LENGTH       0
-void on_start (struct mtproto_connection *self) {
-  prng_seed (self, RANDSEED_PASSWORD_FILENAME, RANDSEED_PASSWORD_LENGTH);
-
+static void load_public_key (void) {
   if (rsa_public_key_name) {
     if (rsa_load_public_key (rsa_public_key_name) < 0) {
       perror ("rsa_load_public_key");
@@ -1630,6 +1851,11 @@ void on_start (struct mtproto_connection *self) {
   pk_fingerprint = compute_rsa_key_fingerprint (pubKey);
 }
 
+void on_start (struct mtproto_connection *self) {
+  prng_seed (self, RANDSEED_PASSWORD_FILENAME, RANDSEED_PASSWORD_LENGTH);
+  pthread_once (&pubkey_once, load_public_key);
+}
+
 
 struct connection_methods mtproto_methods = {
   .execute = rpc_execute,
@@ -1639,15 +1865,33 @@ struct connection_methods mtproto_methods = {
 
 /**
  * Create a new struct mtproto_connection connection using the giving datacenter for authorization and 
- *  session handling
+ *  the session session_num of it for session handling
  */
-struct mtproto_connection *mtproto_new(struct dc *DC, int fd, struct telegram *tg)
+struct mtproto_connection *mtproto_new(struct dc *DC, int session_num, int fd, struct telegram *tg)
 {
     struct mtproto_connection *mtp = talloc0(sizeof(struct mtproto_connection));
-    tg->Cs[tg->cs++] = mtp;
+    // reuse the slot of a freed connection
+    int i;
+    for (i = 0; i < tg->cs && tg->Cs[i]; i++);
+    if (i == tg->cs_size) {
+        int size = tg->cs_size ? 2 * tg->cs_size : 16;
+        struct mtproto_connection **Cs = talloc0 (size * sizeof (void *));
+        if (tg->Cs) {
+            memcpy (Cs, tg->Cs, tg->cs_size * sizeof (void *));
+            tfree (tg->Cs, tg->cs_size * sizeof (void *));
+        }
+        tg->Cs = Cs;
+        tg->cs_size = size;
+    }
+    if (i == tg->cs) {
+        tg->cs ++;
+    }
+    mtp->index = i;
+    tg->Cs[i] = mtp;
     mtp->instance = tg;
-    mtp->packet_buffer = mtp->__packet_buffer + 16;
-    mtp->connection = fd_create_connection(DC, fd, tg, &mtproto_methods, mtp);
+    mtp->verbosity = tg->verbosity;
+    packet_init (mtp);
+    mtp->connection = fd_create_connection(DC, session_num, fd, tg, &mtproto_methods, mtp);
     assert (tg->bl);
     mtp->bl = tg->bl;
     return mtp;
@@ -1669,16 +1913,22 @@ void mtproto_connect(struct mtproto_connection *c)
  */
 void mtproto_close(struct mtproto_connection *mtp) {
     debug ("closing mtproto_connection...\n");
+    if (mtp->destroy) { return; }
     mtp->destroy = 1;
+    mtp->next_closed = mtp->instance->closed;
+    mtp->instance->closed = mtp;
 
     // send all pending acks on this connection so the server won't 
     // resend messages. We might not be able to send the acknowledgements later
     // in case the session is switched and this DC is not reachable anymore
     if (mtp->connection) {
-        if (mtp->connection->session && mtp->connection->session->ack_tree) {
-            struct session *S = mtp->connection->session;
+        struct session *S = mtp->connection->session;
+        if (S && S->acks_num) {
             send_all_acks (S);
             mtp->instance->config->on_output(mtp->handle);
+        }
+        // let the session pick up a new connection
+        if (S && S->c == mtp->connection) {
             S->c = 0;
         }
         stop_ping_timer (mtp->connection);
@@ -1690,15 +1940,35 @@ void mtproto_close(struct mtproto_connection *mtp) {
  */
 void mtproto_destroy (struct mtproto_connection *self) {
     debug("destroying mtproto_connection: %p\n", self);
+    int i;
+    for (i = 0; i < MAX_PACKED_DEPTH; i++) {
+        if (self->packed_buf[i]) {
+            tfree (self->packed_buf[i], self->packed_size[i]);
+        }
+    }
+    if (self->zstrm_ready) {
+        inflateEnd (&self->zstrm);
+    }
+    if (self->enc_msg) {
+        tfree (self->enc_msg, sizeof (struct encrypted_message) + self->enc_msg_ints * 4);
+    }
+    rpc_drop_queued (self);
+    dh_buffers_free (self);
+    packet_free (self);
     self->instance->config->proxy_close_cb(self->handle);
     fd_close_connection(self->connection);
     tfree(self, sizeof(struct mtproto_connection));
+
+    struct buffer_pool_stats st;
+    get_buffer_pool_stats (&st);
+    debug ("buffer pool: hits=%lld misses=%lld resident=%lld used=%lld cached=%lld\n",
+        st.hits, st.misses, st.resident_bytes, st.used_bytes, st.cached_bytes);
 }
 
 void mtproto_close_foreign (struct telegram *instance) 
 {
     int i;
-    for (i = 0; i < 100; i++) {
+    for (i = 0; i < instance->cs; i++) {
         struct mtproto_connection * c = instance->Cs[i];
         if (c && 
             !c->destroy && 
@@ -1714,22 +1984,22 @@ void mtproto_close_foreign (struct telegram *instance)
  * Free all destroyed connections
  */
 void mtproto_free_closed (struct telegram *tg, int force) {
-    int i;
-    for (i = 0; i < 100; i++) {
-        if (tg->Cs[i] == NULL) continue; 
-        struct mtproto_connection *c = tg->Cs[i];
+    struct mtproto_connection **p = &tg->closed;
+    while (*p) {
+        struct mtproto_connection *c = *p;
         debug ("checking mtproto_connection %d: c_state:%d destroy:%d, quries_num:%d\n", 
-            i, c->c_state, c->destroy, c->queries_num);
-        if (c->destroy == 0) continue;
+            c->index, c->c_state, c->destroy, c->queries_num);
         if (!force && c->connection->out_bytes > 0) {
             debug ("still %d bytes ouput left, skipping connection...\n", c->connection->out_bytes);
+            p = &c->next_closed;
             continue;
         }
-        mtproto_destroy (c);
+        *p = c->next_closed;
         if (tg->connection == c) {
             tg->connection = NULL;
         }
-        tg->Cs[i] = NULL;
+        tg->Cs[c->index] = NULL;
+        mtproto_destroy (c);
     }
 }
 
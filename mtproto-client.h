@@ -41,12 +41,14 @@ Copyright Nikolay Durov, Andrey Lopatin 2012-2013
 #include <stdio.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <zlib.h>
 
 #include "include.h"
 #include "tools.h"
 #include "constants.h"
 #include "msglog.h"
 #include "net.h"
+#include "crypto.h"
 
 #ifdef __MACH__
 #include <mach/clock.h>
@@ -114,7 +116,7 @@ Copyright Nikolay Durov, Andrey Lopatin 2012-2013
 #define MAX_PROTO_MESSAGE_INTS	1048576
 #define	_FILE_OFFSET_BITS	64
 
-char *rsa_public_key_name; 
+extern char *rsa_public_key_name; 
 
 #pragma pack(push,4)
 struct encrypted_message {
@@ -129,7 +131,8 @@ struct encrypted_message {
   long long msg_id;
   int seq_no;
   int msg_len;   // divisible by 4
-  int message[MAX_MESSAGE_INTS];
+  // up to MAX_MESSAGE_INTS, allocated as needed
+  int message[];
 };
 #pragma pack(pop)
 
@@ -159,6 +162,18 @@ void mtproto_destroy (struct mtproto_connection *self);
 #define DECRYPT_BUFFER_INTS 16384
 #define ENCRYPT_BUFFER_INTS 16384
 #define PACKET_BUFFER_SIZE	(16384 * 100 + 16) // temp fix
+// initial size of the packet builder in ints, it doubles up to PACKET_BUFFER_SIZE
+#define PACKET_BUFFER_MIN 4096
+// space in front of the packet builder, kept from the static layout
+#define PACKET_BUFFER_HEAD 16
+
+// gzip_packed payloads may contain further gzip_packed payloads up to this depth
+#define MAX_PACKED_DEPTH 4
+// the size in the gzip trailer is trusted up to this many times the packed size,
+// beyond it the buffer only grows with the data actually inflated
+#define PACKED_MAX_RATIO 16
+// inflate buffers up to this size are kept for the next payload
+#define PACKED_KEEP_SIZE (1 << 18)
 
 struct mtproto_connection {
     struct connection *connection;
@@ -176,11 +191,14 @@ struct mtproto_connection {
     unsigned p1, p2;
 
     int *in_ptr, *in_end;
+    // end of the span checked by the last fetch_span, only verified with DEBUG_FETCH
+    int *span_end;
 
     // common
 
-    int __packet_buffer[PACKET_BUFFER_SIZE], *packet_ptr;
-    int *packet_buffer;
+    int *__packet_buffer, *packet_ptr;
+    int *packet_buffer, *packet_end;
+    int packet_size;
     
     long long rsa_encrypted_chunks, rsa_decrypted_chunks;
     
@@ -189,8 +207,9 @@ struct mtproto_connection {
 
     // DH
 
-    int encrypt_buffer[ENCRYPT_BUFFER_INTS];
-    int decrypt_buffer[ENCRYPT_BUFFER_INTS];
+    // only allocated during the key exchange
+    int *encrypt_buffer;
+    int *decrypt_buffer;
     char s_power [256];
     BIGNUM dh_prime, dh_g, g_a, dh_power, auth_key_num;
 
@@ -204,11 +223,16 @@ struct mtproto_connection {
     // AES IGE
 
     unsigned char aes_key_raw[32], aes_iv[32];
-    AES_KEY aes_key;
+    struct aes_ige_key aes_key;
+
+    // large frames are decrypted by the crypto pool, all frames queued behind
+    // them are processed in order of arrival
+    struct crypto_stream rx;
 
     // authorized
 
-    struct encrypted_message enc_msg;
+    struct encrypted_message *enc_msg;
+    int enc_msg_ints;
     long long client_last_msg_id;
     long long server_last_msg_id;
 
@@ -246,21 +270,52 @@ struct mtproto_connection {
     // marks this connection for destruction, so it
     // will be freed once all queries received a response or timed out
     int destroy;
+    struct mtproto_connection *next_closed;
+    // position in the connections of the instance
+    int index;
 
     // 
     // the corresponding telegram instance
     //
     struct telegram *instance;
     void *handle;
+
+    // copied from the instance, read by the inline fetch functions
+    int verbosity;
+
+    // inflated gzip_packed payloads, one buffer per nesting level
+    z_stream zstrm;
+    int zstrm_ready;
+    int packed_depth;
+    int *packed_buf[MAX_PACKED_DEPTH];
+    int packed_size[MAX_PACKED_DEPTH];
+};
+
+/**
+ * Input bounds that were replaced by an inflated payload
+ */
+struct packed_frame {
+    int *in_ptr, *in_end;
 };
 
+/**
+ * Inflate the packed_data:bytes of a gzip_packed at the read position and read
+ * from the result until fetch_packed_end restores the previous input. Returns
+ * -1 and skips the rest of the input if the payload is too deep or broken,
+ * fetch_packed_end must not be called then.
+ */
+int fetch_packed_begin (struct mtproto_connection *self, struct packed_frame *F);
+void fetch_packed_end (struct mtproto_connection *self, struct packed_frame *F);
+
 void mtproto_connection_init (struct mtproto_connection *c);
-struct mtproto_connection *mtproto_new(struct dc *DC, int fd, struct telegram *tg);
+struct mtproto_connection *mtproto_new(struct dc *DC, int session_num, int fd, struct telegram *tg);
 void mtproto_close(struct mtproto_connection *c);
 void mtproto_connect(struct mtproto_connection *c);
 
 void on_start (struct mtproto_connection *self);
 long long encrypt_send_message (struct mtproto_connection *self, int *msg, int msg_ints, int useful);
+long long reserve_msg_id (struct mtproto_connection *self, int useful, int *seq_no);
+double get_utime (int clock_id);
 void work_update (struct mtproto_connection *self, long long msg_id);
 void work_update_binlog (struct mtproto_connection *self);
 int check_g (unsigned char p[256], BIGNUM *g);
@@ -276,21 +331,35 @@ void prng_seed (struct mtproto_connection *self, const char *password_filename,
 int serialize_bignum (BIGNUM *b, char *buffer, int maxlen);
 long long compute_rsa_key_fingerprint (RSA *key);
 
+void packet_init (struct mtproto_connection *self);
+void packet_free (struct mtproto_connection *self);
+void packet_grow (struct mtproto_connection *self, int len);
+
+/**
+ * Make room for len more ints in the packet builder, pointers into it are only
+ * valid until the next call
+ */
+static inline void packet_reserve (struct mtproto_connection *self, int len) {
+  if (self->packet_ptr + len > self->packet_end) {
+    packet_grow (self, len);
+  }
+}
+
 static inline void out_ints (struct mtproto_connection *self, const int *what, int len) {
-  assert (self->packet_ptr + len <= self->packet_buffer + PACKET_BUFFER_SIZE);
+  packet_reserve (self, len);
   memcpy (self->packet_ptr, what, len * 4);
   self->packet_ptr += len;
 }
 
 
 static inline void out_int (struct mtproto_connection *self, int x) {
-  assert (self->packet_ptr + 1 <= self->packet_buffer + PACKET_BUFFER_SIZE);
+  packet_reserve (self, 1);
   *self->packet_ptr++ = x;
 }
 
 
 static inline void out_long (struct mtproto_connection *self, long long x) {
-  assert (self->packet_ptr + 2 <= self->packet_buffer + PACKET_BUFFER_SIZE);
+  packet_reserve (self, 2);
   *(long long *)self->packet_ptr = x;
   self->packet_ptr += 2;
 }
@@ -308,12 +377,25 @@ static inline void out_string (struct mtproto_connection *self, const char *str)
 }
 
 static inline void out_bignum (struct mtproto_connection *self, BIGNUM *n) {
-  int l = serialize_bignum (n, (char *)self->packet_ptr, (PACKET_BUFFER_SIZE - (self->packet_ptr - self->packet_buffer)) * 4);
+  packet_reserve (self, 1024);
+  int l = serialize_bignum (n, (char *)self->packet_ptr, (self->packet_end - self->packet_ptr) * 4);
   assert (l > 0);
   self->packet_ptr += l >> 2;
 }
 
 
+/*
+ * Tracing of every fetch at verbosity 7 and the checks of the span reads are
+ * only compiled in with -DDEBUG_FETCH
+ */
+#ifdef DEBUG_FETCH
+#define FETCH_TRACE(self, ...) do { if ((self)->verbosity > 6) { debug (__VA_ARGS__); } } while (0)
+#define SPAN_CHECK(self, n) assert ((self)->in_ptr + (n) <= (self)->span_end)
+#else
+#define FETCH_TRACE(self, ...)
+#define SPAN_CHECK(self, n)
+#endif
+
 void fetch_pts (struct mtproto_connection *self);
 void fetch_qts (struct mtproto_connection *self);
 void fetch_date (struct mtproto_connection *self);
@@ -334,12 +416,9 @@ static inline int prefetch_strlen (struct mtproto_connection *self) {
   }
 }
 
-extern int verbosity;
 static inline char *fetch_str (struct mtproto_connection *self, int len) {
   assert (len >= 0);
-  if (verbosity > 6) {
-    debug ("fetch_string: len = %d\n", len);
-  }
+  FETCH_TRACE (self, "fetch_string: len = %d\n", len);
   if (len < 254) {
     char *str = (char *) self->in_ptr + 1;
     self->in_ptr += 1 + (len >> 2);
@@ -431,17 +510,13 @@ int fetch_bignum (struct mtproto_connection *self, BIGNUM *x);
 
 static inline int fetch_int (struct mtproto_connection *self) {
   assert (self->in_ptr + 1 <= self->in_end);
-  if (verbosity > 6) {
-    debug ("fetch_int: 0x%08x (%d)\n", *self->in_ptr, *self->in_ptr);
-  }
+  FETCH_TRACE (self, "fetch_int: 0x%08x (%d)\n", *self->in_ptr, *self->in_ptr);
   return *(self->in_ptr ++);
 }
 
 static inline int fetch_bool (struct mtproto_connection *self) {
-  if (verbosity > 6) {
-    debug ("fetch_bool: 0x%08x (%d)\n", *self->in_ptr, *self->in_ptr);
-  }
   assert (self->in_ptr + 1 <= self->in_end);
+  FETCH_TRACE (self, "fetch_bool: 0x%08x (%d)\n", *self->in_ptr, *self->in_ptr);
   assert (*(self->in_ptr) == (int)CODE_bool_true || *(self->in_ptr) == (int)CODE_bool_false);
   return *(self->in_ptr ++) == (int)CODE_bool_true;
 }
@@ -483,12 +558,76 @@ static inline void fetch_ints (struct mtproto_connection *self, void *data, int
   self->in_ptr += count;
 }
 
+/*
+ * Span reader
+ *
+ * fetch_span checks once that the next n ints are in the input, the span_*
+ * reads of the fields within them do not check again.
+ */
+
+static inline void fetch_span (struct mtproto_connection *self, int n) {
+  assert (n >= 0 && n <= self->in_end - self->in_ptr);
+  self->span_end = self->in_ptr + n;
+}
+
+static inline int span_int (struct mtproto_connection *self) {
+  SPAN_CHECK (self, 1);
+  FETCH_TRACE (self, "span_int: 0x%08x (%d)\n", *self->in_ptr, *self->in_ptr);
+  return *(self->in_ptr ++);
+}
+
+static inline long long span_long (struct mtproto_connection *self) {
+  SPAN_CHECK (self, 2);
+  long long r = *(long long *)self->in_ptr;
+  self->in_ptr += 2;
+  return r;
+}
+
+static inline double span_double (struct mtproto_connection *self) {
+  SPAN_CHECK (self, 2);
+  double r = *(double *)self->in_ptr;
+  self->in_ptr += 2;
+  return r;
+}
+
+static inline int span_bool (struct mtproto_connection *self) {
+  SPAN_CHECK (self, 1);
+  int x = *(self->in_ptr ++);
+  assert (x == (int)CODE_bool_true || x == (int)CODE_bool_false);
+  return x == (int)CODE_bool_true;
+}
+
+static inline void span_ints (struct mtproto_connection *self, void *data, int count) {
+  SPAN_CHECK (self, count);
+  memcpy (data, self->in_ptr, 4 * count);
+  self->in_ptr += count;
+}
+
+/**
+ * Fetch a vector header and check that its elements of elem_ints each are in
+ * the input, returns their number. A span covering all of them is open.
+ */
+static inline int fetch_vector_span (struct mtproto_connection *self, int elem_ints) {
+  assert (self->in_ptr + 2 <= self->in_end);
+  assert (*self->in_ptr == (int)CODE_vector);
+  int n = self->in_ptr[1];
+  self->in_ptr += 2;
+  assert (n >= 0 && n <= (self->in_end - self->in_ptr) / elem_ints);
+  self->span_end = self->in_ptr + n * elem_ints;
+  return n;
+}
+
 int get_random_bytes (unsigned char *buf, int n);
 
 int pad_rsa_encrypt (struct mtproto_connection *self, char *from, int from_len, char *to, int size, BIGNUM *N, BIGNUM *E);
 int pad_rsa_decrypt (struct mtproto_connection *self, char *from, int from_len, char *to, int size, BIGNUM *N, BIGNUM *D);
 
 void init_aes_unauth (struct mtproto_connection *self, const char server_nonce[16], const char hidden_client_nonce[32], int encrypt);
+/**
+ * Derive the AES key and iv of a message from the auth key and its msg_key,
+ * does not touch any connection state
+ */
+void aes_auth_derive (const char auth_key[192], const char msg_key[16], unsigned char key[32], unsigned char iv[32]);
 void init_aes_auth (struct mtproto_connection *self, char auth_key[192], char msg_key[16], int encrypt);
 int pad_aes_encrypt (struct mtproto_connection *self, char *from, int from_len, char *to, int size);
 int pad_aes_decrypt (struct mtproto_connection *self, char *from, int from_len, char *to, int size);
@@ -4,8 +4,6 @@
  * struct mtproto_connection-Common.c
  */
 
-int verbosity;
-
 #ifndef __MTPROTO_COMMON_C__
 #define __MTPROTO_COMMON_C__
 
@@ -13,11 +11,7 @@ int get_random_bytes (unsigned char *buf, int n) {
   int r = 0, h = open ("/dev/random", O_RDONLY | O_NONBLOCK);
   if (h >= 0) {
     r = read (h, buf, n);
-    if (r > 0) {
-      if (verbosity >= 3) {
-        debug ( "added %d bytes of real entropy to secure random numbers seed\n", r);
-      }
-    } else {
+    if (r <= 0) {
       r = 0;
     }
     close (h);
@@ -145,8 +139,8 @@ int serialize_bignum (BIGNUM *b, char *buffer, int maxlen) {
 
 
 long long compute_rsa_key_fingerprint (RSA *key) {
-  static char tempbuff[4096];
-  static unsigned char sha[20]; 
+  char tempbuff[4096];
+  unsigned char sha[20];
   assert (key->n && key->e);
   int l1 = serialize_bignum (key->n, tempbuff, 4096);
   assert (l1 > 0);
@@ -156,9 +150,48 @@ long long compute_rsa_key_fingerprint (RSA *key) {
   return *(long long *)(sha + 12);
 }
 
+void packet_init (struct mtproto_connection *self) {
+  self->packet_size = PACKET_BUFFER_MIN;
+  self->__packet_buffer = talloc (self->packet_size * 4);
+  self->packet_buffer = self->__packet_buffer + PACKET_BUFFER_HEAD;
+  self->packet_end = self->__packet_buffer + self->packet_size;
+  self->packet_ptr = self->packet_buffer;
+}
+
+void packet_free (struct mtproto_connection *self) {
+  if (self->__packet_buffer) {
+    tfree (self->__packet_buffer, self->packet_size * 4);
+    self->__packet_buffer = self->packet_buffer = self->packet_ptr = self->packet_end = 0;
+  }
+}
+
+void packet_grow (struct mtproto_connection *self, int len) {
+  int used = self->packet_ptr - self->packet_buffer;
+  int size = self->packet_size;
+  while (size - PACKET_BUFFER_HEAD < used + len && size < PACKET_BUFFER_SIZE) {
+    size *= 2;
+  }
+  if (size > PACKET_BUFFER_SIZE) {
+    size = PACKET_BUFFER_SIZE;
+  }
+  assert (used + len <= size - PACKET_BUFFER_HEAD);
+  int *buf = talloc (size * 4);
+  memcpy (buf, self->__packet_buffer, (PACKET_BUFFER_HEAD + used) * 4);
+  // the secret chat encryption keeps a pointer to its header while the body is written
+  if (self->encr_extra >= self->packet_buffer && self->encr_extra <= self->packet_ptr) {
+    self->encr_extra = buf + PACKET_BUFFER_HEAD + (self->encr_extra - self->packet_buffer);
+  }
+  tfree (self->__packet_buffer, self->packet_size * 4);
+  self->__packet_buffer = buf;
+  self->packet_size = size;
+  self->packet_buffer = buf + PACKET_BUFFER_HEAD;
+  self->packet_ptr = self->packet_buffer + used;
+  self->packet_end = buf + size;
+}
+
 void out_cstring (struct mtproto_connection *self, const char *str, long len) {
   assert (len >= 0 && len < (1 << 24));
-  assert ((char *) self->packet_ptr + len + 8 < (char *) (self->packet_buffer + PACKET_BUFFER_SIZE));
+  packet_reserve (self, (len >> 2) + 2);
   char *dest = (char *) self->packet_ptr;
   if (len < 254) {
     *dest++ = len;
@@ -176,7 +209,14 @@ void out_cstring (struct mtproto_connection *self, const char *str, long len) {
 
 void out_cstring_careful (struct mtproto_connection *self, const char *str, long len) {
   assert (len >= 0 && len < (1 << 24));
-  assert ((char *) self->packet_ptr + len + 8 < (char *) (self->packet_buffer + PACKET_BUFFER_SIZE));
+  if (str >= (char *) self->packet_buffer && str < (char *) self->packet_end) {
+    // str lives in the packet builder and moves with it
+    long offset = str - (char *) self->packet_buffer;
+    packet_reserve (self, (len >> 2) + 2);
+    str = (char *) self->packet_buffer + offset;
+  } else {
+    packet_reserve (self, (len >> 2) + 2);
+  }
   char *dest = (char *) self->packet_ptr;
   if (len < 254) {
     dest++;
@@ -201,7 +241,7 @@ void out_cstring_careful (struct mtproto_connection *self, const char *str, long
 
 void out_data (struct mtproto_connection *self, const void *data, long len) {
   assert (len >= 0 && len < (1 << 24) && !(len & 3));
-  assert ((char *) self->packet_ptr + len + 8 < (char *) (self->packet_buffer + PACKET_BUFFER_SIZE));
+  packet_reserve (self, len >> 2);
   memcpy (self->packet_ptr, data, len);
   self->packet_ptr += len >> 2;
 }
@@ -277,7 +317,7 @@ int pad_rsa_decrypt (struct mtproto_connection *self, char *from, int from_len,
 }
 
 void init_aes_unauth (struct mtproto_connection *self, const char server_nonce[16], const char hidden_client_nonce[32], int encrypt) {
-  static unsigned char buffer[64], hash[20];
+  unsigned char buffer[64], hash[20];
   memcpy (buffer, hidden_client_nonce, 32);
   memcpy (buffer + 32, server_nonce, 16);
   SHA1 (buffer, 48, self->aes_key_raw);
@@ -289,51 +329,48 @@ void init_aes_unauth (struct mtproto_connection *self, const char server_nonce[1
   memcpy (self->aes_key_raw + 20, hash, 12);
   memcpy (self->aes_iv, hash + 12, 8);
   memcpy (self->aes_iv + 28, hidden_client_nonce, 4);
-  if (encrypt == AES_ENCRYPT) {
-    AES_set_encrypt_key (self->aes_key_raw, 32*8, &self->aes_key);
-  } else {
-    AES_set_decrypt_key (self->aes_key_raw, 32*8, &self->aes_key);
-  }
+  aes_ige_set_key (&self->aes_key, self->aes_key_raw, encrypt);
   memset (self->aes_key_raw, 0, sizeof (self->aes_key_raw));
 }
 
-void init_aes_auth (struct mtproto_connection *self, char auth_key[192], char msg_key[16], int encrypt) {
-  static unsigned char buffer[48], hash[20];
+void aes_auth_derive (const char auth_key[192], const char msg_key[16], unsigned char key[32], unsigned char iv[32]) {
+  unsigned char buffer[4][48], hash[4][20];
   //  sha1_a = SHA1 (msg_key + substr (auth_key, 0, 32));
   //  sha1_b = SHA1 (substr (auth_key, 32, 16) + msg_key + substr (auth_key, 48, 16));
   //  sha1_с = SHA1 (substr (auth_key, 64, 32) + msg_key);
   //  sha1_d = SHA1 (msg_key + substr (auth_key, 96, 32));
   //  aes_key = substr (sha1_a, 0, 8) + substr (sha1_b, 8, 12) + substr (sha1_c, 4, 12);
   //  aes_iv = substr (sha1_a, 8, 12) + substr (sha1_b, 0, 8) + substr (sha1_c, 16, 4) + substr (sha1_d, 0, 8);
-  memcpy (buffer, msg_key, 16);
-  memcpy (buffer + 16, auth_key, 32);
-  SHA1 (buffer, 48, hash);
-  memcpy (self->aes_key_raw, hash, 8);
-  memcpy (self->aes_iv, hash + 8, 12);
+  memcpy (buffer[0], msg_key, 16);
+  memcpy (buffer[0] + 16, auth_key, 32);
 
-  memcpy (buffer, auth_key + 32, 16);
-  memcpy (buffer + 16, msg_key, 16);
-  memcpy (buffer + 32, auth_key + 48, 16);
-  SHA1 (buffer, 48, hash);
-  memcpy (self->aes_key_raw + 8, hash + 8, 12);
-  memcpy (self->aes_iv + 12, hash, 8);
+  memcpy (buffer[1], auth_key + 32, 16);
+  memcpy (buffer[1] + 16, msg_key, 16);
+  memcpy (buffer[1] + 32, auth_key + 48, 16);
 
-  memcpy (buffer, auth_key + 64, 32);
-  memcpy (buffer + 32, msg_key, 16);
-  SHA1 (buffer, 48, hash);
-  memcpy (self->aes_key_raw + 20, hash + 4, 12);
-  memcpy (self->aes_iv + 20, hash + 16, 4);
+  memcpy (buffer[2], auth_key + 64, 32);
+  memcpy (buffer[2] + 32, msg_key, 16);
 
-  memcpy (buffer, msg_key, 16);
-  memcpy (buffer + 16, auth_key + 96, 32);
-  SHA1 (buffer, 48, hash);
-  memcpy (self->aes_iv + 24, hash, 8);
-  
-  if (encrypt == AES_ENCRYPT) {
-    AES_set_encrypt_key (self->aes_key_raw, 32*8, &self->aes_key);
-  } else {
-    AES_set_decrypt_key (self->aes_key_raw, 32*8, &self->aes_key);
-  }
+  memcpy (buffer[3], msg_key, 16);
+  memcpy (buffer[3] + 16, auth_key + 96, 32);
+
+  // the four hashes are independent and computed together
+  const unsigned char *in[4] = {buffer[0], buffer[1], buffer[2], buffer[3]};
+  unsigned char *out[4] = {hash[0], hash[1], hash[2], hash[3]};
+  sha1_x4 (in, 48, out);
+
+  memcpy (key, hash[0], 8);
+  memcpy (iv, hash[0] + 8, 12);
+  memcpy (key + 8, hash[1] + 8, 12);
+  memcpy (iv + 12, hash[1], 8);
+  memcpy (key + 20, hash[2] + 4, 12);
+  memcpy (iv + 20, hash[2] + 16, 4);
+  memcpy (iv + 24, hash[3], 8);
+}
+
+void init_aes_auth (struct mtproto_connection *self, char auth_key[192], char msg_key[16], int encrypt) {
+  aes_auth_derive (auth_key, msg_key, self->aes_key_raw, self->aes_iv);
+  aes_ige_set_key (&self->aes_key, self->aes_key_raw, encrypt);
   memset (self->aes_key_raw, 0, sizeof (self->aes_key_raw));
 }
 
@@ -343,7 +380,7 @@ int pad_aes_encrypt (struct mtproto_connection *self, char *from, int from_len,
   if (from_len < padded_size) {
     assert (RAND_pseudo_bytes ((unsigned char *) from + from_len, padded_size - from_len) >= 0);
   }
-  AES_ige_encrypt ((unsigned char *) from, (unsigned char *) to, padded_size, &self->aes_key, self->aes_iv, AES_ENCRYPT);
+  aes_ige (&self->aes_key, (unsigned char *) from, (unsigned char *) to, padded_size, self->aes_iv);
   return padded_size;
 }
 
@@ -351,7 +388,7 @@ int pad_aes_decrypt (struct mtproto_connection *self, char *from, int from_len,
   if (from_len <= 0 || from_len > size || (from_len & 15)) {
     return -1;
   }
-  AES_ige_encrypt ((unsigned char *) from, (unsigned char *) to, from_len, &self->aes_key, self->aes_iv, AES_DECRYPT); 
+  aes_ige (&self->aes_key, (unsigned char *) from, (unsigned char *) to, from_len, self->aes_iv);
   return from_len;
 }
 #endif
@@ -27,10 +27,12 @@
 #include <sys/fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <poll.h>
+#include <pthread.h>
 #include <openssl/rand.h>
 #include <arpa/inet.h>
 
@@ -43,11 +45,8 @@
 #define POLLRDHUP 0
 #endif
 
-#define long_cmp(a,b) ((a) > (b) ? 1 : (a) == (b) ? 0 : -1)
-DEFINE_TREE(long,long long,long_cmp,0)
 double get_utime (int clock_id);
 
-int verbosity;
 extern struct connection_methods auth_methods;
 //extern FILE *log_net_f;
 FILE *log_net_f = 0;
@@ -72,7 +71,8 @@ int ping_alarm (struct connection *c) {
     int x[3];
     x[0] = CODE_ping;
     *(long long *)(x + 1) = lrand48 () * (1ll << 32) + lrand48 ();
-    encrypt_send_message (c->mtconnection, x, 3, 0);
+    c->ping_msg_id = encrypt_send_message (c->mtconnection, x, 3, 0);
+    c->ping_time = get_double_time ();
     start_ping_timer (c);
   } else {
     start_ping_timer (c);
@@ -110,26 +110,141 @@ void start_fail_timer (struct connection *c) {
   insert_event_timer (c->instance, &c->ev);
 }
 
+/*
+ * Connection buffer pool
+ *
+ * Buffers are handed out in power-of-two size classes between 4 KB and 1 MB and
+ * recycled through per-class free lists instead of going through malloc/free for
+ * every chunk. Bigger buffers bypass the pool. The pool is shared by the
+ * connections of all instances and may be used from several threads.
+ */
+
+#define POOL_MIN_SHIFT 12
+#define POOL_MAX_SHIFT 20
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_FREE 16
+#define POOL_MAX_CACHED_BYTES (4 << 20)
+
+static struct {
+  pthread_mutex_t lock;
+  struct connection_buffer *free[POOL_CLASSES];
+  int free_num[POOL_CLASSES];
+  struct buffer_pool_stats stats;
+} buffer_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int pool_class (int size) {
+  int c = 0;
+  while ((1 << (c + POOL_MIN_SHIFT)) < size) {
+    c ++;
+  }
+  return c;
+}
+
 struct connection_buffer *new_connection_buffer (int size) {
-  struct connection_buffer *b = talloc0 (sizeof (*b));
-  b->start = talloc (size);
+  assert (size > 0);
+  struct connection_buffer *b = 0;
+  int c = -1;
+  if (size <= (1 << POOL_MAX_SHIFT)) {
+    c = pool_class (size);
+    size = 1 << (c + POOL_MIN_SHIFT);
+  }
+  pthread_mutex_lock (&buffer_pool.lock);
+  if (c >= 0 && buffer_pool.free[c]) {
+    buffer_pool.stats.hits ++;
+    b = buffer_pool.free[c];
+    buffer_pool.free[c] = b->next;
+    buffer_pool.free_num[c] --;
+    buffer_pool.stats.cached_bytes -= size;
+  } else {
+    buffer_pool.stats.misses ++;
+    if (c >= 0) {
+      buffer_pool.stats.resident_bytes += size;
+    }
+  }
+  buffer_pool.stats.used_bytes += size;
+  pthread_mutex_unlock (&buffer_pool.lock);
+
+  if (!b) {
+    b = talloc0 (sizeof (*b));
+    b->start = talloc (size);
+  }
+  b->next = 0;
   b->end = b->start + size;
   b->rptr = b->wptr = b->start;
   return b;
 }
 
 void delete_connection_buffer (struct connection_buffer *b) {
-  tfree (b->start, b->end - b->start);
+  int size = b->end - b->start;
+  pthread_mutex_lock (&buffer_pool.lock);
+  buffer_pool.stats.used_bytes -= size;
+  if (size <= (1 << POOL_MAX_SHIFT)) {
+    int c = pool_class (size);
+    if (buffer_pool.free_num[c] < POOL_MAX_FREE && 
+        buffer_pool.stats.cached_bytes + size <= POOL_MAX_CACHED_BYTES) {
+      b->next = buffer_pool.free[c];
+      buffer_pool.free[c] = b;
+      buffer_pool.free_num[c] ++;
+      buffer_pool.stats.cached_bytes += size;
+      pthread_mutex_unlock (&buffer_pool.lock);
+      return;
+    }
+    buffer_pool.stats.resident_bytes -= size;
+  }
+  pthread_mutex_unlock (&buffer_pool.lock);
+  tfree (b->start, size);
   tfree (b, sizeof (*b));
 }
 
+void get_buffer_pool_stats (struct buffer_pool_stats *st) {
+  pthread_mutex_lock (&buffer_pool.lock);
+  *st = buffer_pool.stats;
+  pthread_mutex_unlock (&buffer_pool.lock);
+}
+
+/**
+ * Release all cached buffers
+ */
+void buffer_pool_trim (void) {
+  struct connection_buffer *list = 0;
+  int c;
+  pthread_mutex_lock (&buffer_pool.lock);
+  for (c = 0; c < POOL_CLASSES; c++) {
+    while (buffer_pool.free[c]) {
+      struct connection_buffer *b = buffer_pool.free[c];
+      buffer_pool.free[c] = b->next;
+      int size = b->end - b->start;
+      buffer_pool.stats.cached_bytes -= size;
+      buffer_pool.stats.resident_bytes -= size;
+      b->next = list;
+      list = b;
+    }
+    buffer_pool.free_num[c] = 0;
+  }
+  pthread_mutex_unlock (&buffer_pool.lock);
+  while (list) {
+    struct connection_buffer *b = list;
+    list = b->next;
+    tfree (b->start, b->end - b->start);
+    tfree (b, sizeof (*b));
+  }
+}
+
+#define OUT_BUFFER_SIZE (1 << 14)
+#define IN_BUFFER_SIZE (1 << 14)
+// smallest free space a read is attempted with
+#define IN_READ_MIN (1 << 12)
+// rpc_execute skips answers of this size (MAX_RESPONSE_SIZE), the header of a
+// frame may announce up to 64 MB
+#define IN_FRAME_MAX (1 << 24)
+
 int write_out (struct connection *c, const void *_data, int len) {
   const unsigned char *data = _data;
   if (!len) { return 0; }
   assert (len > 0);
   int x = 0;
   if (!c->out_head) {
-    struct connection_buffer *b = new_connection_buffer (1 << 20);
+    struct connection_buffer *b = new_connection_buffer (OUT_BUFFER_SIZE);
     c->out_head = c->out_tail = b;
   }
   while (len) {
@@ -145,7 +260,8 @@ int write_out (struct connection *c, const void *_data, int len) {
       x += y;
       len -= y;
       data += y;
-      struct connection_buffer *b = new_connection_buffer (1 << 20);
+      struct connection_buffer *b = new_connection_buffer (OUT_BUFFER_SIZE);
+      c->out_tail->wptr += y;
       c->out_tail->next = b;
       b->next = 0;
       c->out_tail = b;
@@ -155,70 +271,49 @@ int write_out (struct connection *c, const void *_data, int len) {
   return x;
 }
 
-int read_in (struct connection *c, void *_data, int len) {
-  unsigned char *data = _data;
-  if (!len) { return 0; }
+/**
+ * Return a pointer to at least len contiguous bytes at the end of the output chain,
+ * so that a frame can be built (e.g. encrypted) directly in place. Nothing is queued
+ * until commit_out is called.
+ */
+void *reserve_out (struct connection *c, int len) {
   assert (len > 0);
-  if (len > c->in_bytes) {
-    len = c->in_bytes;
-  }
-  int x = 0;
-  while (len) {
-    int y = c->in_head->wptr - c->in_head->rptr;
-    if (y > len) {
-      memcpy (data, c->in_head->rptr, len);
-      c->in_head->rptr += len;
-      c->in_bytes -= len;
-      return x + len;
+  if (!c->out_tail || c->out_tail->end - c->out_tail->wptr < len) {
+    struct connection_buffer *b = new_connection_buffer (len > OUT_BUFFER_SIZE ? len : OUT_BUFFER_SIZE);
+    if (c->out_tail) {
+      c->out_tail->next = b;
     } else {
-      memcpy (data, c->in_head->rptr, y);
-      c->in_bytes -= y;
-      x += y;
-      data += y;
-      len -= y;
-      void *old = c->in_head;
-      c->in_head = c->in_head->next;
-      if (!c->in_head) {
-        c->in_tail = 0;
-      }
-      delete_connection_buffer (old);
+      c->out_head = b;
     }
+    c->out_tail = b;
   }
-  return x;
+  return c->out_tail->wptr;
 }
 
-int read_in_lookup (struct connection *c, void *_data, int len) {
-  unsigned char *data = _data;
-  if (!len || !c->in_bytes) { return 0; }
-  assert (len > 0);
-  if (len > c->in_bytes) {
-    len = c->in_bytes;
-  }
-  int x = 0;
-  struct connection_buffer *b = c->in_head;
-  while (len) {
-    int y = b->wptr - b->rptr;
-    if (y >= len) {
-      memcpy (data, b->rptr, len);
-      return x + len;
-    } else {
-      memcpy (data, b->rptr, y);
-      x += y;
-      data += y;
-      len -= y;
-      b = b->next;
-    }
-  }
-  return x;
+/**
+ * Queue len bytes previously filled in at the pointer returned by reserve_out
+ */
+void commit_out (struct connection *c, int len) {
+  assert (len >= 0);
+  assert (c->out_tail && c->out_tail->end - c->out_tail->wptr >= len);
+  c->out_tail->wptr += len;
+  c->out_bytes += len;
 }
 
-void flush_out (struct connection *c UU) {
+/**
+ * Called once a complete frame was queued. Frames are not written one by one, the
+ * whole output chain leaves in a single writev once the socket becomes writable (see
+ * try_write). Only a backlog above OUT_FLUSH_WATERMARK is pushed out right away, so
+ * large uploads don't pile up in memory.
+ */
+#define OUT_FLUSH_WATERMARK (1 << 18)
+void flush_out (struct connection *c) {
+  if (c->state == conn_ready && c->out_bytes >= OUT_FLUSH_WATERMARK) {
+    // write errors fail the connection here just like in the event loop
+    try_write (c);
+  }
 }
 
-#define MAX_CONNECTIONS 100
-struct connection *Connections[MAX_CONNECTIONS];
-int max_connection_fd;
-
 void rotate_port (struct connection *c) {
   switch (c->port) {
   case 443:
@@ -245,10 +340,6 @@ void restart_connection (struct connection *c) {
     debug ("Can not create socket: %m\n");
     exit (1);
   }
-  assert (fd >= 0 && fd < MAX_CONNECTIONS);
-  if (fd > max_connection_fd) {
-    max_connection_fd = fd;
-  }
   int flags = -1;
   setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof (flags));
   setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &flags, sizeof (flags));
@@ -275,7 +366,6 @@ void restart_connection (struct connection *c) {
   c->state = conn_connecting;
   c->last_receive_time = get_double_time ();
   start_ping_timer (c);
-  Connections[fd] = c;
   
   char byte = 0xef;
   assert (write_out (c, &byte, 1) == 1);
@@ -288,144 +378,222 @@ void fail_connection (struct connection *c) {
 }
 
 extern FILE *log_net_f;
-int try_write (struct connection *c) {
-  debug ( "try write: fd = %d\n", c->fd);
+
+#define MAX_OUT_IOVECS 64
+
+/**
+ * Write as much of the output chain as possible, gathering up to MAX_OUT_IOVECS
+ * buffers per writev. Returns the amount of written bytes or -1 on a socket error.
+ */
+int write_out_chain (struct connection *c) {
   int x = 0;
   while (c->out_head) {
-    int r = write (c->fd, c->out_head->rptr, c->out_head->wptr - c->out_head->rptr);
+    struct iovec iov[MAX_OUT_IOVECS];
+    int n = 0;
+    int total = 0;
+    struct connection_buffer *b = c->out_head;
+    while (b && n < MAX_OUT_IOVECS) {
+      if (b->wptr != b->rptr) {
+        iov[n].iov_base = b->rptr;
+        iov[n].iov_len = b->wptr - b->rptr;
+        total += iov[n].iov_len;
+        n ++;
+      }
+      b = b->next;
+    }
+    int r = 0;
+    if (n) {
+      r = writev (c->fd, iov, n);
+      if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return -1;
+        }
+        break;
+      }
+    }
 
-	// Log all written packages
+    // Log all written packages
     if (r > 0 && log_net_f) {
-      // fprintf (log_net_f, "%.02lf %d OUT %s:%d", get_utime (CLOCK_REALTIME), r, c->ip, c->port);
-      int i;
-      for (i = 0; i < r; i++) {
-        // fprintf (log_net_f, " %02x", *(unsigned char *)(c->out_head->rptr + i));
-      }
-      fprintf (log_net_f, "\n");
+      fprintf (log_net_f, "%.02lf %d OUT %s:%d\n", get_utime (CLOCK_REALTIME), r, c->ip, c->port);
       fflush (log_net_f);
     }
-	
-    if (r >= 0) {
-      x += r;
-      c->out_head->rptr += r;
-      if (c->out_head->rptr != c->out_head->wptr) {
+
+    x += r;
+    c->out_bytes -= r;
+    int left = r;
+    while (c->out_head) {
+      struct connection_buffer *h = c->out_head;
+      int y = h->wptr - h->rptr;
+      if (y > left) {
+        h->rptr += left;
         break;
       }
-      struct connection_buffer *b = c->out_head;
-      c->out_head = b->next;
+      left -= y;
+      c->out_head = h->next;
       if (!c->out_head) {
         c->out_tail = 0;
       }
-      delete_connection_buffer (b);
-    } else {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        debug ("fail_connection: write_error %m\n");
-        fail_connection (c);
-        return 0;
-      } else {
-        break;
-      }
+      delete_connection_buffer (h);
+    }
+    if (r < total) {
+      break;
     }
   }
+  return x;
+}
+
+int try_write (struct connection *c) {
+  debug ( "try write: fd = %d\n", c->fd);
+  int x = write_out_chain (c);
+  if (x < 0) {
+    debug ("fail_connection: write_error %m\n");
+    fail_connection (c);
+    return 0;
+  }
   debug ( "Sent %d bytes to %d\n", x, c->fd);
-  c->out_bytes -= x;
   return x;
 }
 
-void hexdump_buf (struct connection_buffer *b) {
-  // TODO: figure out how to log hexdumps to purple log
-  int pos = 0;
-  int rem = 8;
-  while (b) { 
-    unsigned char *c = b->rptr;
-    while (c != b->wptr) {
-      if (rem == 8) {
-        //if (pos) { printf ("\n"); }
-        //printf ("%04d", pos);
-      }
-      //printf (" %02x", (int)*c);
-      rem --;
-      pos ++;
-      if (!rem) {
-        rem = 8;
-      }
-      c ++;
-    }
-    b = b->next;
+/**
+ * Return the length of the frame header at the start of data (1 or 4 bytes) and
+ * store the payload length in bytes into len, or return 0 if avail bytes are not
+ * enough to tell
+ */
+static int in_frame_header (unsigned char *data, int avail, int *len) {
+  if (avail < 1) { return 0; }
+  if (data[0] >= 1 && data[0] <= 0x7e) {
+    *len = 4 * data[0];
+    return 1;
   }
-  //printf ("\n");
-    
+  if (avail < 4) { return 0; }
+  *len = 4 * (data[1] | (data[2] << 8) | (data[3] << 16));
+  return 4;
+}
+
+/**
+ * Offset from the buffer start at which a frame beginning with the given header
+ * byte must be placed so that its payload ends up int aligned
+ */
+static int in_frame_align (unsigned char t) {
+  return (t >= 1 && t <= 0x7e) ? 3 : 0;
 }
 
 void try_rpc_read (struct connection *c) {
-  assert (c->in_head);
-  if (verbosity >= 3) {
-    hexdump_buf (c->in_head);
-  }
+  assert (c->in);
+  struct connection_buffer *b = c->in;
 
   while (1) {
-    if (c->in_bytes < 1) { return; }
-    unsigned len = 0;
-    unsigned t = 0;
-    assert (read_in_lookup (c, &len, 1) == 1);
-    if (len >= 1 && len <= 0x7e) {
-      if (c->in_bytes < (int)(1 + 4 * len)) { return; }
-    } else {
-      if (c->in_bytes < 4) { return; }
-      assert (read_in_lookup (c, &len, 4) == 4);
-      len = (len >> 8);
-      if (c->in_bytes < (int)(4 + 4 * len)) { return; }
-      len = 0x7f;
+    int len;
+    int hdr = in_frame_header (b->rptr, c->in_bytes, &len);
+    if (!hdr || c->in_bytes < hdr + len) { break; }
+    assert (len >= 4);
+
+    // The parser reads the payload as ints in place. The header is at least one
+    // byte long, so a misaligned payload can always be slid back over it.
+    unsigned char *data = b->rptr + hdr;
+    int mis = (long)data & 3;
+    if (mis) {
+      memmove (data - mis, data, len);
+      data -= mis;
     }
+    b->rptr += hdr + len;
+    c->in_bytes -= hdr + len;
+    c->in_align = (hdr == 1) ? 3 : 0;
 
-    if (len >= 1 && len <= 0x7e) {
-      assert (read_in (c, &t, 1) == 1);    
-      assert (t == len);
-      assert (len >= 1);
-    } else {
-      assert (len == 0x7f);
-      assert (read_in (c, &len, 4) == 4);
-      len = (len >> 8);
-      assert (len >= 1);
+    // the payload stays valid until the next read into this connection
+    c->methods->execute (c, *(int *)data, len, (char *)data);
+  }
+  if (!c->in_bytes) {
+    b->rptr = b->wptr = b->start + c->in_align;
+    if (b->end - b->start > IN_BUFFER_SIZE) {
+      // do not pin the space of a big frame on an idle connection
+      delete_connection_buffer (b);
+      c->in = 0;
     }
-    len *= 4;
-    int op;
-    assert (read_in_lookup (c, &op, 4) == 4);
-    c->methods->execute (c, op, len);
   }
 }
 
+/**
+ * Return how many bytes are still missing to complete the frame at the head of
+ * the receive buffer, 0 if nothing is known about it yet or -1 if it is not
+ * shorter than IN_FRAME_MAX
+ */
+static int in_frame_missing (struct connection *c) {
+  int len;
+  int hdr = in_frame_header (c->in->rptr, c->in_bytes, &len);
+  if (!hdr) { return 0; }
+  if (len >= IN_FRAME_MAX) { return -1; }
+  return hdr + len > c->in_bytes ? hdr + len - c->in_bytes : 0;
+}
+
+/**
+ * Make room for at least len bytes behind the data in the receive buffer. The
+ * pending bytes are moved to the buffer start, or into a bigger buffer if they
+ * would not fit otherwise or fill more than half of it. Bigger buffers at least
+ * double, so a long backlog that is read before its frames are executed is
+ * copied only a constant number of times per byte.
+ */
+static void in_reserve (struct connection *c, int len) {
+  struct connection_buffer *b = c->in;
+  if (!b) {
+    b = c->in = new_connection_buffer (3 + (len > IN_BUFFER_SIZE ? len : IN_BUFFER_SIZE));
+    b->rptr = b->wptr = b->start + c->in_align;
+    return;
+  }
+  if (b->end - b->wptr >= len) { return; }
+  int used = b->wptr - b->rptr;
+  int off = used ? in_frame_align (*b->rptr) : c->in_align;
+  int size = b->end - b->start;
+  // moving the data down only pays off if that frees at least half the buffer
+  if (off + used + len > size || 2 * used > size) {
+    size = off + used + len > 2 * size ? off + used + len : 2 * size;
+    struct connection_buffer *n = new_connection_buffer (size);
+    memcpy (n->start + off, b->rptr, used);
+    delete_connection_buffer (b);
+    b = c->in = n;
+  } else {
+    memmove (b->start + off, b->rptr, used);
+  }
+  b->rptr = b->start + off;
+  b->wptr = b->rptr + used;
+}
+
 void try_read (struct connection *c) {
   debug ( "try read: fd = %d\n", c->fd);
-  if (!c->in_tail) {
-    c->in_head = c->in_tail = new_connection_buffer (1 << 20);
-  }
   int x = 0;
   while (1) {
-    int r = read (c->fd, c->in_tail->wptr, c->in_tail->end - c->in_tail->wptr);
+    // read whole frames straight into place once their length is known
+    int missing = c->in ? in_frame_missing (c) : 0;
+    if (missing < 0) {
+      // checked before the buffer grows to the announced length
+      debug ("fail_connection: frame too long\n");
+      fail_connection (c);
+      return;
+    }
+    in_reserve (c, missing > IN_READ_MIN ? missing : IN_READ_MIN);
+    struct connection_buffer *b = c->in;
+    int r = read (c->fd, b->wptr, b->end - b->wptr);
     if (r > 0 && log_net_f) {
       fprintf (log_net_f, "%.02lf %d IN %s:%d", get_utime (CLOCK_REALTIME), r, c->ip, c->port);
       int i;
       for (i = 0; i < r; i++) {
-        fprintf (log_net_f, " %02x", *(unsigned char *)(c->in_tail->wptr + i));
+        fprintf (log_net_f, " %02x", *(unsigned char *)(b->wptr + i));
       }
       fprintf (log_net_f, "\n");
       fflush (log_net_f);
     }
     if (r > 0) {
       c->last_receive_time = get_double_time ();
-      stop_ping_timer (c);
+      // moves the armed ping timer
       start_ping_timer (c);
     }
     if (r >= 0) {
-      c->in_tail->wptr += r;
+      b->wptr += r;
+      c->in_bytes += r;
       x += r;
-      if (c->in_tail->wptr != c->in_tail->end) {
+      if (b->wptr != b->end) {
         break;
       }
-      struct connection_buffer *b = new_connection_buffer (1 << 20);
-      c->in_tail->next = b;
-      c->in_tail = b;
     } else {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         debug ("fail_connection: read_error %m\n");
@@ -438,14 +606,33 @@ void try_read (struct connection *c) {
   }
   debug ( "Received %d bytes from fd=#%d and DC %d(%s, %d)\n", x, 
     c->fd, c->session->dc->id, c->session->dc->ip, c->session->dc->port);
-  c->in_bytes += x;
   if (x) {
     try_rpc_read (c);
   }
 }
 
+/**
+ * Append the pending acks of S as msgs_ack to the packet of mt
+ */
+void out_acks (struct mtproto_connection *mt, struct session *S) {
+  out_int (mt, CODE_msgs_ack);
+  out_int (mt, CODE_vector);
+  out_int (mt, S->acks_num);
+  int i;
+  for (i = 0; i < S->acks_num; i++) {
+    out_long (mt, S->acks[i]);
+  }
+  S->acks_num = 0;
+}
+
+/**
+ * Send the pending acks of S in a message of their own
+ */
 int send_all_acks (struct session *S) {
   info ("send_all_acks(dc=%d)\n", S->dc->id);
+  if (!S->acks_num) {
+    return 0;
+  }
   if (!S->c) {
     warning ("WARNING: cannot send acks, session has no active connection");
     return -1;
@@ -453,28 +640,36 @@ int send_all_acks (struct session *S) {
   struct mtproto_connection *mt = S->c->mtconnection;
   
   clear_packet (mt);
-  out_int (mt, CODE_msgs_ack);
-  out_int (mt, CODE_vector);
-  out_int (mt, tree_count_long (S->ack_tree));
-  while (S->ack_tree) {
-    long long x = tree_get_min_long (S->ack_tree); 
-    out_long (mt, x);
-    S->ack_tree = tree_delete_long (S->ack_tree, x);
-  }
+  out_acks (mt, S);
   encrypt_send_message (mt, mt->packet_buffer, mt->packet_ptr - mt->packet_buffer, 0);
   return 0;
 }
 
-void insert_msg_id (struct session *S, long long id) {
-  if (!S->ack_tree) {
-    debug ("Creating ack_tree pointing to session %p\n");
-    S->ev.alarm = (void *)send_all_acks;
+static int ack_alarm (struct session *S) {
+  S->ack_timer = 0;
+  return send_all_acks (S);
+}
+
+void insert_msg_id (struct telegram *instance, struct session *S, long long id) {
+  if (S->acks_num && S->acks[S->acks_num - 1] == id) {
+    return;
+  }
+  if (S->acks_num == ACK_MAX) {
+    send_all_acks (S);
+  }
+  if (S->acks_num == ACK_MAX) {
+    // there is no connection to send them, the server repeats the oldest one
+    memmove (S->acks, S->acks + 1, (ACK_MAX - 1) * sizeof (S->acks[0]));
+    S->acks_num --;
+  }
+  S->acks[S->acks_num ++] = id;
+  if (!S->ack_timer) {
+    S->ack_timer = 1;
+    S->ev.alarm = (void *)ack_alarm;
     S->ev.self = (void *)S;
     S->ev.timeout = get_double_time () + ACK_TIMEOUT;
-    insert_event_timer (S->c->instance, &S->ev);
-  }
-  if (!tree_lookup_long (S->ack_tree, id)) {
-    S->ack_tree = tree_insert_long (S->ack_tree, id, lrand48 ());
+    // S->c is NULL while the session has no connection
+    insert_event_timer (instance, &S->ev);
   }
 }
 
@@ -488,10 +683,26 @@ struct dc *alloc_dc (struct dc* DC_list[], int id, char *ip, int port UU) {
   return DC;
 }
 
+/**
+ * Get the session num of DC, creating it if necessary
+ */
+struct session *dc_get_session (struct dc *DC, int num) {
+  assert (num >= 0 && num < MAX_DC_SESSIONS);
+  if (!DC->sessions[num]) {
+    struct session *S = talloc0 (sizeof (*S));
+    assert (RAND_pseudo_bytes ((unsigned char *) &S->session_id, 8) >= 0);
+    S->dc = DC;
+    S->num = num;
+    DC->sessions[num] = S;
+  }
+  return DC->sessions[num];
+}
+
 /** 
- * Wrap an existing socket file descriptor and make it usable as a connection,
+ * Wrap an existing socket file descriptor and make it usable as a connection
+ * of the session session_num
  */
-struct connection *fd_create_connection (struct dc *DC, int fd, 
+struct connection *fd_create_connection (struct dc *DC, int session_num, int fd,
      struct telegram *instance, struct connection_methods *methods, 
      struct mtproto_connection *mtp) {
   
@@ -505,20 +716,15 @@ struct connection *fd_create_connection (struct dc *DC, int fd,
   c->methods = methods;
   c->instance = instance;
   c->last_receive_time = get_double_time ();
-  debug ( "connect to %s:%d successful\n", DC->ip, DC->port);
+  debug ( "connect to %s:%d successful (session %d)\n", DC->ip, DC->port, session_num);
 
-  if (!DC->sessions[0]) {
-    struct session *S = talloc0 (sizeof (*S));
-    assert (RAND_pseudo_bytes ((unsigned char *) &S->session_id, 8) >= 0);
-    S->dc = DC;
+  struct session *S = dc_get_session (DC, session_num);
+  if (!S->c) {
     S->c = c;
-    DC->sessions[0] = S;
-  }
-  if (!DC->sessions[0]->c) {
-    DC->sessions[0]->c = c;
   }
+  S->connecting = 0;
   // add backreference to session
-  c->session = DC->sessions[0];
+  c->session = S;
 
   // add backreference to used mtproto-connection
   c->mtconnection = mtp;
@@ -536,12 +742,10 @@ void fd_close_connection(struct connection *c) {
     b = b->next;
     delete_connection_buffer (d);
   }
-  while (b) {
-    struct connection_buffer *d = b;
-    b = b->next;
-    delete_connection_buffer (d);
+  if (c->in) {
+    delete_connection_buffer (c->in);
   }
-  c->out_head = c->out_tail = c->in_head = c->in_tail = 0;
+  c->out_head = c->out_tail = c->in = 0;
   c->state = conn_stopped;
   c->out_bytes = c->in_bytes = 0;
   tfree(c, sizeof(struct connection));
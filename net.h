@@ -36,6 +36,7 @@ struct dc;
 #define TG_PORT 443
 
 #define ACK_TIMEOUT 1
+#define ACK_MAX 1024
 #define MAX_DC_ID 10
 
 // typedef struct mtproto_connection not available right now
@@ -45,18 +46,48 @@ struct connection;
 struct connection_methods {
   int (*ready) (struct connection *c);
   int (*close) (struct connection *c);
-  int (*execute) (struct connection *c, int op, int len);
+  int (*execute) (struct connection *c, int op, int len, char *data);
 };
 
 
 #define MAX_DC_SESSIONS 3
 
+/*
+ * Sessions of a DC, each one is carried by its own connection so that bulk
+ * transfers and synchronisation don't delay interactive queries
+ */
+#define SESSION_MAIN 0
+#define SESSION_BULK 1
+#define SESSION_SYNC 2
+
+struct query;
+
 struct session {
   struct dc *dc;
+  int num;
   long long session_id;
   int seq_no;
   struct connection *c;
-  struct tree_long *ack_tree;
+
+  // a connection for this session was requested and is not yet ready
+  int connecting;
+  // earliest time for the next connection attempt after a failure
+  double next_connect;
+
+  // queries waiting for the next flush, sent together in one container
+  struct query *out_head, *out_tail;
+  int out_num;
+  // queries sent on this session that wait for an answer
+  struct query *sent;
+  // unacknowledged queries on this session, and the bytes the transfers on
+  // it want in flight on top of QUERY_WINDOW_BYTES
+  int unacked_bytes;
+  int window_bytes;
+  // msg_ids to acknowledge, sent along with the next outgoing container or on
+  // their own once ev expires
+  long long acks[ACK_MAX];
+  int acks_num;
+  int ack_timer;
   struct event_timer ev;
 };
 
@@ -74,6 +105,16 @@ struct dc {
   int server_time_delta;
   double server_time_udelta;
   int has_auth;
+
+  // round trip time estimate and query timeout, see query_rtt_sample
+  double srtt;
+  double rttvar;
+  double rto;
+  int rtt_samples;
+  // queries sent to this DC that were not acknowledged yet
+  int unacked;
+  int unacked_bytes;
+  long long retransmits;
 };
 
 #define DC_SERIALIZED_MAGIC 0x64582faa
@@ -114,11 +155,13 @@ struct connection {
   int flags;
   enum conn_state state;
   int ipv6[4];
-  struct connection_buffer *in_head;
-  struct connection_buffer *in_tail;
+  // contiguous receive buffer, frames are decoded in place
+  struct connection_buffer *in;
   struct connection_buffer *out_head;
   struct connection_buffer *out_tail;
   int in_bytes;
+  // offset of the next frame from the buffer start that keeps its payload aligned
+  int in_align;
   int out_bytes;
   int packet_num;
   int out_packet_num;
@@ -129,20 +172,39 @@ struct connection {
   void *extra;
   struct event_timer ev;
   double last_receive_time;
+  // the ping in flight, its pong gives a round trip time
+  long long ping_msg_id;
+  double ping_time;
   struct telegram *instance;
   struct mtproto_connection *mtconnection;
 };
 
-extern struct connection *Connections[];
+/**
+ * Counters of the process wide connection buffer pool
+ */
+struct buffer_pool_stats {
+  long long hits;
+  long long misses;
+  // bytes allocated by the pool, either handed out or cached for reuse
+  long long resident_bytes;
+  // bytes currently handed out to connections
+  long long used_bytes;
+  // bytes kept in the free lists
+  long long cached_bytes;
+};
+
+void get_buffer_pool_stats (struct buffer_pool_stats *st);
+void buffer_pool_trim (void);
 
 int write_out (struct connection *c, const void *data, int len);
+void *reserve_out (struct connection *c, int len);
+void commit_out (struct connection *c, int len);
 void flush_out (struct connection *c);
-int read_in (struct connection *c, void *data, int len);
 
 void create_all_outbound_connections (void);
 
-void dc_create_session (struct dc *DC);
-void insert_msg_id (struct session *S, long long id);
+struct session *dc_get_session (struct dc *DC, int num);
+void insert_msg_id (struct telegram *instance, struct session *S, long long id);
 struct dc *alloc_dc (struct dc* DC_list[], int id, char *ip, int port);
 
 #define GET_DC(c) (c->session->dc)
@@ -152,12 +214,13 @@ void try_read (struct connection *c);
 void try_rpc_read (struct connection *c);
 int try_write (struct connection *c);
 
-struct connection *fd_create_connection (struct dc *DC, int fd, struct telegram *instance, 
-    struct connection_methods *methods, struct mtproto_connection *mtp);
+struct connection *fd_create_connection (struct dc *DC, int session_num, int fd,
+    struct telegram *instance, struct connection_methods *methods, struct mtproto_connection *mtp);
 void fd_close_connection(struct connection *c);
 
 void start_ping_timer (struct connection *c);
 void stop_ping_timer (struct connection *c);
 int send_all_acks (struct session *S);
+void out_acks (struct mtproto_connection *mt, struct session *S);
 
 #endif
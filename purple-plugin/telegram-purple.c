@@ -217,6 +217,15 @@ static void tgprpl_input_cb(gpointer data, gint source, PurpleInputCondition con
     }
 }
 
+/*
+ * The crypto pool has finished decrypting messages or file parts
+ */
+static void tgprpl_crypto_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    telegram_conn *conn = data;
+    telegram_crypto_ready (conn->tg);
+}
+
 /**
  * Telegram requests a new connectino to our configured proxy
  */
@@ -379,6 +388,11 @@ void tgprpl_login_on_connected(gpointer *data, gint fd, const gchar *error_messa
 
     if (fd == -1) {
         failure("purple_proxy_connect failed: %s\n", error_message);
+        if (req->type == REQ_SESSION) {
+            // only an additional session, keep using the main connection
+            telegram_session_failed (req);
+            return;
+        }
         telegram_destroy(tg);
         return;
     }
@@ -505,6 +519,8 @@ static void tgprpl_login(PurpleAccount * acct)
     purple_connection_set_protocol_data(gc, conn);
 
     tg->extra = conn;
+    conn->crypto_handle = purple_input_add (telegram_crypto_fd (tg), PURPLE_INPUT_READ,
+        tgprpl_crypto_cb, conn);
     purple_connection_set_state (conn->gc, PURPLE_CONNECTING);
     telegram_connect (tg);
 }
@@ -517,6 +533,7 @@ static void tgprpl_close(PurpleConnection * gc)
     purple_debug_info(PLUGIN_ID, "tgprpl_close()\n");
     telegram_conn *conn = purple_connection_get_protocol_data(gc);
     purple_timeout_remove(conn->timer);
+    purple_input_remove(conn->crypto_handle);
     telegram_destroy(conn->tg);
 }
 
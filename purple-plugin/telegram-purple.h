@@ -48,6 +48,11 @@ typedef struct {
      */
     guint timer;
 
+    /**
+     * Read handler of the crypto pool results
+     */
+    guint crypto_handle;
+
     /**
      * Queue of all new messages that need to be added to a chat
      */
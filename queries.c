@@ -21,11 +21,14 @@
 #include <string.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <math.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/utsname.h>
+#include <pthread.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -34,7 +37,6 @@
 #include "include.h"
 #include "mtproto-client.h"
 #include "queries.h"
-#include "tree.h"
 #include "loop.h"
 #include "structures.h"
 #include "net.h"
@@ -50,8 +52,6 @@
 #include "msglog.h"
 #include "purple-plugin/telegram-purple.h"
 
-#define sha1 SHA1
-
 #ifdef __APPLE__
 #define OPEN_BIN "open %s"
 #else
@@ -59,22 +59,20 @@
 #endif
 
 char *get_downloads_directory (void);
-int verbosity;
 int offline_mode = 0;
 
-#define memcmp8(a,b) memcmp ((a), (b), 8)
-DEFINE_TREE (query, struct query *, memcmp8, 0) ;
+#define QUERY_TABLE_MIN 64
 
-#define event_timer_cmp(a,b) ((a)->timeout > (b)->timeout ? 1 : ((a)->timeout < (b)->timeout ? -1 : (memcmp (a, b, sizeof (struct event_timer)))))
-DEFINE_TREE (timer, struct event_timer *, event_timer_cmp, 0)
 
 void out_peer_id (struct mtproto_connection *self, peer_id_t id);
-#define QUERY_TIMEOUT 6.0
 
 /**
  * Get the struct mtproto_connection connection this connection was attached to
  */
 struct mtproto_connection *query_get_mtproto(struct query *q) { 
+  if (q->session && q->session->c) {
+    return q->session->c->mtconnection;
+  }
   return q->DC->sessions[0]->c->mtconnection; 
 }
 
@@ -84,20 +82,172 @@ double get_double_time (void) {
   return tv.tv_sec + 1e-9 * tv.tv_nsec;
 }
 
+static unsigned query_hash (long long id, int size) {
+  // msg_ids are mostly time, multiply to spread the low bits as well
+  return (unsigned) (((unsigned long long) id * 0x9e3779b97f4a7c15ull) >> 32) & (size - 1);
+}
+
+static void query_table_put (struct query_table *T, struct query *q) {
+  unsigned i = query_hash (q->msg_id, T->size);
+  while (T->slots[i]) {
+    assert (T->slots[i]->msg_id != q->msg_id);
+    i = (i + 1) & (T->size - 1);
+  }
+  T->slots[i] = q;
+}
+
+static void query_table_resize (struct query_table *T, int size) {
+  struct query **old = T->slots;
+  int old_size = T->size;
+  T->slots = talloc0 (size * sizeof (struct query *));
+  T->size = size;
+  int i;
+  for (i = 0; i < old_size; i++) {
+    if (old[i]) {
+      query_table_put (T, old[i]);
+    }
+  }
+  if (old) {
+    tfree (old, old_size * sizeof (struct query *));
+  }
+}
+
+static void query_table_insert (struct query_table *T, struct query *q) {
+  // keep the load below 3/4
+  if (4 * (T->num + 1) > 3 * T->size) {
+    query_table_resize (T, T->size ? 2 * T->size : QUERY_TABLE_MIN);
+  }
+  query_table_put (T, q);
+  T->num ++;
+}
+
+static int query_table_find (struct query_table *T, long long id) {
+  if (!T->size) { return -1; }
+  unsigned i = query_hash (id, T->size);
+  while (T->slots[i]) {
+    if (T->slots[i]->msg_id == id) {
+      return i;
+    }
+    i = (i + 1) & (T->size - 1);
+  }
+  return -1;
+}
+
+static void query_table_delete (struct query_table *T, struct query *q) {
+  int i = query_table_find (T, q->msg_id);
+  assert (i >= 0 && T->slots[i] == q);
+  // move the following entries of the run back, so that lookups never have
+  // to step over holes
+  unsigned mask = T->size - 1;
+  unsigned j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    struct query *x = T->slots[j];
+    if (!x) { break; }
+    unsigned k = query_hash (x->msg_id, T->size);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      T->slots[i] = x;
+      i = j;
+    }
+  }
+  T->slots[i] = 0;
+  T->num --;
+}
+
+static void query_table_free (struct query_table *T) {
+  if (T->slots) {
+    tfree (T->slots, T->size * sizeof (struct query *));
+  }
+  memset (T, 0, sizeof (*T));
+}
+
+/**
+ * Forget the sent query q, it got an answer
+ */
+static void query_unlink (struct telegram *instance, struct query *q) {
+  query_table_delete (&instance->queries, q);
+  *q->pprev_sent = q->next_sent;
+  if (q->next_sent) {
+    q->next_sent->pprev_sent = q->pprev_sent;
+  }
+  q->next_sent = 0;
+  q->pprev_sent = 0;
+}
+
 struct query *query_get (struct telegram *instance, long long id) {
-  return tree_lookup_query (instance->queries_tree, (void *)&id);
+  int i = query_table_find (&instance->queries, id);
+  return i < 0 ? 0 : instance->queries.slots[i];
 }
 
-int alarm_query (struct query *q) {
-  assert (q);
+void query_rtt_sample (struct dc *DC, double rtt) {
+  if (rtt < 0) { return; }
+  if (!DC->rtt_samples) {
+    DC->srtt = rtt;
+    DC->rttvar = rtt / 2;
+  } else {
+    DC->rttvar = 0.75 * DC->rttvar + 0.25 * fabs (DC->srtt - rtt);
+    DC->srtt = 0.875 * DC->srtt + 0.125 * rtt;
+  }
+  DC->rtt_samples ++;
+  DC->rto = DC->srtt + 4 * DC->rttvar;
+  if (DC->rto < QUERY_RTO_MIN) { DC->rto = QUERY_RTO_MIN; }
+  if (DC->rto > QUERY_RTO_MAX) { DC->rto = QUERY_RTO_MAX; }
+  debug ("rtt sample %.3lf for dc %d: srtt=%.3lf rttvar=%.3lf rto=%.3lf\n", rtt, DC->id,
+      DC->srtt, DC->rttvar, DC->rto);
+}
+
+static double query_rto (struct dc *DC) {
+  return DC->rto ? DC->rto : QUERY_RTO_INIT;
+}
+
+int alarm_query (struct query *q);
+
+/**
+ * Arm the timeout of q, at least twice the previous one once it was sent
+ * again, spread a little so that the queries of a burst do not all time out
+ * together
+ */
+static void query_arm (struct telegram *instance, struct query *q) {
+  double t = query_rto (q->DC);
+  if (q->retries && t < 2 * q->rto) {
+    t = 2 * q->rto;
+  }
+  if (t > QUERY_RTO_MAX) { t = QUERY_RTO_MAX; }
+  q->rto = t;
+  if (q->retries) {
+    t *= 1 + 0.25 * drand48 ();
+  }
+  q->ev.alarm = (void *)alarm_query;
+  q->ev.self = (void *)q;
+  q->ev.timeout = get_double_time () + t;
+  insert_event_timer (instance, &q->ev);
+}
+
+/**
+ * The server has seen q, it no longer counts against the window of its session
+ */
+static void query_acked (struct telegram *instance, struct query *q) {
+  if (q->flags & QUERY_ACK_RECEIVED) { return; }
+  q->flags |= QUERY_ACK_RECEIVED;
+  remove_event_timer (instance, &q->ev);
+  q->DC->unacked --;
+  q->DC->unacked_bytes -= 4 * q->data_len;
+  q->session->unacked_bytes -= 4 * q->data_len;
+  // the answer to a query sent more than once cannot be told apart
+  if (!q->retries) {
+    query_rtt_sample (q->DC, get_double_time () - q->sent_time);
+  }
+}
+
+static void query_resend (struct query *q) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
-  debug ("Alarm query %lld\n", q->msg_id);
-  q->ev.timeout = get_double_time () + QUERY_TIMEOUT;
-  insert_event_timer (mtp->connection->instance, &q->ev);
+  q->retries ++;
+  query_arm (mtp->connection->instance, q);
 
-  if (q->session->c->out_bytes >= 100000) {
-    return 0;
+  if (mtp->connection->out_bytes >= 100000) {
+    return;
   }
+  q->DC->retransmits ++;
   
   clear_packet (mtp);
   out_int (mtp, CODE_msg_container);
@@ -107,56 +257,335 @@ int alarm_query (struct query *q) {
   out_int (mtp, 4 * q->data_len);
   out_ints (mtp, q->data, q->data_len);
   
-  encrypt_send_message (mtp, mtp->packet_buffer, mtp->packet_ptr - mtp->packet_buffer, 0);
+  q->container_id = encrypt_send_message (mtp, mtp->packet_buffer, mtp->packet_ptr - mtp->packet_buffer, 0);
+}
+
+int alarm_query (struct query *q) {
+  assert (q);
+  debug ("Alarm query %lld\n", q->msg_id);
+  // back off until the next sample shows the link is fine again, only once
+  // for all queries that timed out after the same timeout
+  double rto = 2 * q->rto < QUERY_RTO_MAX ? 2 * q->rto : QUERY_RTO_MAX;
+  if (rto > query_rto (q->DC)) {
+    q->DC->rto = rto;
+  }
+  query_resend (q);
   return 0;
 }
 
 void query_restart (struct telegram *instance, long long id) {
   struct query *q = query_get (instance, id);
   if (q) {
-    remove_event_timer (instance, &q->ev);
-    alarm_query (q);
+    query_resend (q);
+    return;
+  }
+  // id may name the container the queries went out in, this is rare enough
+  // to just look at all of them
+  struct query_table *T = &instance->queries;
+  int i;
+  for (i = 0; i < T->size; i++) {
+    q = T->slots[i];
+    if (q && q->container_id == id) {
+      query_resend (q);
+    }
+  }
+}
+
+void query_resend_session (struct telegram *instance UU, struct session *S) {
+  struct query *q;
+  for (q = S->sent; q; q = q->next_sent) {
+    if (!(q->flags & QUERY_ACK_RECEIVED)) {
+      query_resend (q);
+    }
+  }
+}
+
+/**
+ * Get the session num of DC to send a query on
+ *
+ * Additional sessions are only opened on the authorized working DC, as long as
+ * their connection is not ready the main session is used.
+ */
+static struct session *query_pick_session (struct telegram *instance, struct dc *DC, int num) {
+  struct session *S = DC->sessions[num];
+  if (S && S->c) {
+    return S;
   }
+  if (num != SESSION_MAIN && (DC->flags & 1) && instance->session_state == STATE_READY &&
+      DC == telegram_get_working_dc (instance) && 
+      (!S || (!S->connecting && S->next_connect <= get_double_time ()))) {
+    telegram_session_connect (instance, DC, num);
+  }
+  return DC->sessions[SESSION_MAIN];
 }
 
 struct query *send_query (struct telegram *instance, struct dc *DC, int ints, void *data, struct query_methods *methods, void *extra) {
-  info ("SEND_QUERY() size %d to DC %d(%s:%d)\n", 4 * ints, DC->id, DC->ip, DC->port);
+  return send_query_session (instance, DC, SESSION_MAIN, ints, data, methods, extra);
+}
+
+/**
+ * Payloads that are already compressed or encrypted
+ */
+static int query_incompressible (unsigned op) {
+  switch (op) {
+  case CODE_upload_save_file_part:
+  case CODE_upload_save_big_file_part:
+  case CODE_messages_send_encrypted:
+  case CODE_messages_send_encrypted_file:
+  case CODE_messages_send_encrypted_service:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Replace the data of q by gzip_packed if that saves at least an eighth of it
+ */
+static void query_gzip (struct telegram *instance, struct query *q) {
+  int len = 4 * q->data_len;
+  if (len < instance->gzip_threshold || query_incompressible (((unsigned *)q->data)[0])) {
+    return;
+  }
+  int max = len - len / 8;
+  char *buf = talloc (max);
+  double t = get_utime (CLOCK_THREAD_CPUTIME_ID);
+  int l = tdeflate (q->data, len, buf, max, GZIP_LEVEL);
+  instance->gzip.cpu_time += get_utime (CLOCK_THREAD_CPUTIME_ID) - t;
+  if (!l) {
+    // back off from payloads of this size
+    instance->gzip.skipped ++;
+    if (instance->gzip_threshold < GZIP_THRESHOLD_MAX) {
+      instance->gzip_threshold *= 2;
+    }
+    tfree (buf, max);
+    return;
+  }
+  if (instance->gzip_threshold > GZIP_THRESHOLD_MIN) {
+    instance->gzip_threshold /= 2;
+  }
+
+  // gzip_packed#3072cfa1 packed_data:bytes
+  int hdr = l < 254 ? 1 : 4;
+  int ints = 1 + (hdr + l + 3) / 4;
+  int *data = talloc0 (4 * ints);
+  data[0] = CODE_gzip_packed;
+  unsigned char *p = (void *)(data + 1);
+  if (hdr == 1) {
+    p[0] = l;
+  } else {
+    p[0] = 254;
+    p[1] = l & 0xff;
+    p[2] = (l >> 8) & 0xff;
+    p[3] = (l >> 16) & 0xff;
+  }
+  memcpy (p + hdr, buf, l);
+  tfree (buf, max);
+
+  instance->gzip.packed ++;
+  instance->gzip.bytes_in += len;
+  instance->gzip.bytes_out += 4 * ints;
+  tfree (q->data, len);
+  q->data = data;
+  q->data_len = ints;
+}
+
+void get_gzip_stats (struct telegram *instance, struct gzip_stats *st) {
+  *st = instance->gzip;
+}
+
+void get_query_stats (struct telegram *instance, int dc_id, struct query_stats *st) {
+  memset (st, 0, sizeof (*st));
+  assert (dc_id >= 0 && dc_id <= MAX_DC_ID);
+  struct dc *DC = instance->auth.DC_list[dc_id];
+  if (!DC) { return; }
+  st->srtt = DC->srtt;
+  st->rttvar = DC->rttvar;
+  st->rto = query_rto (DC);
+  st->rtt_samples = DC->rtt_samples;
+  st->unacked = DC->unacked;
+  st->unacked_bytes = DC->unacked_bytes;
+  st->retransmits = DC->retransmits;
+}
+
+struct query *send_query_session (struct telegram *instance, struct dc *DC, int session_num, int ints, void *data, struct query_methods *methods, void *extra) {
+  info ("SEND_QUERY() size %d to DC %d(%s:%d) session %d\n", 4 * ints, DC->id, DC->ip, DC->port, session_num);
+  struct session *S = query_pick_session (instance, DC, session_num);
   struct query *q = talloc0 (sizeof (*q));
   q->data_len = ints;
   q->data = talloc (4 * ints);
   memcpy (q->data, data, 4 * ints);
-  q->msg_id = encrypt_send_message (DC->sessions[0]->c->mtconnection, data, ints, 1);
-  q->session = DC->sessions[0];
-  q->seq_no = DC->sessions[0]->seq_no - 1; 
-  //debug ( "Msg_id is %lld %p\n", q->msg_id, q);
+  query_gzip (instance, q);
+  q->session = S;
   q->methods = methods;
   q->DC = DC;
-  if (instance->queries_tree) {
-    if (verbosity >= 2) {
-      debug ( "%lld %lld\n", q->msg_id, instance->queries_tree->x->msg_id);
-    }
+  q->extra = extra;
+
+  // sent on the next telegram_flush
+  if (S->out_tail) {
+    S->out_tail->next_out = q;
+  } else {
+    S->out_head = q;
+  }
+  S->out_tail = q;
+  S->out_num ++;
+  return q;
+}
+
+/*
+ * Containers are limited by the server, larger queries are sent on their own
+ */
+#define OUTBOX_MAX_QUERIES 1000
+#define OUTBOX_MAX_INTS (1 << 17)
+#define OUTBOX_SINGLE_INTS (1 << 14)
+
+static void query_sent (struct telegram *instance, struct query *q) {
+  //debug ( "Msg_id is %lld %p\n", q->msg_id, q);
+  query_table_insert (&instance->queries, q);
+  struct session *S = q->session;
+  q->next_sent = S->sent;
+  if (q->next_sent) {
+    q->next_sent->pprev_sent = &q->next_sent;
   }
+  q->pprev_sent = &S->sent;
+  S->sent = q;
 
-  instance->queries_tree = tree_insert_query (instance->queries_tree, q, lrand48 ());
   struct mtproto_connection *mtp = query_get_mtproto(q);
   ++ mtp->queries_num;
 
-  q->ev.alarm = (void *)alarm_query;
-  q->ev.timeout = get_double_time () + QUERY_TIMEOUT;
-  q->ev.self = (void *)q;
-  insert_event_timer (instance, &q->ev);
+  q->DC->unacked ++;
+  q->DC->unacked_bytes += 4 * q->data_len;
+  S->unacked_bytes += 4 * q->data_len;
+  q->sent_time = get_double_time ();
+  query_arm (instance, q);
+}
 
-  q->extra = extra;
-  return q;
+/**
+ * Whether a query of len bytes may be sent on S on top of the pending bytes
+ * already packed, at least one query is always allowed in flight
+ */
+static int query_window_open (struct session *S, int pending, int len) {
+  if (S->num == SESSION_MAIN) { return 1; }
+  int bytes = S->unacked_bytes + pending;
+  return !bytes || bytes + len <= QUERY_WINDOW_BYTES + S->window_bytes;
+}
+
+/**
+ * Pack the queries queued on S into msg_containers, so that a burst of queries
+ * costs one key derivation, one encryption and one frame. Pending acks of the
+ * session ride along.
+ */
+static void flush_outbox (struct telegram *instance, struct session *S) {
+  struct session *T = S->c ? S : S->dc->sessions[SESSION_MAIN];
+  if (!S->out_head || !T || !T->c) { return; }
+  struct mtproto_connection *mtp = T->c->mtconnection;
+  debug ("flush_outbox: %d queries for dc %d session %d\n", S->out_num, S->dc->id, T->num);
+
+  while (S->out_head) {
+    struct query *q = S->out_head;
+    if (!query_window_open (T, 0, 4 * q->data_len)) {
+      // sent once acks make room
+      debug ("flush_outbox: window of dc %d session %d full, %d bytes unacked\n", S->dc->id, T->num,
+          T->unacked_bytes);
+      break;
+    }
+    // a lone query only needs a container to carry pending acks
+    if ((!q->next_out && !T->acks_num) || q->data_len >= OUTBOX_SINGLE_INTS) {
+      S->out_head = q->next_out;
+      S->out_num --;
+      q->next_out = 0;
+      q->session = T;
+      q->msg_id = encrypt_send_message (mtp, q->data, q->data_len, 1);
+      q->seq_no = T->seq_no - 1;
+      query_sent (instance, q);
+      continue;
+    }
+
+    clear_packet (mtp);
+    out_int (mtp, CODE_msg_container);
+    int count_pos = mtp->packet_ptr - mtp->packet_buffer;
+    int count = 0;
+    out_int (mtp, 0);
+    struct query *first = q;
+    int bytes = 0;
+    while (q && count < OUTBOX_MAX_QUERIES && q->data_len < OUTBOX_SINGLE_INTS &&
+        (mtp->packet_ptr - mtp->packet_buffer) + 4 + q->data_len <= OUTBOX_MAX_INTS &&
+        query_window_open (T, bytes, 4 * q->data_len)) {
+      q->session = T;
+      q->msg_id = reserve_msg_id (mtp, 1, &q->seq_no);
+      out_long (mtp, q->msg_id);
+      out_int (mtp, q->seq_no);
+      out_int (mtp, 4 * q->data_len);
+      out_ints (mtp, q->data, q->data_len);
+      count ++;
+      bytes += 4 * q->data_len;
+      q = q->next_out;
+    }
+    if (T->acks_num) {
+      // piggyback the acks instead of sending them on their own later
+      int seq_no;
+      out_long (mtp, reserve_msg_id (mtp, 0, &seq_no));
+      out_int (mtp, seq_no);
+      out_int (mtp, 4 * (3 + 2 * T->acks_num));
+      out_acks (mtp, T);
+      count ++;
+    }
+    mtp->packet_buffer[count_pos] = count;
+    long long container_id = encrypt_send_message (mtp, mtp->packet_buffer, mtp->packet_ptr - mtp->packet_buffer, 0);
+
+    S->out_head = q;
+    q = first;
+    while (q != S->out_head) {
+      struct query *next = q->next_out;
+      q->next_out = 0;
+      q->container_id = container_id;
+      S->out_num --;
+      query_sent (instance, q);
+      q = next;
+    }
+  }
+  if (!S->out_head) {
+    S->out_tail = 0;
+  }
+}
+
+void flush_outboxes (struct telegram *instance) {
+  int i, j;
+  for (i = 0; i <= MAX_DC_ID; i++) {
+    struct dc *DC = instance->auth.DC_list[i];
+    if (!DC) { continue; }
+    for (j = 0; j < MAX_DC_SESSIONS; j++) {
+      if (DC->sessions[j] && DC->sessions[j]->out_head) {
+        flush_outbox (instance, DC->sessions[j]);
+      }
+    }
+  }
 }
 
 void query_ack (struct telegram *instance, long long id) {
   struct query *q = query_get (instance, id);
-  if (q && !(q->flags & QUERY_ACK_RECEIVED)) { 
+  if (q) { 
     assert (q->msg_id == id);
-    q->flags |= QUERY_ACK_RECEIVED; 
-    remove_event_timer (instance, &q->ev);
+    query_acked (instance, q);
+  }
+}
+
+/**
+ * Remove q and hand the error to its on_error
+ */
+static void query_fail (struct telegram *instance, struct query *q, int error_code, int error_len, char *err) {
+  struct mtproto_connection *mtp = query_get_mtproto(q);
+  query_acked (instance, q);
+  query_unlink (instance, q);
+  -- mtp->queries_num;
+
+  if (q->methods && q->methods->on_error) {
+    q->methods->on_error (q, error_code, error_len, err);
+  } else {
+    failure ( "error for query #%lld: #%d :%.*s\n", q->msg_id, error_code, error_len, err);
   }
+  tfree (q->data, q->data_len * 4);
+  tfree (q, sizeof (*q));
 }
 
 void query_error (struct telegram *instance, long long id) {
@@ -171,22 +600,8 @@ void query_error (struct telegram *instance, long long id) {
   if (!q) {
     failure ( "No such query\n");
   } else {
-    if (!(q->flags & QUERY_ACK_RECEIVED)) {
-      remove_event_timer (instance, &q->ev);
-    }
-    instance->queries_tree = tree_delete_query (instance->queries_tree, q);
-    -- mtp->queries_num;
-
-    if (q->methods && q->methods->on_error) {
-      q->methods->on_error (q, error_code, error_len, err);
-    } else {
-      failure ( "error for query #%lld: #%d :%.*s\n", id, error_code, error_len, err);
-    }
-    tfree (q->data, q->data_len * 4);
-    tfree (q, sizeof (*q));
-    return;
+    query_fail (instance, q, error_code, error_len, err);
   }
-
 }
 
 void query_result (struct telegram *instance, long long id UU) {
@@ -194,37 +609,33 @@ void query_result (struct telegram *instance, long long id UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
 
   debug ( "result for query #%lld\n", id);
-  if (verbosity  >= 4) {
+  if (instance->verbosity >= 4) {
     debug ( "result: ");
     hexdump_in (mtp);
   }
 
   int op = prefetch_int (mtp);
-  int *end = 0;
-  int *eend = 0;
+  int packed = 0;
+  struct packed_frame F;
   if (op == CODE_gzip_packed) {
     fetch_int (mtp);
-    int l = prefetch_strlen (mtp);
-    char *s = fetch_str (mtp, l);
-    int total_out = tinflate (s, l, instance->packed_buffer, MAX_PACKED_SIZE);
-    end = mtp->in_ptr;
-    eend = mtp->in_end;
-    //assert (total_out % 4 == 0);
-    mtp->in_ptr = instance->packed_buffer;
-    mtp->in_end = mtp->in_ptr + total_out / 4;
-    if (verbosity >= 4) {
-      debug ( "Unzipped data: ");
-      hexdump_in (mtp);
+    if (fetch_packed_begin (mtp, &F) < 0) {
+      // the answer is lost, and an acked query has no timer that would send it
+      // again, so it fails right away
+      if (q) {
+        char err[] = "BROKEN_GZIP_PACKED_ANSWER";
+        query_fail (instance, q, 500, sizeof (err) - 1, err);
+      }
+      return;
     }
+    packed = 1;
   }
   if (!q) {
     warning ( "No such query\n");
     mtp->in_ptr = mtp->in_end;
   } else {
-    if (!(q->flags & QUERY_ACK_RECEIVED)) {
-      remove_event_timer (instance, &q->ev);
-    }
-    instance->queries_tree = tree_delete_query (instance->queries_tree, q);
+    query_acked (instance, q);
+    query_unlink (instance, q);
     debug("queries_num: %d\n", -- mtp->queries_num);
 
     if (q->methods && q->methods->on_answer) {
@@ -234,63 +645,78 @@ void query_result (struct telegram *instance, long long id UU) {
     tfree (q->data, 4 * q->data_len);
     tfree (q, sizeof (*q));
   }
-  if (end) {
-    mtp->in_ptr = end;
-    mtp->in_end = eend;
+  if (packed) {
+    fetch_packed_end (mtp, &F);
   }
 } 
 
 
+static long long timer_tick_now (void) {
+  return (long long) (get_double_time () * TIMER_HZ);
+}
+
 void insert_event_timer (struct telegram *instance, struct event_timer *ev) {
   //  debug ( "INSERT: %lf %p %p\n", ev->timeout, ev->self, ev->alarm);
-  instance->timer_tree = tree_insert_timer (instance->timer_tree, ev, lrand48 ());
+  ev->expires = (long long) ceil (ev->timeout * TIMER_HZ);
+  timer_wheel_insert (&instance->timers, ev, timer_tick_now ());
 }
 
 void remove_event_timer (struct telegram *instance, struct event_timer *ev) {
   //  debug ( "REMOVE: %lf %p %p\n", ev->timeout, ev->self, ev->alarm);
-  instance->timer_tree = tree_delete_timer (instance->timer_tree, ev);
+  timer_wheel_remove (&instance->timers, ev);
 }
 
 double next_timer_in (struct telegram *instance) {
-  if (!instance->timer_tree) { return 1e100; }
-  return tree_get_min_timer (instance->timer_tree)->timeout;
+  long long next = timer_wheel_next (&instance->timers);
+  return next == LLONG_MAX ? 1e100 : (double) next / TIMER_HZ;
 }
 
 void work_timers (struct telegram *instance) {
   debug ("work_timers ()\n");
-  double t = get_double_time ();
-  while (instance->timer_tree) {
-    struct event_timer *ev = tree_get_min_timer (instance->timer_tree);
-    assert (ev);
-    if (ev->timeout > t) { break; }
-    remove_event_timer (instance, ev);
-    assert (ev->alarm);
-    debug ("Alarm\n");
-    ev->alarm (ev->self);
-  }
+  timer_wheel_run (&instance->timers, timer_tick_now ());
 }
 
 void free_timers (struct telegram *instance)
 {
-  while (instance->timer_tree) {
-    struct event_timer *ev = tree_get_min_timer (instance->timer_tree);
-    assert (ev);
-    debug ("freeing event timer with timeout: %d\n", ev->timeout);
-    remove_event_timer (instance, ev);
-    //tfree (ev, sizeof(struct event_timer));
-  }
+  timer_wheel_clear (&instance->timers);
 }
 
+static void free_lookups (struct telegram *instance);
+
 void free_queries (struct telegram *instance)
 {
-  while (instance->queries_tree) {
-    struct query *q = tree_get_min_query (instance->queries_tree);
-    assert (q);
-    debug ("freeing query with msg_id %d and len\n", q->msg_id, q->data_len);
-    tfree (q->data, 4 * q->data_len);
-    instance->queries_tree = tree_delete_query (instance->queries_tree, q);
-    //tfree (q, sizeof (struct query));
+  // queries that were sent, and those that were never flushed
+  int i, j;
+  for (i = 0; i <= MAX_DC_ID; i++) {
+    struct dc *DC = instance->auth.DC_list[i];
+    if (!DC) { continue; }
+    for (j = 0; j < MAX_DC_SESSIONS; j++) {
+      struct session *S = DC->sessions[j];
+      while (S && S->sent) {
+        struct query *q = S->sent;
+        debug ("freeing query with msg_id %lld and len %d\n", q->msg_id, q->data_len);
+        S->sent = q->next_sent;
+        remove_event_timer (instance, &q->ev);
+        tfree (q->data, 4 * q->data_len);
+        tfree (q, sizeof (*q));
+      }
+      while (S && S->out_head) {
+        struct query *q = S->out_head;
+        S->out_head = q->next_out;
+        tfree (q->data, 4 * q->data_len);
+        tfree (q, sizeof (*q));
+      }
+      if (S) {
+        S->out_tail = 0;
+        S->out_num = 0;
+        S->unacked_bytes = 0;
+      }
+    }
+    DC->unacked = 0;
+    DC->unacked_bytes = 0;
   }
+  query_table_free (&instance->queries);
+  free_lookups (instance);
 }
 
 //extern struct dc *DC_list[];
@@ -298,7 +724,7 @@ void free_queries (struct telegram *instance)
 
 void out_random (struct mtproto_connection *mtp, int n) {
   assert (n <= 32);
-  static char buf[32];
+  char buf[32];
   secure_random (buf, n);
   out_cstring (mtp, buf, n);
 }
@@ -312,7 +738,7 @@ void do_insert_header (struct mtproto_connection *mtp) {
     struct utsname st;
     uname (&st);
     out_string (mtp, st.machine);
-    static char buf[4096];
+    char buf[4096];
     tsnprintf (buf, sizeof (buf), "%.999s %.999s %.999s\n", st.sysname, st.release, st.version);
     out_string (mtp, buf);
     out_string (mtp, TG_VERSION " (build " TG_BUILD ")");
@@ -504,22 +930,18 @@ void do_phone_call (struct telegram *instance, const char *user) {
 /* }}} */
 
 /* {{{ Check phone */
-int check_phone_result;
-int cr_f (void) {
-  return check_phone_result >= 0;
-}
-
 int check_phone_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
 
   assert (fetch_int (mtp) == (int)CODE_auth_checked_phone);
-  check_phone_result = fetch_bool (mtp);
+  struct telegram *instance = mtp->connection->instance;
+  instance->check_phone_result = fetch_bool (mtp);
   fetch_bool (mtp);
 
-  assert (mtp->connection->instance->session_state == STATE_CONFIG_RECEIVED);
-  debug ("check_phone_result=%d\n", check_phone_result);
-  telegram_change_state (mtp->connection->instance, 
-     check_phone_result ? STATE_CLIENT_NOT_REGISTERED : STATE_PHONE_NOT_REGISTERED, NULL);
+  assert (instance->session_state == STATE_CONFIG_RECEIVED);
+  debug ("check_phone_result=%d\n", instance->check_phone_result);
+  telegram_change_state (instance, 
+     instance->check_phone_result ? STATE_CLIENT_NOT_REGISTERED : STATE_PHONE_NOT_REGISTERED, NULL);
   return 0;
 }
 
@@ -564,7 +986,7 @@ void do_auth_check_phone (struct telegram *instance, const char *user) {
   clear_packet (mtp);
   out_int (mtp, CODE_auth_check_phone);
   out_string (mtp, user);
-  check_phone_result = -1;
+  instance->check_phone_result = -1;
   struct dc *DC_working = telegram_get_working_dc(instance);
   send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, 
     &check_phone_methods, instance);
@@ -687,12 +1109,11 @@ int get_contacts_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
   int i;
   assert (fetch_int (mtp) == (int)CODE_contacts_contacts);
-  assert (fetch_int (mtp) == CODE_vector);
-  int n = fetch_int (mtp);
+  int n = fetch_vector_span (mtp, 3);
   for (i = 0; i < n; i++) {
-    assert (fetch_int (mtp) == (int)CODE_contact);
-    fetch_int (mtp); // id
-    fetch_int (mtp); // mutual
+    assert (span_int (mtp) == (int)CODE_contact);
+    span_int (mtp); // id
+    span_int (mtp); // mutual
   }
   assert (fetch_int (mtp) == CODE_vector);
   n = fetch_int (mtp);
@@ -713,7 +1134,7 @@ void do_update_contact_list (struct telegram *instance) {
   clear_packet (mtp);
   out_int (mtp, CODE_contacts_get_contacts);
   out_string (mtp, "");
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_contacts_methods, instance);
+  send_query_session (instance, DC_working, SESSION_SYNC, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_contacts_methods, instance);
 }
 
 
@@ -721,55 +1142,60 @@ void do_update_contact_list (struct telegram *instance) {
 
 /* {{{ Encrypt decrypted */
 
-char *encrypt_decrypted_message (struct mtproto_connection *mtp, struct secret_chat *E) {
-  static int msg_key[4];
-  static unsigned char sha1a_buffer[20];
-  static unsigned char sha1b_buffer[20];
-  static unsigned char sha1c_buffer[20];
-  static unsigned char sha1d_buffer[20];
+/**
+ * Encrypt the message between encr_ptr and encr_end in place and store its
+ * msg_key into msg_key
+ */
+void encrypt_decrypted_message (struct mtproto_connection *mtp, struct secret_chat *E, int msg_key[4]) {
+  unsigned char sha1a_buffer[20];
+  unsigned char sha1b_buffer[20];
+  unsigned char sha1c_buffer[20];
+  unsigned char sha1d_buffer[20];
   int x = *(mtp->encr_ptr);  
   assert (x >= 0 && !(x & 3));
   sha1 ((void *)mtp->encr_ptr, 4 + x, sha1a_buffer);
   memcpy (msg_key, sha1a_buffer + 4, 16);
  
-  static unsigned char buf[64];
-  memcpy (buf, msg_key, 16);
-  memcpy (buf + 16, E->key, 32);
-  sha1 (buf, 48, sha1a_buffer);
+  unsigned char buf[4][48];
+  memcpy (buf[0], msg_key, 16);
+  memcpy (buf[0] + 16, E->key, 32);
   
-  memcpy (buf, E->key + 8, 16);
-  memcpy (buf + 16, msg_key, 16);
-  memcpy (buf + 32, E->key + 12, 16);
-  sha1 (buf, 48, sha1b_buffer);
+  memcpy (buf[1], E->key + 8, 16);
+  memcpy (buf[1] + 16, msg_key, 16);
+  memcpy (buf[1] + 32, E->key + 12, 16);
   
-  memcpy (buf, E->key + 16, 32);
-  memcpy (buf + 32, msg_key, 16);
-  sha1 (buf, 48, sha1c_buffer);
+  memcpy (buf[2], E->key + 16, 32);
+  memcpy (buf[2] + 32, msg_key, 16);
   
-  memcpy (buf, msg_key, 16);
-  memcpy (buf + 16, E->key + 24, 32);
-  sha1 (buf, 48, sha1d_buffer);
+  memcpy (buf[3], msg_key, 16);
+  memcpy (buf[3] + 16, E->key + 24, 32);
 
-  static unsigned char key[32];
+  const unsigned char *in[4] = {buf[0], buf[1], buf[2], buf[3]};
+  unsigned char *out[4] = {sha1a_buffer, sha1b_buffer, sha1c_buffer, sha1d_buffer};
+  sha1_x4 (in, 48, out);
+
+  unsigned char key[32];
   memcpy (key, sha1a_buffer + 0, 8);
   memcpy (key + 8, sha1b_buffer + 8, 12);
   memcpy (key + 20, sha1c_buffer + 4, 12);
 
-  static unsigned char iv[32];
+  unsigned char iv[32];
   memcpy (iv, sha1a_buffer + 8, 12);
   memcpy (iv + 12, sha1b_buffer + 0, 8);
   memcpy (iv + 20, sha1c_buffer + 16, 4);
   memcpy (iv + 24, sha1d_buffer + 0, 8);
 
-  AES_KEY aes_key;
-  AES_set_encrypt_key (key, 256, &aes_key);
-  AES_ige_encrypt ((void *)mtp->encr_ptr, (void *)mtp->encr_ptr, 4 * (mtp->encr_end - mtp->encr_ptr), &aes_key, iv, 1);
-  memset (&aes_key, 0, sizeof (aes_key));
-
-  return (void *)msg_key;
+  struct aes_ige_key aes_key;
+  aes_ige_set_key (&aes_key, key, AES_ENCRYPT);
+  aes_ige (&aes_key, (void *)mtp->encr_ptr, (void *)mtp->encr_ptr, 4 * (mtp->encr_end - mtp->encr_ptr), iv);
+  aes_ige_clear (&aes_key);
+  memset (key, 0, sizeof (key));
+  memset (iv, 0, sizeof (iv));
+  memset (buf, 0, sizeof (buf));
 }
 
 void encr_start (struct mtproto_connection *mtp) {
+  packet_reserve (mtp, 8);
   mtp->encr_extra = mtp->packet_ptr;
   mtp->packet_ptr += 1; // str len
   mtp->packet_ptr += 2; // fingerprint
@@ -793,7 +1219,9 @@ void encr_finish (struct mtproto_connection *mtp, struct secret_chat *E) {
   mtp->encr_extra[4] = l * 4;
   mtp->encr_ptr = mtp->encr_extra + 4;
   mtp->encr_end = mtp->packet_ptr;
-  memcpy (mtp->encr_extra, encrypt_decrypted_message (mtp, E), 16);
+  int msg_key[4];
+  encrypt_decrypted_message (mtp, E, msg_key);
+  memcpy (mtp->encr_extra, msg_key, 16);
 }
 /* }}} */
 
@@ -898,7 +1326,7 @@ void do_send_encr_msg (struct telegram *instance, struct message *M) {
   encr_start (mtp);
   out_int (mtp, CODE_decrypted_message);
   out_long (mtp, M->id);
-  static int buf[4];
+  int buf[4];
   secure_random (buf, 16);
   out_cstring (mtp, (void *)buf, 16);
   out_cstring (mtp, (void *)M->message, M->message_len);
@@ -957,7 +1385,7 @@ void do_send_text (struct telegram *instance, peer_id_t id, char *file_name) {
     tfree_str (file_name);
     return;
   }
-  static char buf[(1 << 20) + 1];
+  char *buf = talloc ((1 << 20) + 1);
   int x = read (fd, buf, (1 << 20) + 1);
   assert (x >= 0);
   if (x == (1 << 20) + 1) {
@@ -970,6 +1398,7 @@ void do_send_text (struct telegram *instance, peer_id_t id, char *file_name) {
     tfree_str (file_name);
     close (fd);
   }
+  tfree (buf, (1 << 20) + 1);
 }
 /* }}} */
 
@@ -1061,7 +1490,7 @@ int get_history_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
   peer_id_t peer_id = extra->peer_id;
 
-  static struct message *ML[10000];
+  struct message *first = 0;
   int i;
   int x = fetch_int (mtp);
   if (x == (int)CODE_messages_messages_slice) {
@@ -1074,15 +1503,11 @@ int get_history_on_answer (struct query *q UU) {
   int n = fetch_int (mtp);
   for (i = 0; i < n; i++) {
     struct message *M = fetch_alloc_message (mtp, instance);
-    if (i <= 9999) {
-      ML[i] = M;
+    if (!i) {
+      first = M;
     }
   }
-  if (n > 10000) { n = 10000; }
   int sn = n;
-  for (i = n - 1; i >= 0; i--) {
-    //print_message (ML[i]);
-  }
   assert (fetch_int (mtp) == CODE_vector);
   n = fetch_int (mtp);
   for (i = 0; i < n; i++) {
@@ -1095,7 +1520,7 @@ int get_history_on_answer (struct query *q UU) {
   }
 
   if (sn > 0 && q->extra) {
-    do_messages_mark_read (instance, peer_id, ML[0]->id);
+    do_messages_mark_read (instance, peer_id, first->id);
   }
   free(extra);
   return 0;
@@ -1141,12 +1566,11 @@ void do_get_history (struct telegram *instance, peer_id_t id, int limit) {
   extra->instance = instance;
   extra->peer_id = id;
 
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_history_methods, extra);
+  send_query_session (instance, DC_working, SESSION_SYNC, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_history_methods, extra);
 }
 /* }}} */
 
 /* {{{ Get dialogs */
-int dialog_list_got;
 int get_dialogs_on_answer (struct query *q UU) {
   struct telegram *instance = q->extra;
   struct mtproto_connection *mtp = query_get_mtproto(q);
@@ -1158,8 +1582,8 @@ int get_dialogs_on_answer (struct query *q UU) {
   assert (fetch_int (mtp) == CODE_vector);
   int n, i;
   n = fetch_int (mtp);
-  static int dlist[2 * 100];
-  static peer_id_t plist[100];
+  int dlist[2 * 100];
+  peer_id_t plist[100];
   int dl_size = n;
   for (i = 0; i < n; i++) {
     assert (fetch_int (mtp) == CODE_dialog);
@@ -1212,7 +1636,7 @@ int get_dialogs_on_answer (struct query *q UU) {
   //pop_color ();
   //print_end ();
 
-  dialog_list_got = 1;
+  instance->dialog_list_got = 1;
   return 0;
 }
 
@@ -1229,19 +1653,43 @@ void do_get_dialog_list (struct telegram *instance) {
   out_int (mtp, 0);
   out_int (mtp, 0);
   out_int (mtp, 1000);
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_dialogs_methods, instance);
+  send_query_session (instance, DC_working, SESSION_SYNC, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_dialogs_methods, instance);
 }
 /* }}} */
 
 int allow_send_linux_version = 1;
 
 /* {{{ Send photo/video file */
+
+/*
+ * Files are uploaded through a window of parallel saveFilePart queries, parts of
+ * secret chat files are read and encrypted ahead by a worker thread since
+ * AES-IGE has to run in order
+ */
+#define UPLOAD_PART_MIN (32 << 10)
+#define UPLOAD_PART_MAX (512 << 10)
+#define UPLOAD_MAX_PARTS 3000
+#define UPLOAD_WINDOW_MAX 8
+// files of at least this size are sent with saveBigFilePart
+#define UPLOAD_BIG_FILE (16 << 20)
+
+struct upload_crypt;
+
 struct send_file {
   int fd;
   long long size;
   long long offset;
+  // next part to send
   int part_num;
   int part_size;
+  int parts_total;
+  int parts_done;
+  int inflight;
+  int window;
+  // acknowledged bytes, minimal round trip time and maximal rate for the window
+  long long acked;
+  double min_rtt;
+  double max_rate;
   long long id;
   long long thumb_id;
   peer_id_t to_id;
@@ -1251,8 +1699,139 @@ struct send_file {
   unsigned char *iv;
   unsigned char *init_iv;
   unsigned char *key;
+  struct upload_crypt *crypt;
+  // window bytes asked for on the bulk session
+  int reserved;
+};
+
+/**
+ * Read and encrypt the parts of a secret chat file ahead of the network
+ */
+struct upload_crypt {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct send_file *f;
+  // parts produced by the worker and taken by the event loop, the buffers are
+  // allocated by the event loop
+  int produced;
+  int taken;
+  char *data[UPLOAD_WINDOW_MAX];
+  int len[UPLOAD_WINDOW_MAX];
 };
 
+static void *upload_crypt_worker (void *arg) {
+  struct upload_crypt *C = arg;
+  struct send_file *f = C->f;
+  struct aes_ige_key aes_key;
+  aes_ige_set_key (&aes_key, f->key, AES_ENCRYPT);
+  int num;
+  for (num = 0; num < f->parts_total; num++) {
+    pthread_mutex_lock (&C->lock);
+    while (C->produced - C->taken >= UPLOAD_WINDOW_MAX) {
+      pthread_cond_wait (&C->cond, &C->lock);
+    }
+    pthread_mutex_unlock (&C->lock);
+
+    char *buf = C->data[num % UPLOAD_WINDOW_MAX];
+    int x = pread (f->fd, buf, f->part_size, (long long)num * f->part_size);
+    assert (x > 0);
+    if (x & 15) {
+      assert (num == f->parts_total - 1);
+      secure_random (buf + x, (-x) & 15);
+      x = (x + 15) & ~15;
+    }
+    aes_ige (&aes_key, (void *)buf, (void *)buf, x, f->iv);
+
+    pthread_mutex_lock (&C->lock);
+    C->len[num % UPLOAD_WINDOW_MAX] = x;
+    C->produced ++;
+    pthread_cond_broadcast (&C->cond);
+    pthread_mutex_unlock (&C->lock);
+  }
+  aes_ige_clear (&aes_key);
+  return 0;
+}
+
+static void upload_crypt_start (struct send_file *f) {
+  struct upload_crypt *C = talloc0 (sizeof (*C));
+  C->f = f;
+  int i;
+  for (i = 0; i < UPLOAD_WINDOW_MAX; i++) {
+    // room for the padding of the last part
+    C->data[i] = talloc (f->part_size + 16);
+  }
+  pthread_mutex_init (&C->lock, 0);
+  pthread_cond_init (&C->cond, 0);
+  f->crypt = C;
+  assert (!pthread_create (&C->thread, 0, upload_crypt_worker, C));
+}
+
+/**
+ * Get the next encrypted part, only waits if the worker fell behind the network
+ */
+static char *upload_crypt_peek (struct send_file *f, int *len) {
+  struct upload_crypt *C = f->crypt;
+  pthread_mutex_lock (&C->lock);
+  while (C->produced == C->taken) {
+    pthread_cond_wait (&C->cond, &C->lock);
+  }
+  char *buf = C->data[C->taken % UPLOAD_WINDOW_MAX];
+  *len = C->len[C->taken % UPLOAD_WINDOW_MAX];
+  pthread_mutex_unlock (&C->lock);
+  return buf;
+}
+
+/**
+ * Hand the buffer of the part returned by upload_crypt_peek back to the worker
+ */
+static void upload_crypt_release (struct send_file *f) {
+  struct upload_crypt *C = f->crypt;
+  pthread_mutex_lock (&C->lock);
+  C->taken ++;
+  pthread_cond_broadcast (&C->cond);
+  pthread_mutex_unlock (&C->lock);
+}
+
+static void upload_crypt_finish (struct send_file *f) {
+  struct upload_crypt *C = f->crypt;
+  assert (!pthread_join (C->thread, 0));
+  assert (C->produced == C->taken);
+  pthread_mutex_destroy (&C->lock);
+  pthread_cond_destroy (&C->cond);
+  int i;
+  for (i = 0; i < UPLOAD_WINDOW_MAX; i++) {
+    tfree (C->data[i], f->part_size + 16);
+  }
+  tfree (C, sizeof (*C));
+  f->crypt = 0;
+}
+
+/**
+ * Smallest power of two part size that needs at most UPLOAD_MAX_PARTS parts and
+ * lets a full window cover twice the bandwidth-delay product seen by the last
+ * upload. Until an upload has measured the link, big files use the largest
+ * parts.
+ */
+static int upload_part_size (struct telegram *instance, long long size) {
+  long long want = 2 * instance->up_bdp / (UPLOAD_WINDOW_MAX - 1);
+  if (!instance->up_bdp && size >= UPLOAD_BIG_FILE) {
+    want = UPLOAD_PART_MAX;
+  }
+  if (want < (size + UPLOAD_MAX_PARTS - 1) / UPLOAD_MAX_PARTS) {
+    want = (size + UPLOAD_MAX_PARTS - 1) / UPLOAD_MAX_PARTS;
+  }
+  // a file that fits in a single part does not need more
+  if (want > size) {
+    want = size;
+  }
+  int part_size = UPLOAD_PART_MIN;
+  while (part_size < want && part_size < UPLOAD_PART_MAX) {
+    part_size *= 2;
+  }
+  return part_size;
+}
+
 void out_peer_id (struct mtproto_connection *self, peer_id_t id) {
   peer_t *U;
   switch (get_peer_type (id)) {
@@ -1279,15 +1858,65 @@ void out_peer_id (struct mtproto_connection *self, peer_id_t id) {
 struct send_file_extra {
   struct telegram *instance;
   struct send_file *file;
+  double sent;
+  long long acked;
 };
 
 void send_part (struct telegram *instance, struct send_file *f);
 
+/**
+ * Let the bulk session carry the window of f, its bandwidth-delay product
+ */
+static void send_file_reserve (struct telegram *instance, struct send_file *f, int bytes) {
+  struct session *S = dc_get_session (telegram_get_working_dc (instance), SESSION_BULK);
+  S->window_bytes += bytes - f->reserved;
+  f->reserved = bytes;
+}
+
+/**
+ * Adapt the window to the bandwidth-delay product, like downloads do
+ */
+static void send_file_adapt_window (struct telegram *instance, struct send_file *f, struct send_file_extra *extra) {
+  double rtt = get_double_time () - extra->sent;
+  if (rtt <= 0) { return; }
+  if (!f->min_rtt || rtt < f->min_rtt) {
+    f->min_rtt = rtt;
+  }
+  double rate = (f->acked - extra->acked) / rtt;
+  f->max_rate *= 0.95;
+  if (rate > f->max_rate) {
+    f->max_rate = rate;
+  }
+  instance->up_bdp = f->max_rate * f->min_rtt;
+  int w = (int)(2 * f->max_rate * f->min_rtt / f->part_size) + 1;
+  if (w > UPLOAD_WINDOW_MAX) { w = UPLOAD_WINDOW_MAX; }
+  if (w != f->window) {
+    debug ("upload window %d -> %d (rtt=%.3f rate=%.0f)\n", f->window, w, f->min_rtt, f->max_rate);
+    f->window = w;
+  }
+}
+
 int send_file_part_on_answer (struct query *q) {
+  struct mtproto_connection *mtp = query_get_mtproto (q);
+  struct send_file_extra *extra = q->extra;
+  struct send_file *f = extra->file;
+  assert (fetch_int (mtp) == (int)CODE_bool_true);
+  f->inflight --;
+  f->parts_done ++;
+  f->acked += f->part_size;
+  send_file_adapt_window (extra->instance, f, extra);
+  struct telegram *instance = extra->instance;
+  tfree (extra, sizeof (*extra));
+  send_part (instance, f);
+  return 0;
+}
+
+int send_file_thumb_on_answer (struct query *q) {
   struct mtproto_connection *mtp = query_get_mtproto (q);
   struct send_file_extra *extra = q->extra;
   assert (fetch_int (mtp) == (int)CODE_bool_true);
   send_part (extra->instance, extra->file);
+  tfree (extra, sizeof (*extra));
   return 0;
 }
 
@@ -1340,6 +1969,10 @@ struct query_methods send_file_part_methods = {
   .on_answer = send_file_part_on_answer
 };
 
+struct query_methods send_file_thumb_methods = {
+  .on_answer = send_file_thumb_on_answer
+};
+
 struct query_methods send_file_methods = {
   .on_answer = send_file_on_answer
 };
@@ -1348,59 +1981,78 @@ struct query_methods send_encr_file_methods = {
   .on_answer = send_encr_file_on_answer
 };
 
-void send_part (struct telegram *instance, struct send_file *f) {
+/**
+ * Send the next part of f
+ */
+static void send_file_part (struct telegram *instance, struct send_file *f) {
   struct mtproto_connection *mtp = instance->connection;
   struct dc *DC_working = telegram_get_working_dc(instance);
-  if (f->fd >= 0) {
-    if (!f->part_num) {
-      instance->cur_uploading_bytes += f->size;
-    }
-    clear_packet (mtp);
-    if (f->size < (16 << 20)) {
-      out_int (mtp, CODE_upload_save_file_part);      
-      out_long (mtp, f->id);
-      out_int (mtp, f->part_num ++);
-    } else {
-      out_int (mtp, CODE_upload_save_big_file_part);      
-      out_long (mtp, f->id);
-      out_int (mtp, f->part_num ++);
-      out_int (mtp, (f->size + f->part_size - 1) / f->part_size);
-    }
-    static char buf[512 << 10];
-    int x = read (f->fd, buf, f->part_size);
+  clear_packet (mtp);
+  if (f->size < UPLOAD_BIG_FILE) {
+    out_int (mtp, CODE_upload_save_file_part);      
+    out_long (mtp, f->id);
+    out_int (mtp, f->part_num);
+  } else {
+    out_int (mtp, CODE_upload_save_big_file_part);      
+    out_long (mtp, f->id);
+    out_int (mtp, f->part_num);
+    out_int (mtp, f->parts_total);
+  }
+  int x;
+  if (f->encr) {
+    char *buf = upload_crypt_peek (f, &x);
+    out_cstring (mtp, buf, x);
+    upload_crypt_release (f);
+  } else {
+    char *buf = talloc (f->part_size);
+    x = pread (f->fd, buf, f->part_size, (long long)f->part_num * f->part_size);
     assert (x > 0);
-    f->offset += x;
-    instance->cur_uploaded_bytes += x;
-    
+    out_cstring (mtp, buf, x);
+    tfree (buf, f->part_size);
+  }
+  f->part_num ++;
+  f->offset = f->part_num < f->parts_total ? (long long)f->part_num * f->part_size : f->size;
+  instance->cur_uploaded_bytes += x;
+  if (instance->verbosity >= 2) {
+    debug ("offset=%lld size=%lld\n", f->offset, f->size);
+  }
+  //update_prompt ();
+
+  struct send_file_extra *extra = talloc (sizeof (*extra));
+  extra->instance = instance;
+  extra->file = f;
+  extra->sent = get_double_time ();
+  extra->acked = f->acked;
+  f->inflight ++;
+  send_query_session (instance, DC_working, SESSION_BULK, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &send_file_part_methods, extra);
+}
+
+/**
+ * Keep the window of f full and send the message once all parts are stored
+ */
+void send_part (struct telegram *instance, struct send_file *f) {
+  struct mtproto_connection *mtp = instance->connection;
+  struct dc *DC_working = telegram_get_working_dc(instance);
+  if (!f->part_num && !f->inflight) {
+    instance->cur_uploading_bytes += f->size;
     if (f->encr) {
-      if (x & 15) {
-        assert (f->offset == f->size);
-        secure_random (buf + x, (-x) & 15);
-        x = (x + 15) & ~15;
-      }
-      
-      AES_KEY aes_key;
-      AES_set_encrypt_key (f->key, 256, &aes_key);
-      AES_ige_encrypt ((void *)buf, (void *)buf, x, &aes_key, f->iv, 1);
-      memset (&aes_key, 0, sizeof (aes_key));
+      upload_crypt_start (f);
     }
-    out_cstring (mtp, buf, x);
-    if (verbosity >= 2) {
-      debug ("offset=%lld size=%lld\n", f->offset, f->size);
+  }
+  if (f->parts_done < f->parts_total) {
+    send_file_reserve (instance, f, f->window * f->part_size);
+    while (f->inflight < f->window && f->part_num < f->parts_total) {
+      send_file_part (instance, f);
     }
-    if (f->offset == f->size) {
+    if (f->part_num == f->parts_total && f->fd >= 0) {
+      if (f->encr) {
+        upload_crypt_finish (f);
+      }
       close (f->fd);
       f->fd = -1;
-    } else {
-      assert (f->part_size == x);
     }
-    //update_prompt ();
-
-    struct send_file_extra *extra = malloc(sizeof(struct send_file_extra));
-    extra->instance = instance;
-    extra->file = f;
-    send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &send_file_part_methods, extra);
   } else {
+    send_file_reserve (instance, f, 0);
     instance->cur_uploaded_bytes -= f->size;
     instance->cur_uploading_bytes -= f->size;
     //update_prompt ();
@@ -1410,7 +2062,7 @@ void send_part (struct telegram *instance, struct send_file *f) {
       out_int (mtp, CODE_messages_send_media);
       out_peer_id (mtp, f->to_id);
       out_int (mtp, f->media_type);
-      if (f->size < (16 << 20)) {
+      if (f->size < UPLOAD_BIG_FILE) {
         out_int (mtp, CODE_input_file);
       } else {
         out_int (mtp, CODE_input_file_big);
@@ -1420,7 +2072,7 @@ void send_part (struct telegram *instance, struct send_file *f) {
       char *s = f->file_name + strlen (f->file_name);
       while (s >= f->file_name && *s != '/') { s --;}
       out_string (mtp, s + 1);
-      if (f->size < (16 << 20)) {
+      if (f->size < UPLOAD_BIG_FILE) {
         out_string (mtp, "");
       }
       if (f->media_type == CODE_input_media_uploaded_thumb_video || f->media_type == CODE_input_media_uploaded_thumb_document) {
@@ -1499,14 +2151,14 @@ void send_part (struct telegram *instance, struct send_file *f) {
       out_cstring (mtp, (void *)f->key, 32);
       out_cstring (mtp, (void *)f->init_iv, 32);
       encr_finish (mtp, &P->encr_chat);
-      if (f->size < (16 << 20)) {
+      if (f->size < UPLOAD_BIG_FILE) {
         out_int (mtp, CODE_input_encrypted_file_uploaded);
       } else {
         out_int (mtp, CODE_input_encrypted_file_big_uploaded);
       }
       out_long (mtp, f->id);
       out_int (mtp, f->part_num);
-      if (f->size < (16 << 20)) {
+      if (f->size < UPLOAD_BIG_FILE) {
         out_string (mtp, "");
       }
  
@@ -1549,7 +2201,10 @@ void send_file_thumb (struct telegram *instance, struct send_file *f) {
   out_long (mtp, f->thumb_id);
   out_int (mtp, 0);
   out_cstring (mtp, (void *)thumb_file, thumb_file_size);
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &send_file_part_methods, f);
+  struct send_file_extra *extra = talloc0 (sizeof (*extra));
+  extra->instance = instance;
+  extra->file = f;
+  send_query_session (instance, DC_working, SESSION_BULK, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &send_file_thumb_methods, extra);
 }
 
 void do_send_photo (struct telegram *instance, int type, peer_id_t to_id, char *file_name) {
@@ -1562,6 +2217,7 @@ void do_send_photo (struct telegram *instance, int type, peer_id_t to_id, char *
   struct stat buf;
   fstat (fd, &buf);
   long long size = buf.st_size;
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
   if (size <= 0) {
     debug ("File has zero length\n");
     tfree_str (file_name);
@@ -1573,15 +2229,13 @@ void do_send_photo (struct telegram *instance, int type, peer_id_t to_id, char *
   f->size = size;
   f->offset = 0;
   f->part_num = 0;
-  int tmp = ((size + 2999) / 3000);
-  f->part_size = (1 << 10);
-  while (f->part_size < tmp) {
-    f->part_size *= 2;
-  }
+  f->part_size = upload_part_size (instance, size);
+  f->parts_total = (size + f->part_size - 1) / f->part_size;
+  f->window = 1;
 
-  if (f->part_size > (512 << 10)) {
+  if (f->parts_total > UPLOAD_MAX_PARTS) {
     close (fd);
-    failure ("Too big file. Maximal supported size is %d.\n", (512 << 10) * 1000);
+    failure ("Too big file. Maximal supported size is %lld.\n", (long long)UPLOAD_PART_MAX * UPLOAD_MAX_PARTS);
     tfree (f, sizeof (*f));
     tfree_str (file_name);
     return;
@@ -1700,6 +2354,72 @@ void do_rename_chat (struct telegram *instance, peer_id_t id, char *name UU) {
 }
 /* }}} */
 
+/* {{{ Coalesced user and chat info */
+
+/*
+ * User and chat info lookups are collected until the next telegram_flush. A
+ * lookup of a peer that is already pending or on its way only adds a waiter,
+ * the answer goes to all of them. Silent user lookups, as done for every new
+ * buddy, are answered from the peer cache when the full profile photo is known
+ * already. Users that are not known at all are first fetched together with
+ * users.getUsers, since users.getFullUser takes a single user.
+ */
+#define LOOKUP_BATCH_MAX 100
+
+struct peer_lookup {
+  peer_id_t id;
+  // waiters that want the user info shown, and whether any waits silently
+  int show_info;
+  int silent;
+  // queued for the next flush, or a query for it is on its way
+  int queued;
+  int inflight;
+  // users.getUsers was tried already
+  int resolved;
+  struct peer_lookup *next;
+};
+
+struct lookup_batch {
+  int num;
+  int ids[0];
+};
+
+static GHashTable **lookup_table (struct telegram *instance, peer_id_t id) {
+  return get_peer_type (id) == PEER_USER ? &instance->user_lookups : &instance->chat_lookups;
+}
+
+static struct peer_lookup *lookup_get (struct telegram *instance, peer_id_t id, int create) {
+  GHashTable **T = lookup_table (instance, id);
+  if (!*T) {
+    if (!create) { return 0; }
+    *T = g_hash_table_new (g_direct_hash, g_direct_equal);
+  }
+  struct peer_lookup *L = g_hash_table_lookup (*T, GINT_TO_POINTER (get_peer_id (id)));
+  if (!L && create) {
+    L = talloc0 (sizeof (*L));
+    L->id = id;
+    g_hash_table_insert (*T, GINT_TO_POINTER (get_peer_id (id)), L);
+  }
+  return L;
+}
+
+static void lookup_free (struct telegram *instance, struct peer_lookup *L) {
+  g_hash_table_remove (*lookup_table (instance, L->id), GINT_TO_POINTER (get_peer_id (L->id)));
+  tfree (L, sizeof (*L));
+}
+
+static void lookup_queue (struct telegram *instance, struct peer_lookup *L) {
+  if (L->queued || L->inflight) { return; }
+  L->queued = 1;
+  if (instance->lookups_tail) {
+    instance->lookups_tail->next = L;
+  } else {
+    instance->lookups_head = L;
+  }
+  instance->lookups_tail = L;
+}
+/* }}} */
+
 /* {{{ Chat info */
 void print_chat_info (struct chat *C) {
 
@@ -1731,17 +2451,25 @@ void print_chat_info (struct chat *C) {
 int chat_info_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
   struct chat *C = fetch_alloc_chat_full (mtp);
+  lookup_free (mtp->instance, q->extra);
   mtp->instance->config->on_chat_info_received (mtp->instance, C->id);
   return 0;
 }
 
+int chat_info_on_error (struct query *q, int error_code, int error_len, char *error) {
+  struct peer_lookup *L = q->extra;
+  warning ("chat info of %d failed: %d %.*s\n", get_peer_id (L->id), error_code, error_len, error);
+  lookup_free (query_get_mtproto (q)->instance, L);
+  return 0;
+}
+
 struct query_methods chat_info_methods = {
-  .on_answer = chat_info_on_answer
+  .on_answer = chat_info_on_answer,
+  .on_error = chat_info_on_error
 };
 
 void do_get_chat_info (struct telegram *instance, peer_id_t id) {
   debug ("do_get_chat_info (peer_id=%d)", id.id);
-  struct dc *DC_working = telegram_get_working_dc(instance);
   struct mtproto_connection *mtp = instance->connection;
   if (offline_mode) {
     peer_t *C = user_chat_get (mtp->bl, id);
@@ -1752,11 +2480,17 @@ void do_get_chat_info (struct telegram *instance, peer_id_t id) {
     }
     return;
   }
+  assert (get_peer_type (id) == PEER_CHAT);
+  lookup_queue (instance, lookup_get (instance, id, 1));
+}
+
+static void lookup_send_chat (struct telegram *instance, struct peer_lookup *L) {
+  struct mtproto_connection *mtp = instance->connection;
   clear_packet (mtp);
   out_int (mtp, CODE_messages_get_full_chat);
-  assert (get_peer_type (id) == PEER_CHAT);
-  out_int (mtp, get_peer_id (id));
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &chat_info_methods, 0);
+  out_int (mtp, get_peer_id (L->id));
+  L->inflight = 1;
+  send_query (instance, telegram_get_working_dc(instance), mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &chat_info_methods, L);
 }
 /* }}} */
 
@@ -1784,45 +2518,189 @@ void print_user_info (struct tgl_user *U) {
   //print_end ();
 }
 
-struct show_info_extra {
-    int show_info;
-};
+/**
+ * Hand U to all waiters of L
+ */
+static void lookup_user_done (struct telegram *instance, struct peer_lookup *L, struct tgl_user *U) {
+  int show_info = L->show_info;
+  int silent = L->silent;
+  // the handlers may look the user up again
+  lookup_free (instance, L);
+  int i;
+  for (i = 0; i < show_info; i++) {
+    event_user_info_received_handler (instance, U, 1);
+  }
+  if (!show_info && silent) {
+    event_user_info_received_handler (instance, U, 0);
+  }
+}
 
 int user_info_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
-  struct show_info_extra *extra = q->extra;
-
   struct tgl_user *U = fetch_alloc_user_full (mtp);
-  event_user_info_received_handler (mtp->instance, U, extra->show_info);
-  tfree (extra, sizeof(struct show_info_extra));
+  lookup_user_done (mtp->instance, q->extra, U);
   //print_user_info (U);
   return 0;
 }
 
+int user_info_on_error (struct query *q, int error_code, int error_len, char *error) {
+  struct peer_lookup *L = q->extra;
+  warning ("user info of %d failed: %d %.*s\n", get_peer_id (L->id), error_code, error_len, error);
+  lookup_free (query_get_mtproto (q)->instance, L);
+  return 0;
+}
+
 struct query_methods user_info_methods = {
-  .on_answer = user_info_on_answer
+  .on_answer = user_info_on_answer,
+  .on_error = user_info_on_error
 };
 
 void do_get_user_info (struct telegram *instance, peer_id_t id, int showInfo) {
   info ("do_get_user_info\n");
-  struct show_info_extra *extra = talloc(sizeof(struct show_info_extra));
-  extra->show_info = showInfo;
-  struct dc *DC_working = telegram_get_working_dc(instance);
+  assert (get_peer_type (id) == PEER_USER);
+  struct peer_lookup *L = lookup_get (instance, id, 1);
+  if (showInfo) {
+    L->show_info ++;
+  } else {
+    L->silent = 1;
+  }
+  lookup_queue (instance, L);
+  debug ("do_get_user_info ready\n");
+}
+
+static void lookup_send_full_user (struct telegram *instance, struct peer_lookup *L, peer_t *U) {
   struct mtproto_connection *mtp = instance->connection;
   clear_packet (mtp);
   out_int (mtp, CODE_users_get_full_user);
-  assert (get_peer_type (id) == PEER_USER);
-  peer_t *U = user_chat_get (mtp->bl, id);
   if (U && U->user.access_hash) {
     out_int (mtp, CODE_input_user_foreign);
-    out_int (mtp, get_peer_id (id));
+    out_int (mtp, get_peer_id (L->id));
     out_long (mtp, U->user.access_hash);
   } else {
     out_int (mtp, CODE_input_user_contact);
-    out_int (mtp, get_peer_id (id));
+    out_int (mtp, get_peer_id (L->id));
   }
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &user_info_methods, extra);
-  debug ("do_get_user_info ready\n");
+  L->inflight = 1;
+  send_query (instance, telegram_get_working_dc(instance), mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &user_info_methods, L);
+}
+
+/**
+ * Queue the lookups of the batch again, now that their users are known
+ */
+static void lookup_batch_done (struct telegram *instance, struct lookup_batch *B) {
+  int i;
+  for (i = 0; i < B->num; i++) {
+    struct peer_lookup *L = lookup_get (instance, MK_USER (B->ids[i]), 0);
+    if (L) {
+      L->inflight = 0;
+      lookup_queue (instance, L);
+    }
+  }
+  tfree (B, sizeof (*B) + 4 * B->num);
+}
+
+int lookup_users_on_answer (struct query *q) {
+  struct mtproto_connection *mtp = query_get_mtproto(q);
+  assert (fetch_int (mtp) == CODE_vector);
+  int n = fetch_int (mtp);
+  int i;
+  for (i = 0; i < n; i++) {
+    fetch_alloc_user (mtp);
+  }
+  lookup_batch_done (mtp->instance, q->extra);
+  return 0;
+}
+
+int lookup_users_on_error (struct query *q, int error_code, int error_len, char *error) {
+  warning ("users.getUsers failed: %d %.*s\n", error_code, error_len, error);
+  lookup_batch_done (query_get_mtproto (q)->instance, q->extra);
+  return 0;
+}
+
+struct query_methods lookup_users_methods = {
+  .on_answer = lookup_users_on_answer,
+  .on_error = lookup_users_on_error
+};
+
+static void lookup_send_users (struct telegram *instance, int num, int *ids) {
+  struct mtproto_connection *mtp = instance->connection;
+  struct lookup_batch *B = talloc (sizeof (*B) + 4 * num);
+  B->num = num;
+  memcpy (B->ids, ids, 4 * num);
+  clear_packet (mtp);
+  out_int (mtp, CODE_users_get_users);
+  out_int (mtp, CODE_vector);
+  out_int (mtp, num);
+  int i;
+  for (i = 0; i < num; i++) {
+    out_int (mtp, CODE_input_user_contact);
+    out_int (mtp, ids[i]);
+  }
+  send_query (instance, telegram_get_working_dc(instance), mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &lookup_users_methods, B);
+}
+
+/**
+ * Whether the full profile photo of U is known, all a silent lookup is for
+ */
+static int user_photo_cached (peer_t *U) {
+  if (!U || !(U->flags & FLAG_CREATED)) { return 0; }
+  return !U->user.photo_id || (U->user.photo.sizes_num && U->user.photo.id == U->user.photo_id);
+}
+
+void flush_lookups (struct telegram *instance) {
+  struct mtproto_connection *mtp = instance->connection;
+  if (!instance->lookups_head || !mtp) { return; }
+  int batch[LOOKUP_BATCH_MAX];
+  int n = 0;
+  struct peer_lookup *L;
+  while ((L = instance->lookups_head)) {
+    instance->lookups_head = L->next;
+    if (!instance->lookups_head) {
+      instance->lookups_tail = 0;
+    }
+    L->next = 0;
+    L->queued = 0;
+    if (get_peer_type (L->id) == PEER_CHAT) {
+      lookup_send_chat (instance, L);
+      continue;
+    }
+    peer_t *U = user_chat_get (mtp->bl, L->id);
+    if (!L->show_info && user_photo_cached (U)) {
+      lookup_user_done (instance, L, &U->user);
+      continue;
+    }
+    if ((!U || !(U->flags & FLAG_CREATED)) && !L->resolved) {
+      L->resolved = 1;
+      L->inflight = 1;
+      batch[n ++] = get_peer_id (L->id);
+      if (n == LOOKUP_BATCH_MAX) {
+        lookup_send_users (instance, n, batch);
+        n = 0;
+      }
+      continue;
+    }
+    lookup_send_full_user (instance, L, U);
+  }
+  if (n) {
+    lookup_send_users (instance, n, batch);
+  }
+}
+
+static void free_lookups (struct telegram *instance) {
+  GHashTable **tables[2] = { &instance->user_lookups, &instance->chat_lookups };
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (!*tables[i]) { continue; }
+    GHashTableIter it;
+    gpointer key, value;
+    g_hash_table_iter_init (&it, *tables[i]);
+    while (g_hash_table_iter_next (&it, &key, &value)) {
+      tfree (value, sizeof (struct peer_lookup));
+    }
+    g_hash_table_destroy (*tables[i]);
+    *tables[i] = 0;
+  }
+  instance->lookups_head = instance->lookups_tail = 0;
 }
 /* }}} */
 
@@ -1855,145 +2733,594 @@ void do_get_user_list_info_silent (struct telegram *instance, int num, int *list
     out_int (mtp, list[i]);
     //out_long (0);
   }
-  send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &user_list_info_silent_methods, 0);
+  send_query_session (instance, DC_working, SESSION_SYNC, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &user_list_info_silent_methods, 0);
 }
 /* }}} */
 
 
+struct download_part {
+  int offset;
+  int len;
+  unsigned char *data;
+  struct download_part *next;
+};
+
+/*
+ * Downloads are written to <name>.part, which is renamed once complete. The
+ * journal <name>.part.map holds a bitmap of the parts on disk so that an
+ * interrupted download resumes exactly where it stopped.
+ */
+#define DOWNLOAD_JOURNAL_MAGIC 0x70616d64
+// completed parts between two writes of the journal
+#define DOWNLOAD_JOURNAL_SYNC 16
+
+struct download_journal_header {
+  int magic;
+  int part_size;
+  long long size;
+  // IGE state after the last part on disk, for encrypted files
+  unsigned char iv[32];
+};
+
+static void download_temp_name (struct download *D, char *buf, int size, const char *suffix) {
+  assert (tsnprintf (buf, size, "%s%s", D->name, suffix) < size);
+}
+
+static int download_part_done (struct download *D, int part) {
+  return (D->done[part >> 3] >> (part & 7)) & 1;
+}
+
+/**
+ * A write of the journal, done by the crypto pool since fdatasync blocks for as
+ * long as the disk needs
+ */
+struct download_sync {
+  struct crypto_job job;
+  struct telegram *instance;
+  struct download *D;
+  int fd;
+  int journal_fd;
+  // the last sync before the download ends or is aborted, closes the files
+  int final;
+  int end;
+  struct download_journal_header H;
+  int len;
+  unsigned char done[0];
+};
+
+static void download_sync_work (struct crypto_job *J) {
+  struct download_sync *C = (void *)J;
+  // the bitmap may only name parts that are on disk
+  fdatasync (C->fd);
+  if (pwrite (C->journal_fd, &C->H, sizeof (C->H), 0) != sizeof (C->H) ||
+      pwrite (C->journal_fd, C->done, C->len, sizeof (C->H)) != C->len) {
+    warning ("cannot write download journal of %s: %m\n", C->D->name);
+  }
+}
+
+void end_load (struct telegram *instance, struct download *D);
+static void abort_load (struct telegram *instance, struct download *D);
+static void download_sync_done (struct crypto_job *J) {
+  struct download_sync *C = (void *)J;
+  struct download *D = C->D;
+  struct telegram *instance = C->instance;
+  assert (D->sync == C);
+  D->sync = 0;
+  int final = C->final, end = C->end;
+  tfree (C, sizeof (*C) + C->len);
+  if (!final) {
+    load_next_part (instance, D);
+    return;
+  }
+  close (D->fd);
+  close (D->journal_fd);
+  D->fd = -1;
+  D->journal_fd = -1;
+  if (end) {
+    end_load (instance, D);
+  } else {
+    abort_load (instance, D);
+  }
+}
+
+static void download_sync_discard (struct crypto_job *J) {
+  struct download_sync *C = (void *)J;
+  struct download *D = C->D;
+  D->sync = 0;
+  if (C->final) {
+    close (D->fd);
+    close (D->journal_fd);
+    D->fd = -1;
+    D->journal_fd = -1;
+  }
+  tfree (C, sizeof (*C) + C->len);
+}
+
+/**
+ * Write the bitmap once the data it describes is on disk. At most one sync of
+ * D is in the pool, parts completed meanwhile go with the next one.
+ */
+static void download_journal_sync (struct telegram *instance, struct download *D, int final) {
+  assert (!D->sync);
+  int len = (D->parts_total + 7) >> 3;
+  struct download_sync *C = talloc0 (sizeof (*C) + len);
+  C->job.work = download_sync_work;
+  C->job.done = download_sync_done;
+  C->job.free = download_sync_discard;
+  C->instance = instance;
+  C->D = D;
+  C->fd = D->fd;
+  C->journal_fd = D->journal_fd;
+  C->final = final;
+  C->end = !D->cancelled;
+  C->H.magic = DOWNLOAD_JOURNAL_MAGIC;
+  C->H.part_size = D->part_size;
+  C->H.size = D->size;
+  if (D->iv) {
+    memcpy (C->H.iv, D->iv, 32);
+  }
+  C->len = len;
+  memcpy (C->done, D->done, len);
+  D->dirty = 0;
+  D->sync = C;
+  crypto_pool_submit (instance->crypto, &D->crypt_stream, &C->job);
+}
+
+/**
+ * Restore the bitmap from the journal, returns 0 if it does not match D
+ */
+static int download_journal_load (struct download *D) {
+  struct download_journal_header H;
+  int len = (D->parts_total + 7) >> 3;
+  if (pread (D->journal_fd, &H, sizeof (H), 0) != sizeof (H) ||
+      H.magic != DOWNLOAD_JOURNAL_MAGIC || H.size != D->size || H.part_size != D->part_size ||
+      pread (D->journal_fd, D->done, len, sizeof (H)) != len) {
+    memset (D->done, 0, len);
+    return 0;
+  }
+  if (D->iv) {
+    // encrypted parts are written in order, continue the IGE chain after them
+    int i = 0;
+    while (i < D->parts_total && download_part_done (D, i)) { i++; }
+    D->iv_offset = i * D->part_size;
+    for (; i < D->parts_total; i++) {
+      if (download_part_done (D, i)) {
+        memset (D->done, 0, len);
+        D->iv_offset = 0;
+        return 0;
+      }
+    }
+    memcpy (D->iv, H.iv, 32);
+  }
+  return 1;
+}
+
+static void download_part_completed (struct telegram *instance, struct download *D, int offset) {
+  int part = offset / D->part_size;
+  D->done[part >> 3] |= 1 << (part & 7);
+  if (++ D->dirty >= DOWNLOAD_JOURNAL_SYNC && D->journal_fd >= 0 && !D->sync) {
+    download_journal_sync (instance, D, 0);
+  }
+}
+
+/**
+ * Parts of an encrypted file that are decrypted by the crypto pool
+ */
+struct download_crypt {
+  struct crypto_job job;
+  struct telegram *instance;
+  struct download *D;
+  struct aes_ige_key aes_key;
+  unsigned char iv[32];
+  struct download_part *parts;
+};
+
+static void download_crypt_free (struct download_crypt *C) {
+  while (C->parts) {
+    struct download_part *P = C->parts;
+    C->parts = P->next;
+    tfree (P->data, P->len);
+    tfree (P, sizeof (*P));
+  }
+  aes_ige_clear (&C->aes_key);
+  memset (C->iv, 0, sizeof (C->iv));
+  tfree (C, sizeof (*C));
+}
+
+void free_download (struct download *D) {
+  // downloads end only once their parts and syncs are back from the crypto pool
+  assert (!D->crypt && !D->sync);
+  while (D->pending) {
+    struct download_part *P = D->pending;
+    D->pending = P->next;
+    tfree (P->data, P->len);
+    tfree (P, sizeof (*P));
+  }
+  if (D->iv) {
+    tfree_secure (D->iv, 32);
+  }
+  if (D->done) {
+    tfree (D->done, (D->parts_total + 7) >> 3);
+  }
+  if (D->name) {
+    tfree_str (D->name);
+  }
+  tfree (D, sizeof (*D));
+}
+
 void end_load (struct telegram *instance, struct download *D) {
+  if (D->done && D->journal_fd >= 0) {
+    // the data has to be on disk before the journal goes, ends again once synced
+    download_journal_sync (instance, D, 1);
+    return;
+  }
   instance->cur_downloading_bytes -= D->size;
   instance->cur_downloaded_bytes -= D->size;
   //update_prompt ();
-  close (D->fd);
+  assert (!D->pending);
+  if (D->done) {
+    // readers only ever see the complete file
+    char part[PATH_MAX], map[PATH_MAX];
+    download_temp_name (D, part, sizeof (part), ".part");
+    download_temp_name (D, map, sizeof (map), ".part.map");
+    if (D->fd >= 0) {
+      close (D->fd);
+    }
+    if (rename (part, D->name) < 0) {
+      warning ("cannot rename %s: %m\n", part);
+    }
+    unlink (map);
+  }
   debug ("Done: %s\n", D->name);
+  telegram_dl_done (instance, D);
   event_download_finished (instance, D);
-  instance->dl_curr = 0;
-  if (D->dc != telegram_get_working_dc(instance)->id) {
-    debug ("%d Not the working dc %d, closing...\n", D->dc, 
-        telegram_get_working_dc(instance)->id);
+  free_download (D);
+  telegram_dl_next (instance);
+}
+
+/**
+ * Stop a cancelled download once it has no more parts in flight, the partial
+ * file and its journal are kept to resume later
+ */
+static void abort_load (struct telegram *instance, struct download *D) {
+  if (D->done && D->journal_fd >= 0) {
+    download_journal_sync (instance, D, 1);
+    return;
   }
-  if (D->iv) {
-    tfree_secure (D->iv, 32);
+  debug ("Cancelled: %s\n", D->name);
+  if (D->done) {
+    instance->cur_downloading_bytes -= D->size;
+    instance->cur_downloaded_bytes -= D->delivered;
+    if (D->fd >= 0) {
+      close (D->fd);
+    }
   }
-  tfree_str (D->name);
-  tfree (D, sizeof (*D));
+  telegram_dl_done (instance, D);
+  free_download (D);
   telegram_dl_next (instance);
 }
 
 struct download_extra {
   struct telegram *instance;
   struct download *dl;
+  int offset;
+  double sent;
+  long long delivered;
 };
 
+/**
+ * Adapt the window to the bandwidth-delay product
+ *
+ * Every answer gives a sample of the delivery rate. While the window limits the
+ * transfer the rate grows with it and the window doubles every round trip, once
+ * the link is saturated it settles at twice the bandwidth-delay product.
+ */
+static void download_adapt_window (struct telegram *instance, struct download *D, struct download_extra *extra) {
+  double now = get_double_time ();
+  double rtt = now - extra->sent;
+  if (rtt <= 0) { return; }
+  if (!D->min_rtt || rtt < D->min_rtt) {
+    D->min_rtt = rtt;
+  }
+  double rate = (D->delivered - extra->delivered) / rtt;
+  D->max_rate *= 0.95;
+  if (rate > D->max_rate) {
+    D->max_rate = rate;
+  }
+  int w = (int)(2 * D->max_rate * D->min_rtt / D->part_size) + 1;
+  if (w > instance->dl_window_max) { w = instance->dl_window_max; }
+  if (w < 1) { w = 1; }
+  if (w != D->window) {
+    debug ("download window %d -> %d (rtt=%.3f rate=%.0f)\n", D->window, w, D->min_rtt, D->max_rate);
+    D->window = w;
+  }
+}
+
+static void download_write (struct download *D, int offset, void *data, int len) {
+  if (len > D->size - offset) {
+    len = D->size - offset;
+  }
+  if (len > 0) {
+    assert (pwrite (D->fd, data, len, offset) == len);
+  }
+}
+
+static void download_write_part (struct telegram *instance, struct download *D, struct download_part *P) {
+  download_write (D, P->offset, P->data, P->len);
+  download_part_completed (instance, D, P->offset);
+  D->iv_offset += P->len;
+  tfree (P->data, P->len);
+  tfree (P, sizeof (*P));
+}
+
+static void download_crypt_work (struct crypto_job *J) {
+  struct download_crypt *C = (void *)J;
+  struct download_part *P;
+  for (P = C->parts; P; P = P->next) {
+    aes_ige (&C->aes_key, P->data, P->data, P->len, C->iv);
+  }
+}
+
+static void download_flush_pending (struct telegram *instance, struct download *D);
+static void download_crypt_done (struct crypto_job *J) {
+  struct download_crypt *C = (void *)J;
+  struct download *D = C->D;
+  struct telegram *instance = C->instance;
+  assert (D->crypt == C);
+  D->crypt = 0;
+  memcpy (D->iv, C->iv, 32);
+  while (C->parts) {
+    struct download_part *P = C->parts;
+    C->parts = P->next;
+    download_write_part (instance, D, P);
+  }
+  download_crypt_free (C);
+  if (!D->cancelled) {
+    download_flush_pending (instance, D);
+  }
+  load_next_part (instance, D);
+}
+
+static void download_crypt_discard (struct crypto_job *J) {
+  struct download_crypt *C = (void *)J;
+  C->D->crypt = 0;
+  download_crypt_free (C);
+}
+
+/**
+ * Decrypt and write all parts of an encrypted file that are next in order.
+ * Runs of at least CRYPTO_OFFLOAD_MIN bytes go to the crypto pool.
+ */
+static void download_flush_pending (struct telegram *instance, struct download *D) {
+  if (D->crypt) {
+    // the pool still works on the parts before, they continue the chain
+    return;
+  }
+  int offset = D->iv_offset;
+  int bytes = 0;
+  struct download_part *P = D->pending, *last = 0;
+  while (P && P->offset == offset) {
+    offset += P->len;
+    bytes += P->len;
+    last = P;
+    P = P->next;
+  }
+  if (!last) { return; }
+
+  if (bytes >= CRYPTO_OFFLOAD_MIN) {
+    struct download_crypt *C = talloc0 (sizeof (*C));
+    C->job.work = download_crypt_work;
+    C->job.done = download_crypt_done;
+    C->job.free = download_crypt_discard;
+    C->instance = instance;
+    C->D = D;
+    aes_ige_set_key (&C->aes_key, D->key, AES_DECRYPT);
+    memcpy (C->iv, D->iv, 32);
+    C->parts = D->pending;
+    D->pending = last->next;
+    last->next = 0;
+    D->crypt = C;
+    crypto_pool_submit (instance->crypto, &D->crypt_stream, &C->job);
+    return;
+  }
+
+  struct aes_ige_key aes_key;
+  aes_ige_set_key (&aes_key, D->key, AES_DECRYPT);
+  while (D->pending && D->pending->offset == D->iv_offset) {
+    P = D->pending;
+    D->pending = P->next;
+    aes_ige (&aes_key, P->data, P->data, P->len, D->iv);
+    download_write_part (instance, D, P);
+  }
+  aes_ige_clear (&aes_key);
+}
+
+static void download_add_pending (struct download *D, int offset, void *data, int len) {
+  struct download_part *P = talloc (sizeof (*P));
+  P->offset = offset;
+  P->len = len;
+  P->data = talloc (len);
+  memcpy (P->data, data, len);
+  struct download_part **ptr = &D->pending;
+  while (*ptr && (*ptr)->offset < offset) {
+    ptr = &(*ptr)->next;
+  }
+  P->next = *ptr;
+  *ptr = P;
+}
+
 void load_next_part (struct telegram *instance, struct download *D);
 int download_on_answer (struct query *q) {
   struct download_extra *extra = q->extra;
   struct telegram *instance = extra->instance;
   struct mtproto_connection *mtp = query_get_mtproto(q);
-
   struct download *D = extra->dl;
-  free(extra);
 
   assert (fetch_int (mtp) == (int)CODE_upload_file);
   unsigned x = fetch_int (mtp);
   assert (x);
-  if (D->fd == -1) {
-    D->fd = open (D->name, O_CREAT | O_WRONLY, 0640);
-  }
   fetch_int (mtp); // mtime
   int len = prefetch_strlen (mtp);
   assert (len >= 0);
   instance->cur_downloaded_bytes += len;
+  D->delivered += len;
+  D->inflight --;
   //update_prompt ();
-  if (D->iv) {
-    unsigned char *ptr = (void *)fetch_str (mtp, len);
-    assert (!(len & 15));
-    AES_KEY aes_key;
-    AES_set_decrypt_key (D->key, 256, &aes_key);
-    AES_ige_encrypt (ptr, ptr, len, &aes_key, D->iv, 0);
-    memset (&aes_key, 0, sizeof (aes_key));
-    if (len > D->size - D->offset) {
-      len = D->size - D->offset;
+  if (D->cancelled) {
+    tfree (extra, sizeof (*extra));
+    if (!D->inflight && !D->crypt && !D->sync) {
+      abort_load (instance, D);
     }
-    assert (write (D->fd, ptr, len) == len);
-  } else {
-    assert (write (D->fd, fetch_str (mtp, len), len) == len);
-  }
-  D->offset += len;
-  if (D->offset < D->size) {
-    load_next_part (instance, D);
     return 0;
+  }
+  if (D->iv) {
+    void *ptr = fetch_str (mtp, len);
+    assert (!(len & 15));
+    download_add_pending (D, extra->offset, ptr, len);
+    download_flush_pending (instance, D);
   } else {
-    end_load (instance, D);
-    return 0;
+    download_write (D, extra->offset, fetch_str (mtp, len), len);
+    download_part_completed (instance, D, extra->offset);
   }
+  download_adapt_window (instance, D, extra);
+  tfree (extra, sizeof (*extra));
+  load_next_part (instance, D);
+  return 0;
 }
 
 struct query_methods download_methods = {
   .on_answer = download_on_answer
 };
 
+/**
+ * Name and open the target file of D and choose the part size, returns 0 if
+ * the file is already complete
+ */
+static int download_start (struct telegram *instance, struct download *D) {
+  char buf[PATH_MAX];
+  int l;
+
+  if (!D->id) {
+    l = tsnprintf (buf, sizeof (buf), "%s/download_%lld_%d", instance->download_path, D->volume, D->local_id);
+  } else {
+    l = tsnprintf (buf, sizeof (buf), "%s/download_%lld", instance->download_path, D->id);
+  }
+  if (l >= (int) sizeof (buf)) {
+    fatal ("Download filename is too long");
+    exit (1);
+  }
+  D->name = tstrdup (buf);
+  // files of a single part, like avatars and thumbnails, need no journal
+  D->journal_fd = -1;
+
+  // smallest power of two that holds the whole file, but at most dl_part_size
+  int max_part = instance->dl_part_size;
+  if (max_part > DOWNLOAD_PART_MAX) { max_part = DOWNLOAD_PART_MAX; }
+  D->part_size = DOWNLOAD_PART_MIN;
+  while (D->part_size < D->size && 2 * D->part_size <= max_part) {
+    D->part_size *= 2;
+  }
+  D->window = 1;
+
+  struct stat st;
+  if (stat (buf, &st) >= 0 && st.st_size >= D->size) {
+    instance->cur_downloading_bytes += D->size;
+    instance->cur_downloaded_bytes += D->size;
+    info ("Already downloaded\n");
+    return 0;
+  }
+
+  char part[PATH_MAX], map[PATH_MAX];
+  download_temp_name (D, part, sizeof (part), ".part");
+  download_temp_name (D, map, sizeof (map), ".part.map");
+  D->fd = open (part, O_CREAT | O_WRONLY, 0640);
+  assert (D->fd >= 0);
+  D->parts_total = (D->size + D->part_size - 1) / D->part_size;
+  D->done = talloc0 ((D->parts_total + 7) >> 3);
+  if (D->parts_total > 1) {
+    D->journal_fd = open (map, O_CREAT | O_RDWR, 0640);
+    assert (D->journal_fd >= 0);
+  }
+  long long resumed = 0;
+  if (D->journal_fd >= 0 && download_journal_load (D)) {
+    int i;
+    for (i = 0; i < D->parts_total; i++) {
+      if (download_part_done (D, i)) {
+        resumed += D->part_size;
+      }
+    }
+    debug ("resuming %s, %lld bytes on disk\n", D->name, resumed);
+  } else {
+    assert (ftruncate (D->fd, 0) >= 0);
+  }
+  if (D->journal_fd >= 0) {
+    // reserve the space up front, the parts arrive out of order
+    posix_fallocate (D->fd, 0, D->size);
+  }
+
+  instance->cur_downloading_bytes += D->size;
+  instance->cur_downloaded_bytes += resumed;
+  //update_prompt ();
+  return 1;
+}
+
+/**
+ * Request parts of D until the window is full
+ */
 void load_next_part (struct telegram *instance, struct download *D) {
   struct mtproto_connection *mtp = instance->connection;
-  if (!D->offset) {
-    static char buf[PATH_MAX];
-    int l;
-  
-    if (!D->id) {
-      l = tsnprintf (buf, sizeof (buf), "%s/download_%lld_%d", instance->download_path, D->volume, D->local_id);
-    } else {
-      l = tsnprintf (buf, sizeof (buf), "%s/download_%lld", instance->download_path, D->id);
+  if (D->cancelled) {
+    if (!D->inflight && !D->crypt && !D->sync) {
+      abort_load (instance, D);
     }
-    if (l >= (int) sizeof (buf)) {
-      fatal ("Download filename is too long");
-      exit (1);
+    return;
+  }
+  if (!D->name && !download_start (instance, D)) {
+    end_load (instance, D);
+    return;
+  }
+  while (D->inflight < D->window && D->offset < D->size) {
+    if (download_part_done (D, D->offset / D->part_size)) {
+      D->offset += D->part_size;
+      continue;
     }
-    D->name = tstrdup (buf);
-    struct stat st;
-    if (stat (buf, &st) >= 0) {
-      D->offset = st.st_size;      
-      if (D->offset >= D->size) {
-        instance->cur_downloading_bytes += D->size;
-        instance->cur_downloaded_bytes += D->offset;
-        info ("Already downloaded\n");
-        end_load (instance, D);
-        return;
+    info ("do_upload_get_file(offset=%d, limit=%d)\n", D->offset, D->part_size);
+    clear_packet (mtp);
+    out_int (mtp, CODE_upload_get_file);
+    if (!D->id) {
+      out_int (mtp, CODE_input_file_location);
+      out_long (mtp, D->volume);
+      out_int (mtp, D->local_id);
+      out_long (mtp, D->secret);
+    } else {
+      if (D->iv) {
+        out_int (mtp, CODE_input_encrypted_file_location);
+      } else {
+        out_int (mtp, D->type);
       }
+      out_long (mtp, D->id);
+      out_long (mtp, D->access_hash);
     }
-    
-    instance->cur_downloading_bytes += D->size;
-    instance->cur_downloaded_bytes += D->offset;
-    //update_prompt ();
+    out_int (mtp, D->offset);
+    out_int (mtp, D->part_size);
+
+    struct download_extra *extra = talloc (sizeof (*extra));
+    extra->instance = instance;
+    extra->dl = D;
+    extra->offset = D->offset;
+    extra->sent = get_double_time ();
+    extra->delivered = D->delivered;
+    D->offset += D->part_size;
+    D->inflight ++;
+
+    send_query_session (instance, instance->auth.DC_list[D->dc], SESSION_BULK, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &download_methods, extra);
   }
-  info ("do_upload_get_file()\n");
-  clear_packet (mtp);
-  out_int (mtp, CODE_upload_get_file);
-  if (!D->id) {
-    out_int (mtp, CODE_input_file_location);
-    out_long (mtp, D->volume);
-    out_int (mtp, D->local_id);
-    out_long (mtp, D->secret);
-  } else {
-    if (D->iv) {
-      out_int (mtp, CODE_input_encrypted_file_location);
-    } else {
-      out_int (mtp, D->type);
-    }
-    out_long (mtp, D->id);
-    out_long (mtp, D->access_hash);
+  if (D->offset >= D->size && !D->inflight && !D->crypt && !D->sync) {
+    end_load (instance, D);
   }
-  out_int (mtp, D->offset);
-  out_int (mtp, 1 << 14);
-
-  struct download_extra *extra = malloc(sizeof(struct download_extra));
-  extra->instance = instance;
-  extra->dl = D;
-
-  send_query (instance, instance->auth.DC_list[D->dc], mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &download_methods, extra);
-  //send_query (instance, DC_working, packet_ptr - packet_buffer, packet_buffer, &download_methods, D);
 }
 
-void do_load_photo_size (struct telegram *instance, struct photo_size *P, void *extra) {
+void do_load_photo_size (struct telegram *instance, struct photo_size *P, int priority, void *extra) {
   if (!P->loc.dc) {
     failure ("Bad video thumb\n");
     return;
@@ -2010,6 +3337,7 @@ void do_load_photo_size (struct telegram *instance, struct photo_size *P, void *
   D->extra = extra;
   D->name = 0;
   D->fd = -1;
+  D->priority = priority;
 
   telegram_dl_add (instance, D);
   telegram_dl_next (instance);
@@ -2034,15 +3362,15 @@ void do_load_photo (struct telegram *instance, struct photo *photo, int photoBig
         }
     }
   }
-  do_load_photo_size (instance, &photo->sizes[sizei], extra);
+  do_load_photo_size (instance, &photo->sizes[sizei], photoBig ? DL_PRIO_NORMAL : DL_PRIO_HIGH, extra);
 }
 
 void do_load_video_thumb (struct telegram *instance, struct video *video, void *extra) {
-  do_load_photo_size (instance, &video->thumb, extra);
+  do_load_photo_size (instance, &video->thumb, DL_PRIO_HIGH, extra);
 }
 
 void do_load_document_thumb (struct telegram *instance, struct document *video, void *extra) {
-  do_load_photo_size (instance, &video->thumb, extra);
+  do_load_photo_size (instance, &video->thumb, DL_PRIO_HIGH, extra);
 }
 
 void do_load_video (struct telegram *instance, struct video *V, void *extra) {
@@ -2057,7 +3385,9 @@ void do_load_video (struct telegram *instance, struct video *V, void *extra) {
   D->name = 0;
   D->fd = -1;
   D->type = CODE_input_video_file_location;
-  load_next_part (instance, D);
+  D->priority = DL_PRIO_BULK;
+  telegram_dl_add (instance, D);
+  telegram_dl_next (instance);
 }
 
 void do_load_audio (struct telegram *instance, struct video *V, void *extra) {
@@ -2072,7 +3402,9 @@ void do_load_audio (struct telegram *instance, struct video *V, void *extra) {
   D->name = 0;
   D->fd = -1;
   D->type = CODE_input_audio_file_location;
-  load_next_part (instance, D);
+  D->priority = DL_PRIO_BULK;
+  telegram_dl_add (instance, D);
+  telegram_dl_next (instance);
 }
 
 void do_load_document (struct telegram *instance, struct document *V, void *extra) {
@@ -2087,7 +3419,9 @@ void do_load_document (struct telegram *instance, struct document *V, void *extr
   D->name = 0;
   D->fd = -1;
   D->type = CODE_input_document_file_location;
-  load_next_part (instance, D);
+  D->priority = DL_PRIO_BULK;
+  telegram_dl_add (instance, D);
+  telegram_dl_next (instance);
 }
 
 void do_load_encr_video (struct telegram *instance, struct encr_video *V, void *extra) {
@@ -2104,7 +3438,6 @@ void do_load_encr_video (struct telegram *instance, struct encr_video *V, void *
   D->key = V->key;
   D->iv = talloc (32);
   memcpy (D->iv, V->iv, 32);
-  load_next_part (instance, D);
       
   unsigned char md5[16];
   unsigned char str[64];
@@ -2112,6 +3445,10 @@ void do_load_encr_video (struct telegram *instance, struct encr_video *V, void *
   memcpy (str + 32, V->iv, 32);
   MD5 (str, 64, md5);
   assert (V->key_fingerprint == ((*(int *)md5) ^ (*(int *)(md5 + 4))));
+
+  D->priority = DL_PRIO_BULK;
+  telegram_dl_add (instance, D);
+  telegram_dl_next (instance);
 }
 /* }}} */
 
@@ -2456,13 +3793,13 @@ void do_send_accept_encr_chat (struct telegram *instance, struct secret_chat *E,
   BIGNUM *r = BN_new ();
   ensure_ptr (r);
   ensure (BN_mod_exp (r, g_a, b, p, instance->ctx));
-  static unsigned char kk[256];
+  unsigned char kk[256];
   memset (kk, 0, sizeof (kk));
   BN_bn2bin (r, kk);
   for (i = 0; i < 256; i++) {
     kk[i] ^= E->nonce[i];
   }
-  static unsigned char sha_buffer[20];
+  unsigned char sha_buffer[20];
   sha1 (kk, 256, sha_buffer);
 
   bl_do_set_encr_chat_key (mtp->bl, mtp, E, kk, *(long long *)(sha_buffer + 12));
@@ -2475,7 +3812,7 @@ void do_send_accept_encr_chat (struct telegram *instance, struct secret_chat *E,
   
   ensure (BN_set_word (g_a, instance->encr_root));
   ensure (BN_mod_exp (r, g_a, b, p, instance->ctx));
-  static unsigned char buf[256];
+  unsigned char buf[256];
   memset (buf, 0, sizeof (buf));
   BN_bn2bin (r, buf);
   out_cstring (mtp, (void *)buf, 256);
@@ -2516,7 +3853,7 @@ void do_create_keys_end (struct telegram *instance, struct secret_chat *U) {
     U->key[i] ^= *(((int *)U->nonce) + i);
   }
   
-  static unsigned char sha_buffer[20];
+  unsigned char sha_buffer[20];
   sha1 ((void *)U->key, 256, sha_buffer);
   long long k = *(long long *)(sha_buffer + 12);
   if (k != U->key_fingerprint) {
@@ -2807,12 +4144,12 @@ void do_get_difference (struct telegram *instance, int sync_from_start) {
     out_int (mtp, instance->proto.pts);
     out_int (mtp, instance->proto.last_date);
     out_int (mtp, instance->proto.qts);
-    send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_difference_methods, instance);
+    send_query_session (instance, DC_working, SESSION_SYNC, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_difference_methods, instance);
   } else {
     debug("do_updates_get_state()\n", 
         instance->proto.pts, instance->proto.last_date, instance->proto.qts);
     out_int (mtp, CODE_updates_get_state);
-    send_query (instance, DC_working, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_state_methods, instance);
+    send_query_session (instance, DC_working, SESSION_SYNC, mtp->packet_ptr - mtp->packet_buffer, mtp->packet_buffer, &get_state_methods, instance);
   }
 }
 /* }}} */
@@ -2999,8 +4336,7 @@ void do_create_group_chat (struct telegram *instance, peer_id_t id, char *chat_t
 int delete_msg_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
 
-  assert (fetch_int (mtp) == CODE_vector);
-  int n = fetch_int (mtp);
+  int n = fetch_vector_span (mtp, 1);
   fetch_skip (mtp, n);
   debug ("Deleted %d messages\n", n);
   return 0;
@@ -3028,8 +4364,7 @@ void do_delete_msg (struct telegram *instance, long long id) {
 int restore_msg_on_answer (struct query *q UU) {
   struct mtproto_connection *mtp = query_get_mtproto(q);
 
-  assert (fetch_int (mtp) == CODE_vector);
-  int n = fetch_int (mtp);
+  int n = fetch_vector_span (mtp, 1);
   fetch_skip (mtp, n);
   debug ("Restored %d messages\n", n);
   return 0;
@@ -21,13 +21,14 @@
 
 #pragma once
 #include "structures.h"
+#include "crypto.h"
+#include "timers.h"
 
 struct telegram;
 struct encr_video;
 struct document;
 struct secret_chat;
 struct tree_query;
-struct tree_timer;
 #define QUERY_ACK_RECEIVED 1
 
 struct query;
@@ -42,7 +43,34 @@ struct download_desc{
     int type;
 };
 
+/*
+ * File parts of downloads are requested in a window of parallel queries, the
+ * part size must be a power of two so that every offset is a multiple of it
+ */
+#define DOWNLOAD_PART_MIN (1 << 12)
+#define DOWNLOAD_PART_MAX (1 << 19)
+#define DOWNLOAD_PART_SIZE (1 << 17)
+#define DOWNLOAD_WINDOW_MAX 8
+
+/*
+ * Priority classes of downloads, avatars and thumbnails are small and shown
+ * right away so they overtake media
+ */
+#define DL_PRIO_HIGH 0
+#define DL_PRIO_NORMAL 1
+#define DL_PRIO_BULK 2
+#define DL_PRIO_NUM 3
+
+#define DL_MAX_ACTIVE 4
+#define DL_MAX_PER_DC 2
+// seconds the connections to foreign DCs stay open after the last download
+#define DL_LINGER_TIME 60.0
+
+struct download_part;
+struct download_crypt;
+
 struct download {
+  // offset of the next part to request
   int offset;
   int size;
   long long volume;
@@ -58,14 +86,40 @@ struct download {
   unsigned char *key;
   int type;
   struct mtproto_connection *c;
-};
-void load_next_part (struct telegram *instance, struct download *D);
 
-struct event_timer {
-  double timeout;
-  int (*alarm)(void *self);
-  void *self;
+  int priority;
+  // started by the scheduler and not yet done
+  int active;
+  int cancelled;
+
+  int part_size;
+  // parts in flight and their current limit
+  int inflight;
+  int window;
+  // bytes received so far, used for delivery rate samples
+  long long delivered;
+  // minimal round trip time and maximal delivery rate seen
+  double min_rtt;
+  double max_rate;
+  // encrypted files are decrypted in order, this is the next offset to decrypt
+  // and the parts that arrived before it
+  int iv_offset;
+  struct download_part *pending;
+  // large runs of parts are decrypted by the crypto pool, one at a time
+  struct download_crypt *crypt;
+  struct crypto_stream crypt_stream;
+
+  // bitmap of the parts that are on disk, mirrored by the journal file of
+  // downloads with more than one part
+  unsigned char *done;
+  int parts_total;
+  int journal_fd;
+  // parts completed since the journal was written, and the write in the pool
+  int dirty;
+  struct download_sync *sync;
 };
+void load_next_part (struct telegram *instance, struct download *D);
+void free_download (struct download *D);
 
 struct query {
   long long msg_id;
@@ -78,17 +132,131 @@ struct query {
   struct dc *DC;
   struct session *session;
   void *extra;
+  // next query in the outbox of the session
+  struct query *next_out;
+  // list of the queries sent on session that wait for an answer
+  struct query *next_sent, **pprev_sent;
+  // first sent, and the number of times it was sent again since
+  double sent_time;
+  int retries;
+  // timeout the query was last armed with, without the jitter
+  double rto;
+  // msg_id of the container the query was last sent in, 0 if it went alone
+  long long container_id;
+};
+
+/**
+ * Queries waiting for an answer by msg_id, an open addressing table with
+ * linear probing
+ */
+struct query_table {
+  struct query **slots;
+  // a power of two
+  int size;
+  int num;
 };
 
 
 struct query *send_query (struct telegram *instance, struct dc *DC, int len, void *data, struct query_methods *methods, void *extra);
+
+/**
+ * Like send_query, but prefer the session session_num of DC
+ */
+struct query *send_query_session (struct telegram *instance, struct dc *DC, int session_num, int len, void *data, struct query_methods *methods, void *extra);
+
+/*
+ * Queries of at least gzip_threshold bytes are sent as gzip_packed, the
+ * threshold grows while payloads turn out to be incompressible
+ */
+#define GZIP_THRESHOLD_MIN 512
+#define GZIP_THRESHOLD_MAX (1 << 16)
+#define GZIP_LEVEL 6
+
+struct gzip_stats {
+  // queries sent compressed and skipped because they did not shrink enough
+  long long packed;
+  long long skipped;
+  // size of the compressed queries before and after compression
+  long long bytes_in;
+  long long bytes_out;
+  // cpu time spent in deflate, in seconds
+  double cpu_time;
+};
+
+void get_gzip_stats (struct telegram *instance, struct gzip_stats *st);
+
+/*
+ * Queries time out after the retransmission timeout of their DC, estimated
+ * from the round trip times of acks, results and pongs like TCP does
+ * (RFC 6298), and back off exponentially while no answer comes.
+ *
+ * The bytes of unacknowledged queries on the bulk and sync sessions are limited
+ * to QUERY_WINDOW_BYTES plus the window the transfers on the session asked for,
+ * further queries wait in the outbox. The main session is not limited, so
+ * messages never wait behind file parts.
+ */
+#define QUERY_RTO_INIT 6.0
+#define QUERY_RTO_MIN 1.0
+#define QUERY_RTO_MAX 60.0
+#define QUERY_WINDOW_BYTES (1 << 20)
+
+struct query_stats {
+  // smoothed round trip time, its mean deviation and the current timeout, in seconds
+  double srtt;
+  double rttvar;
+  double rto;
+  int rtt_samples;
+  // queries sent and not acknowledged yet, and their size
+  int unacked;
+  int unacked_bytes;
+  // queries sent again because they timed out or the server asked for it
+  long long retransmits;
+};
+
+/**
+ * Current estimates of the DC dc_id, all zero if it is unknown
+ */
+void get_query_stats (struct telegram *instance, int dc_id, struct query_stats *st);
+
+/**
+ * Feed a round trip time to DC in seconds
+ */
+void query_rtt_sample (struct dc *DC, double rtt);
+
+/**
+ * Encrypt and send the queries queued since the last flush
+ */
+void flush_outboxes (struct telegram *instance);
+
+/**
+ * Send the user and chat info lookups collected since the last flush
+ */
+void flush_lookups (struct telegram *instance);
 void query_ack (struct telegram *instance, long long id);
+
+/**
+ * Send the unacknowledged queries of S again, e.g. once it has a new connection
+ */
+void query_resend_session (struct telegram *instance, struct session *S);
 void query_error (struct telegram *instance, long long id);
 void query_result (struct telegram *instance, long long id);
 void query_restart (struct telegram *instance, long long id);
 
+/**
+ * Arm ev to fire at ev->timeout, a timer that is already armed is moved
+ */
 void insert_event_timer (struct telegram *instance, struct event_timer *ev);
+
+/**
+ * Cancel ev, nothing happens if it is not armed
+ */
 void remove_event_timer (struct telegram *instance, struct event_timer *ev);
+
+/**
+ * Time at which work_timers has to run next at the latest, 1e100 if no timer
+ * is armed. This may be before the first timeout when timers have to be
+ * spread to a lower level of the wheel.
+ */
 double next_timer_in (struct telegram *instance);
 void work_timers (struct telegram *instance);
 
@@ -30,7 +30,8 @@
 #include "binlog.h"
 #include "net.h"
 
-#define sha1 SHA1
+#include "crypto.h"
+#include "tl-skip.h"
 
 static int id_cmp (struct message *M1, struct message *M2);
 #define peer_cmp(a,b) (cmp_peer_id (a->id, b->id))
@@ -44,10 +45,6 @@ struct message message_list = {
   .prev_use = &message_list
 };
 
-int verbosity;
-
-void fetch_skip_photo (struct mtproto_connection *mtp);
-
 #define code_assert(x) if (!(x)) { fatal ("Can not parse at line %d\n", __LINE__); assert (0); return -1; }
 #define code_try(x) if ((x) == -1) { return -1; }
 
@@ -58,68 +55,30 @@ void fetch_skip_photo (struct mtproto_connection *mtp);
  */
 
 int fetch_file_location (struct mtproto_connection *mtp, struct file_location *loc) {
-  int x = fetch_int (mtp);
-  code_assert (x == CODE_file_location_unavailable || x == CODE_file_location);
-
-  if (x == CODE_file_location_unavailable) {
-    loc->dc = -1;
-    loc->volume = fetch_long (mtp);
-    loc->local_id = fetch_int (mtp);
-    loc->secret = fetch_long (mtp);
-  } else {
-    loc->dc = fetch_int (mtp);
-    loc->volume = fetch_long (mtp);
-    loc->local_id = fetch_int (mtp);
-    loc->secret = fetch_long (mtp);
-  }
+  struct tl_file_location R;
+  fetch_tl_file_location (mtp, &R);
+  loc->dc = R.magic == CODE_file_location ? R.dc_id : -1;
+  loc->volume = R.volume_id;
+  loc->local_id = R.local_id;
+  loc->secret = R.secret;
   return 0;
 }
 
 int fetch_user_status (struct mtproto_connection *mtp, struct user_status *S) {
-  unsigned x = fetch_int (mtp);
-  code_assert (x == CODE_user_status_empty || x == CODE_user_status_online || x == CODE_user_status_offline);
-  switch (x) {
-  case CODE_user_status_empty:
-    S->online = 0;
-    S->when = 0;
-    break;
+  struct tl_user_status R;
+  fetch_tl_user_status (mtp, &R);
+  switch (R.magic) {
   case CODE_user_status_online:
     S->online = 1;
-    S->when = fetch_int (mtp);
+    S->when = R.expires;
     break;
   case CODE_user_status_offline:
     S->online = -1;
-    S->when = fetch_int (mtp);
+    S->when = R.was_online;
     break;
   default:
-    assert (0);
-  }
-  return 0;
-}
-
-/*
- *
- * Skip simple structures 
- *
- */
-
-int fetch_skip_file_location (struct mtproto_connection *mtp) {
-  int x = fetch_int (mtp);
-  code_assert (x == CODE_file_location_unavailable || x == CODE_file_location);
-
-  if (x == CODE_file_location_unavailable) {
-    mtp->in_ptr += 5;
-  } else {
-    mtp->in_ptr += 6;
-  }
-  return 0;
-}
-
-int fetch_skip_user_status (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  code_assert (x == CODE_user_status_empty || x == CODE_user_status_online || x == CODE_user_status_offline);
-  if (x != CODE_user_status_empty) {
-    fetch_int (mtp);
+    S->online = 0;
+    S->when = 0;
   }
   return 0;
 }
@@ -127,7 +86,7 @@ int fetch_skip_user_status (struct mtproto_connection *mtp) {
 char *create_print_name (struct binlog *bl, peer_id_t id, const char *a1, const char *a2, const char *a3, const char *a4) {
   const char *d[4];
   d[0] = a1; d[1] = a2; d[2] = a3; d[3] = a4;
-  static char buf[10000];
+  char buf[10000];
   buf[0] = 0;
   int i;
   int p = 0;
@@ -323,8 +282,8 @@ void fetch_encrypted_chat (struct mtproto_connection *mtp, struct secret_chat *U
     return;
   }
 
-  static char g_key[256];
-  static char nonce[256];
+  char g_key[256];
+  char nonce[256];
   if (new) {
     long long access_hash = fetch_long (mtp);
     int date = fetch_int (mtp);
@@ -569,15 +528,14 @@ void fetch_chat_full (struct mtproto_connection *mtp, struct chat *C) {
   if (x == CODE_chat_participants) {
     assert (fetch_int (mtp) == get_peer_id (C->id));
     admin_id =  fetch_int (mtp);
-    assert (fetch_int (mtp) == CODE_vector);
-    users_num = fetch_int (mtp);
+    users_num = fetch_vector_span (mtp, 4);
     users = talloc (sizeof (struct chat_user) * users_num);
     int i;
     for (i = 0; i < users_num; i++) {
-      assert (fetch_int (mtp) == (int)CODE_chat_participant);
-      users[i].user_id = fetch_int (mtp);
-      users[i].inviter_id = fetch_int (mtp);
-      users[i].date = fetch_int (mtp);
+      assert (span_int (mtp) == (int)CODE_chat_participant);
+      users[i].user_id = span_int (mtp);
+      users[i].inviter_id = span_int (mtp);
+      users[i].date = span_int (mtp);
     }
     version = fetch_int (mtp);
   }
@@ -607,73 +565,53 @@ void fetch_chat_full (struct mtproto_connection *mtp, struct chat *C) {
   bl_do_set_chat_full_photo (mtp->bl, mtp, C, start, 4 * (end - start));
 }
 
-void fetch_photo_size (struct mtproto_connection *mtp, struct photo_size *S) {
+/**
+ * Fill the photo_size S from its decoded form R
+ */
+static void photo_size_from_tl (struct photo_size *S, struct tl_photo_size *R) {
   memset (S, 0, sizeof (*S));
-  unsigned x = fetch_int (mtp);
-  assert (x == CODE_photo_size || x == CODE_photo_cached_size || x == CODE_photo_size_empty);
-  S->type = fetch_str_dup (mtp);
+  S->type = tstrndup (R->type.data, R->type.len);
   debug("s->type %s\n", S->type);
-  if (x != CODE_photo_size_empty) {
-    fetch_file_location (mtp, &S->loc);
-    S->w = fetch_int (mtp);
-    S->h = fetch_int (mtp);
-    if (x == CODE_photo_size) {
-      S->size = fetch_int (mtp);
-    } else {
-      S->size = prefetch_strlen (mtp);
-//      S->data = talloc (S->size);
-      fetch_str (mtp, S->size);
-//      memcpy (S->data, fetch_str (mtp, S->size), S->size);
-    }
+  if (R->magic != CODE_photo_size_empty) {
+    S->loc.dc = R->location.magic == CODE_file_location ? R->location.dc_id : -1;
+    S->loc.volume = R->location.volume_id;
+    S->loc.local_id = R->location.local_id;
+    S->loc.secret = R->location.secret;
+    S->w = R->w;
+    S->h = R->h;
+    // cached sizes bring the data along, it is not kept
+    S->size = R->magic == CODE_photo_size ? R->size : R->bytes.len;
   }
 }
 
-void fetch_skip_photo_size (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  assert (x == CODE_photo_size || x == CODE_photo_cached_size || x == CODE_photo_size_empty);
-  int l = prefetch_strlen (mtp);
-  fetch_str (mtp, l); // type
-  if (x != CODE_photo_size_empty) {
-    fetch_skip_file_location (mtp);
-    mtp->in_ptr += 2; // w, h
-    if (x == CODE_photo_size) {
-      mtp->in_ptr ++;
-    } else {
-      l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-    }
-  }
+void fetch_photo_size (struct mtproto_connection *mtp, struct photo_size *S) {
+  struct tl_photo_size R;
+  fetch_tl_photo_size (mtp, &R);
+  photo_size_from_tl (S, &R);
 }
 
 void fetch_geo (struct mtproto_connection *mtp, struct geo *G) {
-  unsigned x = fetch_int (mtp);
-  if (x == CODE_geo_point) {
-    G->longitude = fetch_double (mtp);
-    G->latitude = fetch_double (mtp);
+  struct tl_geo_point R;
+  fetch_tl_geo_point (mtp, &R);
+  if (R.magic == CODE_geo_point) {
+    G->longitude = R.long_;
+    G->latitude = R.lat;
   } else {
-    assert (x == CODE_geo_point_empty);
     G->longitude = 0;
     G->latitude = 0;
   }
 }
 
-void fetch_skip_geo (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  assert (x == CODE_geo_point || x == CODE_geo_point_empty);
-  if (x == CODE_geo_point) {
-    mtp->in_ptr += 4;
-  }
-}
-
 void fetch_photo (struct mtproto_connection *mtp, struct photo *P) {
   memset (P, 0, sizeof (*P));
   unsigned x = fetch_int (mtp);
   assert (x == CODE_photo_empty || x == CODE_photo);
-  P->id = fetch_long (mtp);
+  fetch_span (mtp, x == CODE_photo_empty ? 2 : 6);
+  P->id = span_long (mtp);
   if (x == CODE_photo_empty) { return; }
-  P->access_hash = fetch_long (mtp);
-  P->user_id = fetch_int (mtp);
-  P->date = fetch_int (mtp);
+  P->access_hash = span_long (mtp);
+  P->user_id = span_int (mtp);
+  P->date = span_int (mtp);
   P->caption = fetch_str_dup (mtp);
   fetch_geo (mtp, &P->geo);
   assert (fetch_int (mtp) == CODE_vector);
@@ -686,99 +624,52 @@ void fetch_photo (struct mtproto_connection *mtp, struct photo *P) {
   }
 }
 
-void fetch_skip_photo (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  assert (x == CODE_photo_empty || x == CODE_photo);
-  mtp->in_ptr += 2; // id
-  if (x == CODE_photo_empty) { return; }
-  mtp->in_ptr += 2  +1 + 1; // access_hash, user_id, date
-  int l = prefetch_strlen (mtp);
-  fetch_str (mtp, l); // caption
-  fetch_skip_geo (mtp);
-  assert (fetch_int (mtp) == CODE_vector);
-  int n = fetch_int (mtp);
-  int i;
-  for (i = 0; i < n; i++) {
-    fetch_skip_photo_size (mtp);
-  }
-}
-
 void fetch_video (struct mtproto_connection *mtp, struct video *V) {
+  struct tl_video R;
+  fetch_tl_video (mtp, &R);
   memset (V, 0, sizeof (*V));
-  unsigned x = fetch_int (mtp);
-  V->id = fetch_long (mtp);
-  if (x == CODE_video_empty) { return; }
-  V->access_hash = fetch_long (mtp);
-  V->user_id = fetch_int (mtp);
-  V->date = fetch_int (mtp);
-  V->caption = fetch_str_dup (mtp);
-  V->duration = fetch_int (mtp);
-  V->size = fetch_int (mtp);
-  fetch_photo_size (mtp, &V->thumb);
-  V->dc_id = fetch_int (mtp);
-  V->w = fetch_int (mtp);
-  V->h = fetch_int (mtp);
-}
-
-void fetch_skip_video (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  fetch_long (mtp);
-  if (x == CODE_video_empty) { return; }
-  fetch_skip (mtp, 4);
-  int l = prefetch_strlen (mtp);
-  fetch_str (mtp, l);
-  fetch_skip (mtp, 2);
-  fetch_skip_photo_size (mtp);
-  fetch_skip (mtp, 3);
+  V->id = R.id;
+  if (R.magic == CODE_video_empty) { return; }
+  V->access_hash = R.access_hash;
+  V->user_id = R.user_id;
+  V->date = R.date;
+  V->caption = tstrndup (R.caption.data, R.caption.len);
+  V->duration = R.duration;
+  V->size = R.size;
+  photo_size_from_tl (&V->thumb, &R.thumb);
+  V->dc_id = R.dc_id;
+  V->w = R.w;
+  V->h = R.h;
 }
 
 void fetch_audio (struct mtproto_connection *mtp, struct audio *V) {
+  struct tl_audio R;
+  fetch_tl_audio (mtp, &R);
   memset (V, 0, sizeof (*V));
-  unsigned x = fetch_int (mtp);
-  V->id = fetch_long (mtp);
-  if (x == CODE_audio_empty) { return; }
-  V->access_hash = fetch_long (mtp);
-  V->user_id = fetch_int (mtp);
-  V->date = fetch_int (mtp);
-  V->duration = fetch_int (mtp);
-  V->size = fetch_int (mtp);
-  V->dc_id = fetch_int (mtp);
-}
-
-void fetch_skip_audio (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  fetch_skip (mtp, 2);
-  if (x == CODE_audio_empty) { return; }
-  fetch_skip (mtp, 7);
+  V->id = R.id;
+  if (R.magic == CODE_audio_empty) { return; }
+  V->access_hash = R.access_hash;
+  V->user_id = R.user_id;
+  V->date = R.date;
+  V->duration = R.duration;
+  V->size = R.size;
+  V->dc_id = R.dc_id;
 }
 
 void fetch_document (struct mtproto_connection *mtp, struct document *V) {
+  struct tl_document R;
+  fetch_tl_document (mtp, &R);
   memset (V, 0, sizeof (*V));
-  unsigned x = fetch_int (mtp);
-  V->id = fetch_long (mtp);
-  if (x == CODE_document_empty) { return; }
-  V->access_hash = fetch_long (mtp);
-  V->user_id = fetch_int (mtp);
-  V->date = fetch_int (mtp);
-  V->caption = fetch_str_dup (mtp);
-  V->mime_type = fetch_str_dup (mtp);
-  V->size = fetch_int (mtp);
-  fetch_photo_size (mtp, &V->thumb);
-  V->dc_id = fetch_int (mtp);
-}
-
-void fetch_skip_document (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  fetch_skip (mtp, 2);
-  if (x == CODE_document_empty) { return; }
-  fetch_skip (mtp, 4);
-  int l = prefetch_strlen (mtp);
-  fetch_str (mtp, l);
-  l = prefetch_strlen (mtp);
-  fetch_str (mtp, l);
-  fetch_skip (mtp, 1);
-  fetch_skip_photo_size (mtp);
-  fetch_skip (mtp, 1);
+  V->id = R.id;
+  if (R.magic == CODE_document_empty) { return; }
+  V->access_hash = R.access_hash;
+  V->user_id = R.user_id;
+  V->date = R.date;
+  V->caption = tstrndup (R.file_name.data, R.file_name.len);
+  V->mime_type = tstrndup (R.mime_type.data, R.mime_type.len);
+  V->size = R.size;
+  photo_size_from_tl (&V->thumb, &R.thumb);
+  V->dc_id = R.dc_id;
 }
 
 void fetch_message_action (struct mtproto_connection *mtp, struct message_action *M) {
@@ -801,10 +692,9 @@ void fetch_message_action (struct mtproto_connection *mtp, struct message_action
     break;
   case CODE_message_action_chat_create:
     M->title = fetch_str_dup (mtp);
-    assert (fetch_int (mtp) == (int)CODE_vector);
-    M->user_num = fetch_int (mtp);
+    M->user_num = fetch_vector_span (mtp, 1);
     M->users = talloc (M->user_num * 4);
-    fetch_ints (mtp, M->users, M->user_num);
+    span_ints (mtp, M->users, M->user_num);
     break;
   case CODE_message_action_chat_edit_title:
     M->new_title = fetch_str_dup (mtp);
@@ -825,49 +715,6 @@ void fetch_message_action (struct mtproto_connection *mtp, struct message_action
   }
 }
 
-void fetch_skip_message_action (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  int l;
-  switch (x) {
-  case CODE_message_action_empty:
-    break;
-  case CODE_message_action_geo_chat_create:
-    {
-      l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-      l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-    }
-    break;
-  case CODE_message_action_geo_chat_checkin:
-    break;
-  case CODE_message_action_chat_create:
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l);
-    assert (fetch_int (mtp) == (int)CODE_vector);
-    l = fetch_int (mtp);
-    fetch_skip (mtp, l);
-    break;
-  case CODE_message_action_chat_edit_title:
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l);
-    break;
-  case CODE_message_action_chat_edit_photo:
-    fetch_skip_photo (mtp);
-    break;
-  case CODE_message_action_chat_delete_photo:
-    break;
-  case CODE_message_action_chat_add_user:
-    fetch_int (mtp);
-    break;
-  case CODE_message_action_chat_delete_user:
-    fetch_int (mtp);
-    break;
-  default:
-    assert (0);
-  }
-}
-
 void fetch_message_short (struct mtproto_connection *mtp, struct message *M) {
   struct telegram *instance = mtp->instance;
   
@@ -966,124 +813,6 @@ void fetch_message_media (struct mtproto_connection *mtp, struct message_media *
   }
 }
 
-void fetch_skip_message_media (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  switch (x) {
-  case CODE_message_media_empty:
-    break;
-  case CODE_message_media_photo:
-    fetch_skip_photo (mtp);
-    break;
-  case CODE_message_media_video:
-    fetch_skip_video (mtp);
-    break;
-  case CODE_message_media_audio:
-    fetch_skip_audio (mtp);
-    break;
-  case CODE_message_media_document:
-    fetch_skip_document (mtp);
-    break;
-  case CODE_message_media_geo:
-    fetch_skip_geo (mtp);
-    break;
-  case CODE_message_media_contact:
-    {
-      int l;
-      l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-      l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-      l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-      fetch_int (mtp);
-    }
-    break;
-  case CODE_message_media_unsupported:
-    {
-      int l = prefetch_strlen (mtp);
-      fetch_str (mtp, l);
-    }
-    break;
-  default:
-    debug ("type = 0x%08x\n", x);
-    assert (0);
-  }
-}
-
-void fetch_skip_message_media_encrypted (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  int l;
-  switch (x) {
-  case CODE_decrypted_message_media_empty:
-    break;
-  case CODE_decrypted_message_media_photo:
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-    fetch_skip (mtp, 5);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    break;
-  case CODE_decrypted_message_media_video:
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-
-    fetch_skip (mtp, 6);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    break;
-  case CODE_decrypted_message_media_audio:
-    fetch_skip (mtp, 2);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    break;
-  case CODE_decrypted_message_media_document:
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-
-    fetch_skip (mtp, 2);
-    
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-    fetch_skip (mtp, 1);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    
-    l = prefetch_strlen  (mtp);
-    fetch_str (mtp, l);
-    break;
-  case CODE_decrypted_message_media_geo_point:
-    fetch_skip (mtp, 4);
-    break;
-  case CODE_decrypted_message_media_contact:
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-    l = prefetch_strlen (mtp);
-    fetch_str (mtp, l); // thumb
-    fetch_skip (mtp, 1);
-    break;
-  default:
-    debug ("type = 0x%08x\n", x);
-    assert (0);
-  }
-}
-
 void fetch_message_media_encrypted (struct mtproto_connection *mtp, struct message_media *M) {
   memset (M, 0, sizeof (*M));
   unsigned x = fetch_int (mtp);
@@ -1233,18 +962,6 @@ void fetch_message_media_encrypted (struct mtproto_connection *mtp, struct messa
   }
 }
 
-void fetch_skip_message_action_encrypted (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  switch (x) {
-  case CODE_decrypted_message_action_set_message_t_t_l:
-    fetch_skip (mtp, 1);
-    break;
-  default:
-    debug ("x = 0x%08x\n", x);
-    assert (0);
-  }
-}
-
 void fetch_message_action_encrypted (struct mtproto_connection *mtp, struct message_action *M) {
   unsigned x = fetch_int (mtp);
   switch (x) {
@@ -1271,7 +988,9 @@ peer_id_t fetch_peer_id (struct mtproto_connection *mtp) {
 void fetch_message (struct mtproto_connection *mtp, struct message *M) {
   unsigned x = fetch_int (mtp);
   assert (x == CODE_message_empty || x == CODE_message || x == CODE_message_forwarded || x == CODE_message_service);
-  int id = fetch_int (mtp);
+  // the fixed part up to the date
+  fetch_span (mtp, x == CODE_message_empty ? 1 : x == CODE_message_forwarded ? 9 : 7);
+  int id = span_int (mtp);
   assert (M->id == id);
   if (x == CODE_message_empty) {
     return;
@@ -1280,16 +999,18 @@ void fetch_message (struct mtproto_connection *mtp, struct message *M) {
   int fwd_date = 0;
 
   if (x == CODE_message_forwarded) {
-    fwd_from_id = fetch_int (mtp);
-    fwd_date = fetch_int (mtp);
+    fwd_from_id = span_int (mtp);
+    fwd_date = span_int (mtp);
   }
-  int from_id = fetch_int (mtp);
-  peer_id_t to_id = fetch_peer_id (mtp);
+  int from_id = span_int (mtp);
+  unsigned peer = span_int (mtp);
+  assert (peer == CODE_peer_user || peer == CODE_peer_chat);
+  peer_id_t to_id = peer == CODE_peer_user ? MK_USER (span_int (mtp)) : MK_CHAT (span_int (mtp));
 
-  fetch_bool (mtp); // out.
+  span_bool (mtp); // out.
 
-  int unread = fetch_bool (mtp);
-  int date = fetch_int (mtp);
+  int unread = span_bool (mtp);
+  int date = span_int (mtp);
 
   int new = !(M->flags & FLAG_CREATED);
 
@@ -1345,51 +1066,52 @@ void fetch_geo_message (struct mtproto_connection *mtp, struct message *M) {
   }
 }
 
-static int *decr_ptr;
-static int *decr_end;
-
-int decrypt_encrypted_message (struct secret_chat *E) {
-  int *msg_key = decr_ptr;
-  decr_ptr += 4;
+/**
+ * Decrypt the message behind the msg_key at *ptr in place, *ptr is advanced to
+ * the decrypted data
+ */
+int decrypt_encrypted_message (struct secret_chat *E, int **ptr, int *decr_end) {
+  int *msg_key = *ptr;
+  int *decr_ptr = (*ptr += 4);
   assert (decr_ptr < decr_end);
-  static unsigned char sha1a_buffer[20];
-  static unsigned char sha1b_buffer[20];
-  static unsigned char sha1c_buffer[20];
-  static unsigned char sha1d_buffer[20];
+  unsigned char sha1a_buffer[20];
+  unsigned char sha1b_buffer[20];
+  unsigned char sha1c_buffer[20];
+  unsigned char sha1d_buffer[20];
  
-  static unsigned char buf[64];
-  memcpy (buf, msg_key, 16);
-  memcpy (buf + 16, E->key, 32);
-  sha1 (buf, 48, sha1a_buffer);
+  unsigned char buf[4][48];
+  memcpy (buf[0], msg_key, 16);
+  memcpy (buf[0] + 16, E->key, 32);
   
-  memcpy (buf, E->key + 8, 16);
-  memcpy (buf + 16, msg_key, 16);
-  memcpy (buf + 32, E->key + 12, 16);
-  sha1 (buf, 48, sha1b_buffer);
+  memcpy (buf[1], E->key + 8, 16);
+  memcpy (buf[1] + 16, msg_key, 16);
+  memcpy (buf[1] + 32, E->key + 12, 16);
   
-  memcpy (buf, E->key + 16, 32);
-  memcpy (buf + 32, msg_key, 16);
-  sha1 (buf, 48, sha1c_buffer);
+  memcpy (buf[2], E->key + 16, 32);
+  memcpy (buf[2] + 32, msg_key, 16);
   
-  memcpy (buf, msg_key, 16);
-  memcpy (buf + 16, E->key + 24, 32);
-  sha1 (buf, 48, sha1d_buffer);
+  memcpy (buf[3], msg_key, 16);
+  memcpy (buf[3] + 16, E->key + 24, 32);
+
+  const unsigned char *in[4] = {buf[0], buf[1], buf[2], buf[3]};
+  unsigned char *out[4] = {sha1a_buffer, sha1b_buffer, sha1c_buffer, sha1d_buffer};
+  sha1_x4 (in, 48, out);
 
-  static unsigned char key[32];
+  unsigned char key[32];
   memcpy (key, sha1a_buffer + 0, 8);
   memcpy (key + 8, sha1b_buffer + 8, 12);
   memcpy (key + 20, sha1c_buffer + 4, 12);
 
-  static unsigned char iv[32];
+  unsigned char iv[32];
   memcpy (iv, sha1a_buffer + 8, 12);
   memcpy (iv + 12, sha1b_buffer + 0, 8);
   memcpy (iv + 20, sha1c_buffer + 16, 4);
   memcpy (iv + 24, sha1d_buffer + 0, 8);
 
-  AES_KEY aes_key;
-  AES_set_decrypt_key (key, 256, &aes_key);
-  AES_ige_encrypt ((void *)decr_ptr, (void *)decr_ptr, 4 * (decr_end - decr_ptr), &aes_key, iv, 0);
-  memset (&aes_key, 0, sizeof (aes_key));
+  struct aes_ige_key aes_key;
+  aes_ige_set_key (&aes_key, key, AES_DECRYPT);
+  aes_ige (&aes_key, (void *)decr_ptr, (void *)decr_ptr, 4 * (decr_end - decr_ptr), iv);
+  aes_ige_clear (&aes_key);
 
   int x = *(decr_ptr);
   if (x < 0 || (x & 3)) {
@@ -1426,8 +1148,8 @@ void fetch_encrypted_message (struct mtproto_connection *mtp, struct message *M)
 
   int len = prefetch_strlen (mtp);
   assert ((len & 15) == 8);
-  decr_ptr = (void *)fetch_str (mtp, len);
-  decr_end = decr_ptr + (len / 4);
+  int *decr_ptr = (void *)fetch_str (mtp, len);
+  int *decr_end = decr_ptr + (len / 4);
   int ok = 0;
   if (P) {
     if (*(long long *)decr_ptr != P->encr_chat.key_fingerprint) {
@@ -1441,7 +1163,7 @@ void fetch_encrypted_message (struct mtproto_connection *mtp, struct message *M)
   int *start = 0;
   int *end = 0;
   x = 0;
-  if (P && decrypt_encrypted_message (&P->encr_chat) >= 0 && new) {
+  if (P && decrypt_encrypted_message (&P->encr_chat, &decr_ptr, decr_end) >= 0 && new) {
     ok = 1;
     int *save_in_ptr = mtp->in_ptr;
     int *save_in_end = mtp->in_end;
@@ -1463,11 +1185,11 @@ void fetch_encrypted_message (struct mtproto_connection *mtp, struct message *M)
       l = prefetch_strlen (mtp);
       s = fetch_str (mtp, l);
       start = mtp->in_ptr;
-      fetch_skip_message_media_encrypted (mtp);
+      fetch_skip_decrypted_message_media (mtp);
       end = mtp->in_ptr;
     } else {
       start = mtp->in_ptr;
-      fetch_skip_message_action_encrypted (mtp);
+      fetch_skip_decrypted_message_action (mtp);
       end = mtp->in_ptr;
     }
     mtp->in_ptr = save_in_ptr;
@@ -1477,7 +1199,7 @@ void fetch_encrypted_message (struct mtproto_connection *mtp, struct message *M)
   if (sx == CODE_encrypted_message) {
     if (ok) {
       int *start_file = mtp->in_ptr;
-      fetch_skip_encrypted_message_file (mtp);
+      fetch_skip_encrypted_file (mtp);
       if (x == CODE_decrypted_message) {
         bl_do_create_message_media_encr (mtp->bl, mtp, id, P->encr_chat.user_id, PEER_ENCR_CHAT, to_id, date, l, s, start, end - start, start_file, mtp->in_ptr - start_file);
       }
@@ -1517,15 +1239,6 @@ void fetch_encrypted_message_file (struct mtproto_connection *mtp, struct messag
   }
 }
 
-void fetch_skip_encrypted_message_file (struct mtproto_connection *mtp) {
-  unsigned x = fetch_int (mtp);
-  assert (x == CODE_encrypted_file || x == CODE_encrypted_file_empty);
-  if (x == CODE_encrypted_file_empty) {
-  } else {
-    fetch_skip (mtp, 7);
-  }
-}
-
 static int id_cmp (struct message *M1, struct message *M2) {
   if (M1->id < M2->id) { return -1; }
   else if (M1->id > M2->id) { return 1; }
@@ -1544,8 +1257,7 @@ struct tgl_user *fetch_alloc_user (struct mtproto_connection *mtp) {
     U = talloc0 (sizeof (*U));
     U->id = MK_USER (data[1]);
     bl->peer_tree = tree_insert_peer (bl->peer_tree, U, lrand48 ());
-    assert (bl->peer_num < MAX_PEER_NUM);
-    bl->Peers[bl->peer_num ++] = U;
+    peer_append (bl, U);
     fetch_user (mtp, &U->user);
     event_update_user_status(mtp->connection->instance, U);
     event_peer_allocated(mtp->connection->instance, U);
@@ -1568,33 +1280,46 @@ struct secret_chat *fetch_alloc_encrypted_chat (struct mtproto_connection *mtp)
     U->id = MK_ENCR_CHAT (data[1]);
     bl->encr_chats_allocated ++;
     bl->peer_tree = tree_insert_peer (bl->peer_tree, U, lrand48 ());
-    assert (bl->peer_num < MAX_PEER_NUM);
-    bl->Peers[bl->peer_num ++] = U;
+    peer_append (bl, U);
   }
   fetch_encrypted_chat (mtp, &U->encr_chat);
   event_peer_allocated(mtp->connection->instance, U);
   return &U->encr_chat;
 }
 
+/**
+ * Add P to the dense vector of all peers
+ */
+void peer_append (struct binlog *bl, peer_t *P) {
+  if (bl->peer_num == bl->peer_size) {
+    int n = bl->peer_size ? 2 * bl->peer_size : PEER_VECTOR_MIN;
+    peer_t **V = talloc (n * sizeof (peer_t *));
+    if (bl->Peers) {
+      memcpy (V, bl->Peers, bl->peer_num * sizeof (peer_t *));
+      tfree (bl->Peers, bl->peer_size * sizeof (peer_t *));
+    }
+    bl->Peers = V;
+    bl->peer_size = n;
+  }
+  bl->Peers[bl->peer_num ++] = P;
+}
+
 void insert_encrypted_chat (struct binlog *bl, peer_t *P) {
   bl->encr_chats_allocated ++;
   bl->peer_tree = tree_insert_peer (bl->peer_tree, P, lrand48 ());
-  assert (bl->peer_num < MAX_PEER_NUM);
-  bl->Peers[bl->peer_num ++] = P;
+  peer_append (bl, P);
 }
 
 void insert_user (struct binlog *bl, peer_t *P) {
   bl->users_allocated ++;
   bl->peer_tree = tree_insert_peer (bl->peer_tree, P, lrand48 ());
-  assert (bl->peer_num < MAX_PEER_NUM);
-  bl->Peers[bl->peer_num ++] = P;
+  peer_append (bl, P);
 }
 
 void insert_chat (struct binlog *bl, peer_t *P) {
   bl->chats_allocated ++;
   bl->peer_tree = tree_insert_peer (bl->peer_tree, P, lrand48 ());
-  assert (bl->peer_num < MAX_PEER_NUM);
-  bl->Peers[bl->peer_num ++] = P;
+  peer_append (bl, P);
 }
 
 struct tgl_user *fetch_alloc_user_full (struct mtproto_connection *mtp) {
@@ -1611,8 +1336,7 @@ struct tgl_user *fetch_alloc_user_full (struct mtproto_connection *mtp) {
     U->id = MK_USER (data[2]);
     bl->peer_tree = tree_insert_peer (bl->peer_tree, U, lrand48 ());
     fetch_user_full (mtp, &U->user);
-    assert (bl->peer_num < MAX_PEER_NUM);
-    bl->Peers[bl->peer_num ++] = U;
+    peer_append (bl, U);
     return &U->user;
   }
 }
@@ -1769,8 +1493,7 @@ void message_add_peer (struct message *M) {
       break;
     }
     bl->peer_tree = tree_insert_peer (bl->peer_tree, P, lrand48 ());
-    assert (bl->peer_num < MAX_PEER_NUM);
-    bl->Peers[bl->peer_num ++] = P;
+    peer_append (bl, P);
   }
   if (!P->last) {
     P->last = M;
@@ -1935,8 +1658,7 @@ struct chat *fetch_alloc_chat (struct mtproto_connection *mtp) {
     U = talloc0 (sizeof (*U));
     U->id = MK_CHAT (data[1]);
     bl->peer_tree = tree_insert_peer (bl->peer_tree, U, lrand48 ());
-    assert (bl->peer_num < MAX_PEER_NUM);
-    bl->Peers[bl->peer_num ++] = U;
+    peer_append (bl, U);
   }
   fetch_chat (mtp, &U->chat);
   event_peer_allocated(mtp->connection->instance, U);
@@ -1957,8 +1679,7 @@ struct chat *fetch_alloc_chat_full (struct mtproto_connection *mtp) {
     U->id = MK_CHAT (data[2]);
     bl->peer_tree = tree_insert_peer (bl->peer_tree, U, lrand48 ());
     fetch_chat_full (mtp, &U->chat);
-    assert (bl->peer_num < MAX_PEER_NUM);
-    bl->Peers[bl->peer_num ++] = U;
+    peer_append (bl, U);
     return &U->chat;
   }
 }
@@ -1984,7 +1705,7 @@ int print_stat (struct binlog *bl, char *s, int len) {
 }
 
 peer_t *user_chat_get (struct binlog *bl, peer_id_t id) {
-  static peer_t U;
+  peer_t U;
   U.id = id;
   return tree_lookup_peer (bl->peer_tree, &U);
 }
@@ -2054,7 +1775,7 @@ void peer_delete_name (struct binlog *bl, peer_t *P) {
 }
 
 peer_t *peer_lookup_name (struct binlog *bl, const char *s) {
-  static peer_t P;
+  peer_t P;
   P.print_name = (void *)s;
   peer_t *R = tree_lookup_peer_by_name (bl->peer_by_name_tree, &P);
   return R;
@@ -2086,5 +1807,10 @@ void free_peers (struct binlog *bl)
     free (P->print_name);
     tfree (P, sizeof (union peer));
   }
+  if (bl->Peers) {
+    tfree (bl->Peers, bl->peer_size * sizeof (peer_t *));
+    bl->Peers = 0;
+    bl->peer_size = 0;
+  }
 }
 
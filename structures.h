@@ -349,7 +349,6 @@ struct message *fetch_alloc_message_short (struct mtproto_connection *mtp, struc
 struct message *fetch_alloc_message_short_chat (struct mtproto_connection *self, struct telegram *instance);
 struct message *fetch_alloc_encrypted_message (struct mtproto_connection *mtp, struct telegram *instance);
 void fetch_encrypted_message_file (struct mtproto_connection *mtp, struct message_media *M);
-void fetch_skip_encrypted_message_file (struct mtproto_connection *mtp);
 void fetch_message_action_encrypted (struct mtproto_connection *mtp, struct message_action *M);
 peer_id_t fetch_peer_id (struct mtproto_connection *mtp);
 
@@ -369,6 +368,7 @@ struct message *message_get (struct binlog *bl, long long id);
 void update_message_id (struct message *M, long long id);
 void message_insert (struct message *M);
 void fetch_photo (struct mtproto_connection *mtp, struct photo *P);
+void peer_append (struct binlog *bl, peer_t *P);
 void insert_encrypted_chat (struct binlog *bl, peer_t *P);
 void insert_user (struct binlog *bl, peer_t *P);
 void insert_chat (struct binlog *bl, peer_t *P);
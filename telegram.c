@@ -168,6 +168,12 @@ struct telegram *telegram_new(const char* login, struct telegram_config *config)
     this->auth_path = telegram_get_config(this, "auth");
     this->state_path = telegram_get_config(this, "state");
     this->secret_path = telegram_get_config(this, "secret");
+    this->gzip_threshold = GZIP_THRESHOLD_MIN;
+    this->dl_max_active = DL_MAX_ACTIVE;
+    this->dl_max_per_dc = DL_MAX_PER_DC;
+    this->dl_part_size = DOWNLOAD_PART_SIZE;
+    this->dl_window_max = DOWNLOAD_WINDOW_MAX;
+    this->crypto = crypto_pool_new ();
     
     debug("%s\n", this->login);
     debug("%s\n", this->config_path);
@@ -186,7 +192,7 @@ void telegram_destroy(struct telegram *this)
 {
     // close all open connections
     int i = 0; 
-    for (; i < 100; i++) {
+    for (; i < this->cs; i++) {
       if (this->Cs[i] != NULL && !this->Cs[i]->destroy) {
         mtproto_close (this->Cs[i]);
       }
@@ -194,10 +200,24 @@ void telegram_destroy(struct telegram *this)
     free_queries (this);
     free_timers (this);
     mtproto_free_closed (this, 1);
+    if (this->Cs) {
+      tfree (this->Cs, this->cs_size * sizeof (void *));
+    }
+    crypto_pool_free (this->crypto);
 
     free_bl (this->bl);
     free_auth (this->auth.DC_list, 11);
 
+    for (i = 0; i < DL_PRIO_NUM; i++) {
+      if (this->dl_queue[i]) {
+        struct download *dl;
+        while ((dl = g_queue_pop_head (this->dl_queue[i]))) {
+          free_download (dl);
+        }
+        g_queue_free (this->dl_queue[i]);
+      }
+    }
+
     g_free(this->login);
     g_free(this->config_path);
     g_free(this->download_path);
@@ -218,6 +238,9 @@ void free_bl (struct binlog *bl)
     // TODO: rptr, wptr
     free_peers (bl);
     free_messages (bl);
+    if (bl->binlog_buffer) {
+        tfree (bl->binlog_buffer, bl->binlog_buffer_size);
+    }
     tfree (bl, sizeof (struct binlog));
 }
 
@@ -345,6 +368,8 @@ void on_auth_imported (void *extra)
    bl_do_dc_signed (tg->bl, c, dl->dc);
    write_auth_file (&tg->auth, tg->auth_path);
    load_next_part (tg, dl);
+   // downloads from the same DC waited for the authorization
+   telegram_dl_next (tg);
    telegram_flush (tg);
 }
 
@@ -375,52 +400,178 @@ void telegram_dl_connected (struct proxy_request *req)
 
 
 /**
- * Create a connection for the given download
+ * Queue a download in its priority class
  */
 void telegram_dl_add (struct telegram *instance, struct download *dl)
 {
-    debug ("telegram_connect_dl(dc_num=%d, dc=%d)\n", dl->dc, instance->auth.DC_list[dl->dc]);
-    if (!instance->dl_queue) {
-        instance->dl_queue = g_queue_new ();
+    debug ("telegram_dl_add(dc=%d, prio=%d)\n", dl->dc, dl->priority);
+    assert (dl->priority >= 0 && dl->priority < DL_PRIO_NUM);
+    assert (dl->dc > 0 && dl->dc < 11);
+    if (!instance->dl_queue[dl->priority]) {
+        instance->dl_queue[dl->priority] = g_queue_new ();
+    }
+    g_queue_push_tail(instance->dl_queue[dl->priority], dl);
+}
+
+/**
+ * Return whether a download from DC may start now
+ *
+ * Only one download per foreign DC sets up the connection and authorization,
+ * the others wait until it is usable.
+ */
+static int telegram_dl_dc_ready (struct telegram *instance, int dc)
+{
+    if (instance->dl_active_dc[dc] >= instance->dl_max_per_dc) {
+        return 0;
+    }
+    if (dc == instance->auth.dc_working_num) {
+        return 1;
     }
-    g_queue_push_tail(instance->dl_queue, dl);
+    struct dc *DC = instance->auth.DC_list[dc];
+    struct session *S = DC->sessions[0];
+    if (!S || (!S->c && !S->connecting)) {
+        return 1;
+    }
+    return S->c && DC->has_auth;
+}
+
+static void telegram_dl_start (struct telegram *instance, struct download *dl)
+{
+    dl->active = 1;
+    instance->dl_active ++;
+    instance->dl_active_dc[dl->dc] ++;
+
+    struct dc *DC = instance->auth.DC_list[dl->dc];
+    if (dl->dc == instance->auth.dc_working_num) {
+        debug ("is working DC, start download...\n");
+        assert (telegram_get_working_dc(instance)->sessions[0]->c);
+        dl->c = instance->connection;
+        load_next_part (instance, dl);
+    } else if (DC->sessions[0] && DC->sessions[0]->c) {
+        debug ("is remote DC, reusing its connection...\n");
+        dl->c = DC->sessions[0]->c->mtconnection;
+        load_next_part (instance, dl);
+    } else {
+        debug ("is remote DC, requesting connection...\n");
+        dc_get_session (DC, 0)->connecting = 1;
+        struct proxy_request *req = talloc0(sizeof(struct proxy_request));
+        req->type = REQ_DOWNLOAD;
+        req->DC = DC;
+        req->tg = instance;
+        req->done = telegram_dl_connected;
+        req->data = dl;
+        instance->config->proxy_request_cb (instance, req);
+    }
+}
+
+static int telegram_dl_linger_alarm (void *self)
+{
+    struct telegram *instance = self;
+    instance->dl_linger = 0;
+    if (!instance->dl_active) {
+        debug ("downloads idle, closing foreign connections\n");
+        mtproto_close_foreign (instance);
+    }
+    return 0;
 }
 
 void telegram_dl_next (struct telegram *instance)
 {
-    assert (instance->dl_queue);
     assert (instance->config->proxy_request_cb);
-    if (!instance->dl_curr) {
-        struct download *dl = g_queue_pop_head (instance->dl_queue);
-        if (dl) {
-            struct proxy_request *req = talloc0(sizeof(struct proxy_request));
-            req->type = REQ_DOWNLOAD;
-            req->DC = instance->auth.DC_list[dl->dc];
-            req->tg = instance;
-            req->done = telegram_dl_connected;
-            req->data = dl;
-            instance->dl_curr = dl;
-
-            debug ("telegrma_dl_start(workin_dc=%d, ): starting new download..\n", instance->auth.dc_working_num);
-            if (dl->dc == instance->auth.dc_working_num) {
-                debug ("is working DC, start download...\n");
-                assert (telegram_get_working_dc(instance)->sessions[0]->c);
-                req->conn = instance->connection;
-                dl->c = req->conn;
-                telegram_dl_connected (req);
-            }  else {
-                debug ("is remote DC, requesting connection...\n");
-                instance->config->proxy_request_cb (instance, req);
+    int prio;
+    for (prio = 0; prio < DL_PRIO_NUM && instance->dl_active < instance->dl_max_active; prio++) {
+        GQueue *q = instance->dl_queue[prio];
+        if (!q) continue;
+        GList *it = q->head;
+        while (it && instance->dl_active < instance->dl_max_active) {
+            GList *next = it->next;
+            struct download *dl = it->data;
+            if (telegram_dl_dc_ready (instance, dl->dc)) {
+                g_queue_delete_link (q, it);
+                telegram_dl_start (instance, dl);
             }
-        } else {
-            debug ("telegrma_dl_start(): no more downloads, DONE!\n");
-            mtproto_close_foreign (instance);
+            it = next;
         }
-    } else {
-        debug ("telegrma_dl_start(): download busy...\n");
+    }
+
+    if (!instance->dl_active) {
+        // keep the foreign connections for a while, there might be more
+        // downloads from the same DCs soon
+        debug ("telegram_dl_next(): no more downloads\n");
+        if (instance->dl_linger) {
+            remove_event_timer (instance, &instance->dl_linger_ev);
+        }
+        instance->dl_linger = 1;
+        instance->dl_linger_ev.alarm = telegram_dl_linger_alarm;
+        instance->dl_linger_ev.self = instance;
+        instance->dl_linger_ev.timeout = get_double_time () + DL_LINGER_TIME;
+        insert_event_timer (instance, &instance->dl_linger_ev);
     }
 }
 
+void telegram_dl_done (struct telegram *instance, struct download *dl)
+{
+    assert (dl->active);
+    dl->active = 0;
+    instance->dl_active --;
+    instance->dl_active_dc[dl->dc] --;
+}
+
+void telegram_dl_cancel (struct telegram *instance, struct download *dl)
+{
+    debug ("telegram_dl_cancel(dc=%d)\n", dl->dc);
+    if (dl->active) {
+        // stopped by the download itself once its queries are answered
+        dl->cancelled = 1;
+        return;
+    }
+    assert (instance->dl_queue[dl->priority]);
+    assert (g_queue_remove (instance->dl_queue[dl->priority], dl));
+    free_download (dl);
+}
+
+#define SESSION_RETRY_DELAY 30.0
+
+void telegram_session_connected (struct proxy_request *req)
+{
+    debug ("telegram_session_connected(dc=%d, session=%d)\n", req->DC->id, req->session_num);
+    // answers to the queries of a previous connection may have been lost with it
+    query_resend_session (req->tg, dc_get_session (req->DC, req->session_num));
+    // send the queries that were queued while connecting
+    telegram_flush (req->tg);
+}
+
+void telegram_session_connect (struct telegram *instance, struct dc *DC, int num)
+{
+    assert (instance->config->proxy_request_cb);
+    struct session *S = dc_get_session (DC, num);
+    if (S->c || S->connecting) {
+        return;
+    }
+    debug ("telegram_session_connect(dc=%d, session=%d)\n", DC->id, num);
+    S->connecting = 1;
+
+    struct proxy_request *req = talloc0(sizeof(struct proxy_request));
+    req->type = REQ_SESSION;
+    req->DC = DC;
+    req->session_num = num;
+    req->tg = instance;
+    req->done = telegram_session_connected;
+    req->data = instance;
+    instance->config->proxy_request_cb (instance, req);
+}
+
+void telegram_session_failed (struct proxy_request *req)
+{
+    assert (req->type == REQ_SESSION);
+    warning ("connection for session %d of dc %d failed, using the main session\n",
+        req->session_num, req->DC->id);
+    struct session *S = dc_get_session (req->DC, req->session_num);
+    S->connecting = 0;
+    S->next_connect = get_double_time () + SESSION_RETRY_DELAY;
+    tfree (req, sizeof(struct proxy_request));
+}
+
 void on_authorized(struct mtproto_connection *c UU, void *data)
 {
     debug ("on_authorized()...\n");
@@ -433,7 +584,7 @@ void on_authorized(struct mtproto_connection *c UU, void *data)
 struct mtproto_connection *telegram_add_proxy(struct telegram *instance, struct proxy_request *req,
     int fd, void *handle)
 {
-    struct mtproto_connection *c = mtproto_new (req->DC, fd, instance);
+    struct mtproto_connection *c = mtproto_new (req->DC, req->session_num, fd, instance);
     c->handle = handle;
     c->on_ready = on_authorized;
     c->on_ready_data = req;
@@ -442,6 +593,8 @@ struct mtproto_connection *telegram_add_proxy(struct telegram *instance, struct
         req->tg->connection = c;
     }
     mtproto_connect (c);
+    // send the queries issued while the connection became ready
+    telegram_flush (instance);
     return c;
 }
 
@@ -463,8 +616,11 @@ int telegram_authenticated (struct telegram *instance)
 void telegram_flush (struct telegram *instance)
 {
     debug ("telegram flush()\n");
+    // queries of this loop iteration go out together
+    flush_lookups (instance);
+    flush_outboxes (instance);
     int i;
-    for (i = 0; i < 100; i++) {
+    for (i = 0; i < instance->cs; i++) {
         struct mtproto_connection *c = instance->Cs[i];
         if (!c) continue;
         if (!c->connection) continue;
@@ -478,3 +634,17 @@ void telegram_flush (struct telegram *instance)
     }
 }
 
+int telegram_crypto_fd (struct telegram *instance)
+{
+    return crypto_pool_fd (instance->crypto);
+}
+
+void telegram_crypto_ready (struct telegram *instance)
+{
+    if (crypto_pool_reap (instance->crypto)) {
+        // the processed messages may have inserted new queries or closed connections
+        telegram_flush (instance);
+        mtproto_free_closed (instance, 0);
+    }
+}
+
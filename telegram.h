@@ -3,7 +3,6 @@
 
 #define MAX_PACKED_SIZE (1 << 24)
 #define MAX_DC_NUM 9
-#define MAX_PEER_NUM 100000
 
 #ifndef PROG_NAME
 #define PROG_NAME "telegram-purple"
@@ -21,7 +20,7 @@ struct message;
 struct protocol_state;
 struct authorization_state;
 struct tree_query;
-struct tree_timer;
+struct peer_lookup;
 
 
 /*
@@ -62,13 +61,16 @@ struct tree_peer;
 struct tree_peer_by_name;
 struct tree_message;
 
-#define BINLOG_BUFFER_SIZE (1 << 20)
+// initial capacity of the peer vector
+#define PEER_VECTOR_MIN 256
 
 /**
  * Binary log
  */
 struct binlog {
-  int binlog_buffer[BINLOG_BUFFER_SIZE];
+  // scratch for a single event, as large as the largest event so far
+  int *binlog_buffer;
+  int binlog_buffer_size;
   int *rptr;
   int *wptr;
   int test_dc; // = 0
@@ -77,8 +79,6 @@ struct binlog {
   int binlog_fd;
   long long binlog_pos;
 
-  int s[1000];
-
   // 
   struct tree_peer *peer_tree;
   struct tree_peer_by_name *peer_by_name_tree;
@@ -92,16 +92,21 @@ struct binlog {
   int encr_chats_allocated;
   int geo_chats_allocated;
 
-  peer_t *Peers[MAX_PEER_NUM];
+  // all peers in order of allocation
+  peer_t **Peers;
+  int peer_size;
 };
 
 #define REQ_CONNECTION 1
 #define REQ_DOWNLOAD 2
+#define REQ_SESSION 3
 struct proxy_request {
     struct telegram *tg;
     struct dc *DC;
     struct mtproto_connection *conn;
     int type;
+    // the session of DC that will use the connection
+    int session_num;
     void *data;
     void (*done) (struct proxy_request *req);
     void *extra;
@@ -321,6 +326,11 @@ struct telegram {
 
     int session_state;
     struct telegram_config *config;
+
+    /*
+     * debug output level, inherited by connections created afterwards
+     */
+    int verbosity;
     
     /*
      * protocol state
@@ -345,6 +355,8 @@ struct telegram {
     int unread_messages;
     long long cur_uploading_bytes;
     long long cur_uploaded_bytes;
+    // bandwidth-delay product seen by the last upload, sizes the parts of the next
+    double up_bdp;
     long long cur_downloading_bytes;
     long long cur_downloaded_bytes;
     int our_id;
@@ -360,27 +372,63 @@ struct telegram {
     int out_message_num;
     char *suser;
     int nearest_dc_num;
-    int packed_buffer[MAX_PACKED_SIZE / 4];
-    struct tree_query *queries_tree;
-    struct tree_timer *timer_tree;
+    struct query_table queries;
+    // pending and running user and chat info lookups by peer id, and the
+    // ones that wait for the next flush
+    GHashTable *user_lookups;
+    GHashTable *chat_lookups;
+    struct peer_lookup *lookups_head, *lookups_tail;
+    // outbound compression
+    int gzip_threshold;
+    struct gzip_stats gzip;
+    struct timer_wheel timers;
     char *export_auth_str;
     int export_auth_str_len;
     char g_a[256];
     // do_get_difference
     int get_difference_active;
+    int check_phone_result;
+    int dialog_list_got;
     struct message *ML[MSG_STORE_SIZE];
 
     /*
      * All active MtProto connections
      */
+    // slots below cs may be NULL once their connection was freed
     int cs;
-    struct mtproto_connection *Cs[100]; 
+    int cs_size;
+    struct mtproto_connection **Cs;
+    // connections marked for destruction, linked by next_closed
+    struct mtproto_connection *closed;
 
     /*
      * Downloads
      */
-    GQueue *dl_queue;
-    struct download *dl_curr;
+    // queued downloads of every priority class
+    GQueue *dl_queue[DL_PRIO_NUM];
+    // running downloads, in total and per DC
+    int dl_active;
+    int dl_active_dc[11];
+    // limits for the running downloads
+    int dl_max_active;
+    int dl_max_per_dc;
+    // closes the connections to foreign DCs once the downloads are idle
+    struct event_timer dl_linger_ev;
+    int dl_linger;
+    // size of requested file parts and maximal number of parts in flight
+    int dl_part_size;
+    int dl_window_max;
+
+    /*
+     * workers for large decryptions
+     */
+    struct crypto_pool *crypto;
+
+    /*
+     * event loop driving this instance, when not run by libpurple
+     */
+    struct event_loop *loop;
+    struct event_source *crypto_src;
 
     /*
      * additional user data
@@ -478,7 +526,44 @@ struct mtproto_connection *telegram_add_proxy(struct telegram *tg, struct proxy_
 int telegram_authenticated (struct telegram *instance);
 
 void telegram_flush (struct telegram *instance);
+
+/**
+ * Becomes readable when the crypto pool has results, the main loop must then
+ * call telegram_crypto_ready
+ */
+int telegram_crypto_fd (struct telegram *instance);
+void telegram_crypto_ready (struct telegram *instance);
+
+/**
+ * Request an additional connection for the session num of DC
+ */
+void telegram_session_connect (struct telegram *instance, struct dc *DC, int num);
+
+/**
+ * Must be called instead of the usual error handling when the connection of a
+ * request of type REQ_SESSION could not be acquired, frees req
+ */
+void telegram_session_failed (struct proxy_request *req);
+
+/**
+ * Queue dl in its priority class and start it as soon as the limits allow
+ */
 void telegram_dl_add (struct telegram *instance, struct download *dl);
+
+/**
+ * Start queued downloads until the limits are reached
+ */
 void telegram_dl_next (struct telegram *instance);
 
+/**
+ * Called by the download once it is finished or cancelled
+ */
+void telegram_dl_done (struct telegram *instance, struct download *dl);
+
+/**
+ * Drop a queued download or stop a running one, no download_finished event
+ * will be sent for it
+ */
+void telegram_dl_cancel (struct telegram *instance, struct download *dl);
+
 #endif
@@ -0,0 +1,146 @@
+/*
+ * Hierarchical timing wheel, see timers.h
+ */
+
+#include <assert.h>
+#include <limits.h>
+
+#include "timers.h"
+#include "msglog.h"
+
+/**
+ * Put ev into the slot of its expiry tick, on the lowest level that reaches it
+ */
+static void timer_link (struct timer_wheel *W, struct event_timer *ev) {
+  long long t = ev->expires;
+  if (t < W->cur) { t = W->cur; }
+  long long delta = t - W->cur;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_BITS * (level + 1))) {
+    level ++;
+  }
+  if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+    // beyond the wheel, wait in the last slot it reaches
+    t = W->cur + (1ll << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+  int slot = (t >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  struct event_timer **head = &W->slots[level * TIMER_WHEEL_SLOTS + slot];
+  ev->slot = level * TIMER_WHEEL_SLOTS + slot;
+  ev->next = *head;
+  if (ev->next) {
+    ev->next->pprev = &ev->next;
+  }
+  ev->pprev = head;
+  *head = ev;
+  W->used[level] |= 1ull << slot;
+}
+
+static void timer_unlink (struct timer_wheel *W, struct event_timer *ev) {
+  *ev->pprev = ev->next;
+  if (ev->next) {
+    ev->next->pprev = ev->pprev;
+  }
+  if (!W->slots[ev->slot]) {
+    W->used[ev->slot / TIMER_WHEEL_SLOTS] &= ~(1ull << (ev->slot % TIMER_WHEEL_SLOTS));
+  }
+  ev->next = 0;
+  ev->pprev = 0;
+}
+
+/**
+ * Spread the current slot of level over the levels below, called whenever
+ * the level below begins a new turn
+ */
+static void timer_cascade (struct timer_wheel *W, int level) {
+  int slot = (W->cur >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  struct event_timer *ev = W->slots[level * TIMER_WHEEL_SLOTS + slot];
+  W->slots[level * TIMER_WHEEL_SLOTS + slot] = 0;
+  W->used[level] &= ~(1ull << slot);
+  while (ev) {
+    struct event_timer *next = ev->next;
+    timer_link (W, ev);
+    ev = next;
+  }
+  if (!slot && level + 1 < TIMER_WHEEL_LEVELS) {
+    timer_cascade (W, level + 1);
+  }
+}
+
+void timer_wheel_insert (struct timer_wheel *W, struct event_timer *ev, long long now) {
+  if (!W->cur) {
+    W->cur = now;
+  }
+  if (ev->pprev) {
+    timer_unlink (W, ev);
+  } else {
+    W->count ++;
+  }
+  timer_link (W, ev);
+}
+
+void timer_wheel_remove (struct timer_wheel *W, struct event_timer *ev) {
+  if (!ev->pprev) { return; }
+  timer_unlink (W, ev);
+  W->count --;
+}
+
+long long timer_wheel_next (struct timer_wheel *W) {
+  if (!W->count) { return LLONG_MAX; }
+  long long next = LLONG_MAX;
+  int level;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    unsigned long long used = W->used[level];
+    if (!used) { continue; }
+    int shift = TIMER_WHEEL_BITS * level;
+    int pos = (W->cur >> shift) & (TIMER_WHEEL_SLOTS - 1);
+    // slots in the order they come up, the current slot of the upper levels
+    // only holds timers for the next turn once it was spread at cur
+    unsigned long long order = pos ? (used >> pos) | (used << (TIMER_WHEEL_SLOTS - pos)) : used;
+    if (level && (W->cur & ((1ll << shift) - 1))) {
+      order &= ~1ull;
+    }
+    int k = order ? __builtin_ctzll (order) : TIMER_WHEEL_SLOTS;
+    long long t = ((W->cur >> shift) + k) << shift;
+    if (t < next) { next = t; }
+  }
+  return next;
+}
+
+void timer_wheel_run (struct timer_wheel *W, long long now) {
+  if (!W->count) {
+    W->cur = now + 1;
+    return;
+  }
+  while (W->cur <= now) {
+    int slot = W->cur & (TIMER_WHEEL_SLOTS - 1);
+    if (!slot) {
+      timer_cascade (W, 1);
+    }
+    // alarms may arm timers that are due in this slot again
+    while (W->slots[slot]) {
+      struct event_timer *ev = W->slots[slot];
+      timer_unlink (W, ev);
+      W->count --;
+      assert (ev->alarm);
+      debug ("Alarm\n");
+      ev->alarm (ev->self);
+    }
+    // skip the empty slots up to the end of the turn
+    unsigned long long ahead = slot + 1 < TIMER_WHEEL_SLOTS ? W->used[0] >> (slot + 1) : 0;
+    long long next = ahead ? W->cur + 1 + __builtin_ctzll (ahead) : (W->cur | (TIMER_WHEEL_SLOTS - 1)) + 1;
+    W->cur = next <= now ? next : now + 1;
+  }
+}
+
+void timer_wheel_clear (struct timer_wheel *W) {
+  int i;
+  for (i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+    while (W->slots[i]) {
+      struct event_timer *ev = W->slots[i];
+      debug ("freeing event timer with timeout: %lf\n", ev->timeout);
+      timer_unlink (W, ev);
+      W->count --;
+    }
+  }
+  assert (!W->count);
+}
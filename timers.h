@@ -0,0 +1,62 @@
+#ifndef __TIMERS_H__
+#define __TIMERS_H__
+
+/*
+ * Timers live in a hierarchical timing wheel. The slots of level 0 are
+ * 1 / TIMER_HZ seconds wide, each slot of the next level spans a whole turn of
+ * the level below and is spread over it once that turn begins. Arming,
+ * re-arming and cancelling a timer only link or unlink it.
+ */
+#define TIMER_HZ 64
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct event_timer {
+  double timeout;
+  int (*alarm)(void *self);
+  void *self;
+
+  // tick of the timeout and position in the wheel, pprev is set while armed
+  long long expires;
+  int slot;
+  struct event_timer *next, **pprev;
+};
+
+struct timer_wheel {
+  // all ticks before cur have been processed
+  long long cur;
+  int count;
+  // non-empty slots of each level
+  unsigned long long used[TIMER_WHEEL_LEVELS];
+  struct event_timer *slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+};
+
+/**
+ * Arm ev to fire at tick ev->expires, a timer that is already armed is moved.
+ * now is the current tick, it starts the wheel when the first timer is armed.
+ */
+void timer_wheel_insert (struct timer_wheel *W, struct event_timer *ev, long long now);
+
+/**
+ * Cancel ev, nothing happens if it is not armed
+ */
+void timer_wheel_remove (struct timer_wheel *W, struct event_timer *ev);
+
+/**
+ * Tick at which timer_wheel_run has to run next at the latest, LLONG_MAX if no
+ * timer is armed
+ */
+long long timer_wheel_next (struct timer_wheel *W);
+
+/**
+ * Fire all timers due up to and including tick now
+ */
+void timer_wheel_run (struct timer_wheel *W, long long now);
+
+/**
+ * Disarm all timers without firing them
+ */
+void timer_wheel_clear (struct timer_wheel *W);
+
+#endif
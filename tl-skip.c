@@ -0,0 +1,713 @@
+/*
+    This file is part of telegram-client.
+
+    Telegram-client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Telegram-client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this telegram-client.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright Vitaly Valtman 2013
+*/
+
+// Generated by gen_skip_c.awk from skip.tl, do not edit
+#include <assert.h>
+
+#include "mtproto-client.h"
+#include "constants.h"
+#include "msglog.h"
+#include "tl-skip.h"
+
+void fetch_skip_file_location (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_file_location_unavailable:
+    fetch_skip (mtp, 5);
+    break;
+  case CODE_file_location:
+    fetch_skip (mtp, 6);
+    break;
+  default:
+    debug ("fetch_skip_file_location: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_user_status (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_user_status_empty:
+    break;
+  case CODE_user_status_online:
+    fetch_skip (mtp, 1);
+    break;
+  case CODE_user_status_offline:
+    fetch_skip (mtp, 1);
+    break;
+  default:
+    debug ("fetch_skip_user_status: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_photo_size (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_photo_size_empty:
+    fetch_skip_str (mtp);
+    break;
+  case CODE_photo_size:
+    fetch_skip_str (mtp);
+    fetch_skip_file_location (mtp);
+    fetch_skip (mtp, 3);
+    break;
+  case CODE_photo_cached_size:
+    fetch_skip_str (mtp);
+    fetch_skip_file_location (mtp);
+    fetch_skip (mtp, 2);
+    fetch_skip_str (mtp);
+    break;
+  default:
+    debug ("fetch_skip_photo_size: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_geo_point (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_geo_point_empty:
+    break;
+  case CODE_geo_point:
+    fetch_skip (mtp, 4);
+    break;
+  default:
+    debug ("fetch_skip_geo_point: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_photo (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  int n;
+  int i;
+  switch (x) {
+  case CODE_photo_empty:
+    fetch_skip (mtp, 2);
+    break;
+  case CODE_photo:
+    fetch_skip (mtp, 6);
+    fetch_skip_str (mtp);
+    fetch_skip_geo_point (mtp);
+    assert (fetch_int (mtp) == (int)CODE_vector);
+    n = fetch_int (mtp);
+    for (i = 0; i < n; i++) {
+      fetch_skip_photo_size (mtp);
+    }
+    break;
+  default:
+    debug ("fetch_skip_photo: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_video (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_video_empty:
+    fetch_skip (mtp, 2);
+    break;
+  case CODE_video:
+    fetch_skip (mtp, 6);
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 2);
+    fetch_skip_photo_size (mtp);
+    fetch_skip (mtp, 3);
+    break;
+  default:
+    debug ("fetch_skip_video: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_audio (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_audio_empty:
+    fetch_skip (mtp, 2);
+    break;
+  case CODE_audio:
+    fetch_skip (mtp, 9);
+    break;
+  default:
+    debug ("fetch_skip_audio: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_document (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_document_empty:
+    fetch_skip (mtp, 2);
+    break;
+  case CODE_document:
+    fetch_skip (mtp, 6);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 1);
+    fetch_skip_photo_size (mtp);
+    fetch_skip (mtp, 1);
+    break;
+  default:
+    debug ("fetch_skip_document: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_message_action (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  int n;
+  switch (x) {
+  case CODE_message_action_empty:
+    break;
+  case CODE_message_action_chat_create:
+    fetch_skip_str (mtp);
+    assert (fetch_int (mtp) == (int)CODE_vector);
+    n = fetch_int (mtp);
+    assert (n >= 0 && n <= mtp->in_end - mtp->in_ptr);
+    fetch_skip (mtp, n);
+    break;
+  case CODE_message_action_chat_edit_title:
+    fetch_skip_str (mtp);
+    break;
+  case CODE_message_action_chat_edit_photo:
+    fetch_skip_photo (mtp);
+    break;
+  case CODE_message_action_chat_delete_photo:
+    break;
+  case CODE_message_action_chat_add_user:
+    fetch_skip (mtp, 1);
+    break;
+  case CODE_message_action_chat_delete_user:
+    fetch_skip (mtp, 1);
+    break;
+  case CODE_message_action_geo_chat_create:
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    break;
+  case CODE_message_action_geo_chat_checkin:
+    break;
+  default:
+    debug ("fetch_skip_message_action: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_message_media (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_message_media_empty:
+    break;
+  case CODE_message_media_photo:
+    fetch_skip_photo (mtp);
+    break;
+  case CODE_message_media_video:
+    fetch_skip_video (mtp);
+    break;
+  case CODE_message_media_geo:
+    fetch_skip_geo_point (mtp);
+    break;
+  case CODE_message_media_contact:
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 1);
+    break;
+  case CODE_message_media_unsupported:
+    fetch_skip_str (mtp);
+    break;
+  case CODE_message_media_document:
+    fetch_skip_document (mtp);
+    break;
+  case CODE_message_media_audio:
+    fetch_skip_audio (mtp);
+    break;
+  default:
+    debug ("fetch_skip_message_media: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_encrypted_file (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_encrypted_file_empty:
+    break;
+  case CODE_encrypted_file:
+    fetch_skip (mtp, 7);
+    break;
+  default:
+    debug ("fetch_skip_encrypted_file: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_decrypted_message_media (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  switch (x) {
+  case CODE_decrypted_message_media_empty:
+    break;
+  case CODE_decrypted_message_media_photo:
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 5);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    break;
+  case CODE_decrypted_message_media_video:
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 6);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    break;
+  case CODE_decrypted_message_media_geo_point:
+    fetch_skip (mtp, 4);
+    break;
+  case CODE_decrypted_message_media_contact:
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 1);
+    break;
+  case CODE_decrypted_message_media_document:
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 2);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    fetch_skip (mtp, 1);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    break;
+  case CODE_decrypted_message_media_audio:
+    fetch_skip (mtp, 2);
+    fetch_skip_str (mtp);
+    fetch_skip_str (mtp);
+    break;
+  default:
+    debug ("fetch_skip_decrypted_message_media: type = 0x%08x\n", x);
+    assert (0);
+  }
+}
+
+void fetch_skip_decrypted_message_action (struct mtproto_connection *mtp) {
+  unsigned x = fetch_int (mtp);
+  assert (x == CODE_decrypted_message_action_set_message_t_t_l);
+  fetch_skip (mtp, 1);
+}
+
+void fetch_tl_file_location (struct mtproto_connection *mtp, struct tl_file_location *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_file_location_unavailable:
+    fetch_span (mtp, 5);
+    R->volume_id = span_long (mtp);
+    R->local_id = span_int (mtp);
+    R->secret = span_long (mtp);
+    break;
+  case CODE_file_location:
+    fetch_span (mtp, 6);
+    R->dc_id = span_int (mtp);
+    R->volume_id = span_long (mtp);
+    R->local_id = span_int (mtp);
+    R->secret = span_long (mtp);
+    break;
+  default:
+    debug ("fetch_tl_file_location: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_user_status (struct mtproto_connection *mtp, struct tl_user_status *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_user_status_empty:
+    break;
+  case CODE_user_status_online:
+    fetch_span (mtp, 1);
+    R->expires = span_int (mtp);
+    break;
+  case CODE_user_status_offline:
+    fetch_span (mtp, 1);
+    R->was_online = span_int (mtp);
+    break;
+  default:
+    debug ("fetch_tl_user_status: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_photo_size (struct mtproto_connection *mtp, struct tl_photo_size *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_photo_size_empty:
+    R->type.len = prefetch_strlen (mtp);
+    R->type.data = fetch_str (mtp, R->type.len);
+    break;
+  case CODE_photo_size:
+    R->type.len = prefetch_strlen (mtp);
+    R->type.data = fetch_str (mtp, R->type.len);
+    fetch_tl_file_location (mtp, &R->location);
+    fetch_span (mtp, 3);
+    R->w = span_int (mtp);
+    R->h = span_int (mtp);
+    R->size = span_int (mtp);
+    break;
+  case CODE_photo_cached_size:
+    R->type.len = prefetch_strlen (mtp);
+    R->type.data = fetch_str (mtp, R->type.len);
+    fetch_tl_file_location (mtp, &R->location);
+    fetch_span (mtp, 2);
+    R->w = span_int (mtp);
+    R->h = span_int (mtp);
+    R->bytes.len = prefetch_strlen (mtp);
+    R->bytes.data = fetch_str (mtp, R->bytes.len);
+    break;
+  default:
+    debug ("fetch_tl_photo_size: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_geo_point (struct mtproto_connection *mtp, struct tl_geo_point *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_geo_point_empty:
+    break;
+  case CODE_geo_point:
+    fetch_span (mtp, 4);
+    R->long_ = span_double (mtp);
+    R->lat = span_double (mtp);
+    break;
+  default:
+    debug ("fetch_tl_geo_point: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_photo (struct mtproto_connection *mtp, struct tl_photo *R) {
+  int i;
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_photo_empty:
+    fetch_span (mtp, 2);
+    R->id = span_long (mtp);
+    break;
+  case CODE_photo:
+    fetch_span (mtp, 6);
+    R->id = span_long (mtp);
+    R->access_hash = span_long (mtp);
+    R->user_id = span_int (mtp);
+    R->date = span_int (mtp);
+    R->caption.len = prefetch_strlen (mtp);
+    R->caption.data = fetch_str (mtp, R->caption.len);
+    fetch_tl_geo_point (mtp, &R->geo);
+    assert (fetch_int (mtp) == (int)CODE_vector);
+    R->sizes.n = fetch_int (mtp);
+    R->sizes.data = mtp->in_ptr;
+    assert (R->sizes.n >= 0);
+    for (i = 0; i < R->sizes.n; i++) {
+      fetch_skip_photo_size (mtp);
+    }
+    break;
+  default:
+    debug ("fetch_tl_photo: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_video (struct mtproto_connection *mtp, struct tl_video *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_video_empty:
+    fetch_span (mtp, 2);
+    R->id = span_long (mtp);
+    break;
+  case CODE_video:
+    fetch_span (mtp, 6);
+    R->id = span_long (mtp);
+    R->access_hash = span_long (mtp);
+    R->user_id = span_int (mtp);
+    R->date = span_int (mtp);
+    R->caption.len = prefetch_strlen (mtp);
+    R->caption.data = fetch_str (mtp, R->caption.len);
+    fetch_span (mtp, 2);
+    R->duration = span_int (mtp);
+    R->size = span_int (mtp);
+    fetch_tl_photo_size (mtp, &R->thumb);
+    fetch_span (mtp, 3);
+    R->dc_id = span_int (mtp);
+    R->w = span_int (mtp);
+    R->h = span_int (mtp);
+    break;
+  default:
+    debug ("fetch_tl_video: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_audio (struct mtproto_connection *mtp, struct tl_audio *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_audio_empty:
+    fetch_span (mtp, 2);
+    R->id = span_long (mtp);
+    break;
+  case CODE_audio:
+    fetch_span (mtp, 9);
+    R->id = span_long (mtp);
+    R->access_hash = span_long (mtp);
+    R->user_id = span_int (mtp);
+    R->date = span_int (mtp);
+    R->duration = span_int (mtp);
+    R->size = span_int (mtp);
+    R->dc_id = span_int (mtp);
+    break;
+  default:
+    debug ("fetch_tl_audio: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_document (struct mtproto_connection *mtp, struct tl_document *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_document_empty:
+    fetch_span (mtp, 2);
+    R->id = span_long (mtp);
+    break;
+  case CODE_document:
+    fetch_span (mtp, 6);
+    R->id = span_long (mtp);
+    R->access_hash = span_long (mtp);
+    R->user_id = span_int (mtp);
+    R->date = span_int (mtp);
+    R->file_name.len = prefetch_strlen (mtp);
+    R->file_name.data = fetch_str (mtp, R->file_name.len);
+    R->mime_type.len = prefetch_strlen (mtp);
+    R->mime_type.data = fetch_str (mtp, R->mime_type.len);
+    fetch_span (mtp, 1);
+    R->size = span_int (mtp);
+    fetch_tl_photo_size (mtp, &R->thumb);
+    fetch_span (mtp, 1);
+    R->dc_id = span_int (mtp);
+    break;
+  default:
+    debug ("fetch_tl_document: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_message_action (struct mtproto_connection *mtp, struct tl_message_action *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_message_action_empty:
+    break;
+  case CODE_message_action_chat_create:
+    R->title.len = prefetch_strlen (mtp);
+    R->title.data = fetch_str (mtp, R->title.len);
+    assert (fetch_int (mtp) == (int)CODE_vector);
+    R->users.n = fetch_int (mtp);
+    R->users.data = mtp->in_ptr;
+    assert (R->users.n >= 0 && R->users.n <= (mtp->in_end - mtp->in_ptr) / 1);
+    fetch_skip (mtp, R->users.n * 1);
+    break;
+  case CODE_message_action_chat_edit_title:
+    R->title.len = prefetch_strlen (mtp);
+    R->title.data = fetch_str (mtp, R->title.len);
+    break;
+  case CODE_message_action_chat_edit_photo:
+    fetch_tl_photo (mtp, &R->photo);
+    break;
+  case CODE_message_action_chat_delete_photo:
+    break;
+  case CODE_message_action_chat_add_user:
+    fetch_span (mtp, 1);
+    R->user_id = span_int (mtp);
+    break;
+  case CODE_message_action_chat_delete_user:
+    fetch_span (mtp, 1);
+    R->user_id = span_int (mtp);
+    break;
+  case CODE_message_action_geo_chat_create:
+    R->title.len = prefetch_strlen (mtp);
+    R->title.data = fetch_str (mtp, R->title.len);
+    R->address.len = prefetch_strlen (mtp);
+    R->address.data = fetch_str (mtp, R->address.len);
+    break;
+  case CODE_message_action_geo_chat_checkin:
+    break;
+  default:
+    debug ("fetch_tl_message_action: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_message_media (struct mtproto_connection *mtp, struct tl_message_media *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_message_media_empty:
+    break;
+  case CODE_message_media_photo:
+    fetch_tl_photo (mtp, &R->photo);
+    break;
+  case CODE_message_media_video:
+    fetch_tl_video (mtp, &R->video);
+    break;
+  case CODE_message_media_geo:
+    fetch_tl_geo_point (mtp, &R->geo);
+    break;
+  case CODE_message_media_contact:
+    R->phone_number.len = prefetch_strlen (mtp);
+    R->phone_number.data = fetch_str (mtp, R->phone_number.len);
+    R->first_name.len = prefetch_strlen (mtp);
+    R->first_name.data = fetch_str (mtp, R->first_name.len);
+    R->last_name.len = prefetch_strlen (mtp);
+    R->last_name.data = fetch_str (mtp, R->last_name.len);
+    fetch_span (mtp, 1);
+    R->user_id = span_int (mtp);
+    break;
+  case CODE_message_media_unsupported:
+    R->bytes.len = prefetch_strlen (mtp);
+    R->bytes.data = fetch_str (mtp, R->bytes.len);
+    break;
+  case CODE_message_media_document:
+    fetch_tl_document (mtp, &R->document);
+    break;
+  case CODE_message_media_audio:
+    fetch_tl_audio (mtp, &R->audio);
+    break;
+  default:
+    debug ("fetch_tl_message_media: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_encrypted_file (struct mtproto_connection *mtp, struct tl_encrypted_file *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_encrypted_file_empty:
+    break;
+  case CODE_encrypted_file:
+    fetch_span (mtp, 7);
+    R->id = span_long (mtp);
+    R->access_hash = span_long (mtp);
+    R->size = span_int (mtp);
+    R->dc_id = span_int (mtp);
+    R->key_fingerprint = span_int (mtp);
+    break;
+  default:
+    debug ("fetch_tl_encrypted_file: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_decrypted_message_media (struct mtproto_connection *mtp, struct tl_decrypted_message_media *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_decrypted_message_media_empty:
+    break;
+  case CODE_decrypted_message_media_photo:
+    R->thumb.len = prefetch_strlen (mtp);
+    R->thumb.data = fetch_str (mtp, R->thumb.len);
+    fetch_span (mtp, 5);
+    R->thumb_w = span_int (mtp);
+    R->thumb_h = span_int (mtp);
+    R->w = span_int (mtp);
+    R->h = span_int (mtp);
+    R->size = span_int (mtp);
+    R->key.len = prefetch_strlen (mtp);
+    R->key.data = fetch_str (mtp, R->key.len);
+    R->iv.len = prefetch_strlen (mtp);
+    R->iv.data = fetch_str (mtp, R->iv.len);
+    break;
+  case CODE_decrypted_message_media_video:
+    R->thumb.len = prefetch_strlen (mtp);
+    R->thumb.data = fetch_str (mtp, R->thumb.len);
+    fetch_span (mtp, 6);
+    R->thumb_w = span_int (mtp);
+    R->thumb_h = span_int (mtp);
+    R->duration = span_int (mtp);
+    R->w = span_int (mtp);
+    R->h = span_int (mtp);
+    R->size = span_int (mtp);
+    R->key.len = prefetch_strlen (mtp);
+    R->key.data = fetch_str (mtp, R->key.len);
+    R->iv.len = prefetch_strlen (mtp);
+    R->iv.data = fetch_str (mtp, R->iv.len);
+    break;
+  case CODE_decrypted_message_media_geo_point:
+    fetch_span (mtp, 4);
+    R->lat = span_double (mtp);
+    R->long_ = span_double (mtp);
+    break;
+  case CODE_decrypted_message_media_contact:
+    R->phone_number.len = prefetch_strlen (mtp);
+    R->phone_number.data = fetch_str (mtp, R->phone_number.len);
+    R->first_name.len = prefetch_strlen (mtp);
+    R->first_name.data = fetch_str (mtp, R->first_name.len);
+    R->last_name.len = prefetch_strlen (mtp);
+    R->last_name.data = fetch_str (mtp, R->last_name.len);
+    fetch_span (mtp, 1);
+    R->user_id = span_int (mtp);
+    break;
+  case CODE_decrypted_message_media_document:
+    R->thumb.len = prefetch_strlen (mtp);
+    R->thumb.data = fetch_str (mtp, R->thumb.len);
+    fetch_span (mtp, 2);
+    R->thumb_w = span_int (mtp);
+    R->thumb_h = span_int (mtp);
+    R->file_name.len = prefetch_strlen (mtp);
+    R->file_name.data = fetch_str (mtp, R->file_name.len);
+    R->mime_type.len = prefetch_strlen (mtp);
+    R->mime_type.data = fetch_str (mtp, R->mime_type.len);
+    fetch_span (mtp, 1);
+    R->size = span_int (mtp);
+    R->key.len = prefetch_strlen (mtp);
+    R->key.data = fetch_str (mtp, R->key.len);
+    R->iv.len = prefetch_strlen (mtp);
+    R->iv.data = fetch_str (mtp, R->iv.len);
+    break;
+  case CODE_decrypted_message_media_audio:
+    fetch_span (mtp, 2);
+    R->duration = span_int (mtp);
+    R->size = span_int (mtp);
+    R->key.len = prefetch_strlen (mtp);
+    R->key.data = fetch_str (mtp, R->key.len);
+    R->iv.len = prefetch_strlen (mtp);
+    R->iv.data = fetch_str (mtp, R->iv.len);
+    break;
+  default:
+    debug ("fetch_tl_decrypted_message_media: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
+
+void fetch_tl_decrypted_message_action (struct mtproto_connection *mtp, struct tl_decrypted_message_action *R) {
+  R->magic = fetch_int (mtp);
+  switch (R->magic) {
+  case CODE_decrypted_message_action_set_message_t_t_l:
+    fetch_span (mtp, 1);
+    R->ttl_seconds = span_int (mtp);
+    break;
+  default:
+    debug ("fetch_tl_decrypted_message_action: type = 0x%08x\n", R->magic);
+    assert (0);
+  }
+}
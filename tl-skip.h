@@ -0,0 +1,203 @@
+/*
+    This file is part of telegram-client.
+
+    Telegram-client is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Telegram-client is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this telegram-client.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright Vitaly Valtman 2013
+*/
+
+// Generated by gen_skip_c.awk from skip.tl, do not edit
+#ifndef __TL_SKIP_H__
+#define __TL_SKIP_H__
+
+struct mtproto_connection;
+
+struct tl_str {
+  int len;
+  char *data;
+};
+
+// the elements are left in the input at data, decode them from there
+struct tl_vector {
+  int n;
+  int *data;
+};
+
+struct tl_file_location {
+  unsigned magic;
+  long long volume_id;
+  int local_id;
+  long long secret;
+  int dc_id;
+};
+
+struct tl_user_status {
+  unsigned magic;
+  int expires;
+  int was_online;
+};
+
+struct tl_photo_size {
+  unsigned magic;
+  struct tl_str type;
+  struct tl_file_location location;
+  int w;
+  int h;
+  int size;
+  struct tl_str bytes;
+};
+
+struct tl_geo_point {
+  unsigned magic;
+  double long_;
+  double lat;
+};
+
+struct tl_photo {
+  unsigned magic;
+  long long id;
+  long long access_hash;
+  int user_id;
+  int date;
+  struct tl_str caption;
+  struct tl_geo_point geo;
+  struct tl_vector sizes;
+};
+
+struct tl_video {
+  unsigned magic;
+  long long id;
+  long long access_hash;
+  int user_id;
+  int date;
+  struct tl_str caption;
+  int duration;
+  int size;
+  struct tl_photo_size thumb;
+  int dc_id;
+  int w;
+  int h;
+};
+
+struct tl_audio {
+  unsigned magic;
+  long long id;
+  long long access_hash;
+  int user_id;
+  int date;
+  int duration;
+  int size;
+  int dc_id;
+};
+
+struct tl_document {
+  unsigned magic;
+  long long id;
+  long long access_hash;
+  int user_id;
+  int date;
+  struct tl_str file_name;
+  struct tl_str mime_type;
+  int size;
+  struct tl_photo_size thumb;
+  int dc_id;
+};
+
+struct tl_message_action {
+  unsigned magic;
+  struct tl_str title;
+  struct tl_vector users;
+  struct tl_photo photo;
+  int user_id;
+  struct tl_str address;
+};
+
+struct tl_message_media {
+  unsigned magic;
+  struct tl_photo photo;
+  struct tl_video video;
+  struct tl_geo_point geo;
+  struct tl_str phone_number;
+  struct tl_str first_name;
+  struct tl_str last_name;
+  int user_id;
+  struct tl_str bytes;
+  struct tl_document document;
+  struct tl_audio audio;
+};
+
+struct tl_encrypted_file {
+  unsigned magic;
+  long long id;
+  long long access_hash;
+  int size;
+  int dc_id;
+  int key_fingerprint;
+};
+
+struct tl_decrypted_message_media {
+  unsigned magic;
+  struct tl_str thumb;
+  int thumb_w;
+  int thumb_h;
+  int w;
+  int h;
+  int size;
+  struct tl_str key;
+  struct tl_str iv;
+  int duration;
+  double lat;
+  double long_;
+  struct tl_str phone_number;
+  struct tl_str first_name;
+  struct tl_str last_name;
+  int user_id;
+  struct tl_str file_name;
+  struct tl_str mime_type;
+};
+
+struct tl_decrypted_message_action {
+  unsigned magic;
+  int ttl_seconds;
+};
+
+void fetch_skip_file_location (struct mtproto_connection *mtp);
+void fetch_skip_user_status (struct mtproto_connection *mtp);
+void fetch_skip_photo_size (struct mtproto_connection *mtp);
+void fetch_skip_geo_point (struct mtproto_connection *mtp);
+void fetch_skip_photo (struct mtproto_connection *mtp);
+void fetch_skip_video (struct mtproto_connection *mtp);
+void fetch_skip_audio (struct mtproto_connection *mtp);
+void fetch_skip_document (struct mtproto_connection *mtp);
+void fetch_skip_message_action (struct mtproto_connection *mtp);
+void fetch_skip_message_media (struct mtproto_connection *mtp);
+void fetch_skip_encrypted_file (struct mtproto_connection *mtp);
+void fetch_skip_decrypted_message_media (struct mtproto_connection *mtp);
+void fetch_skip_decrypted_message_action (struct mtproto_connection *mtp);
+
+void fetch_tl_file_location (struct mtproto_connection *mtp, struct tl_file_location *R);
+void fetch_tl_user_status (struct mtproto_connection *mtp, struct tl_user_status *R);
+void fetch_tl_photo_size (struct mtproto_connection *mtp, struct tl_photo_size *R);
+void fetch_tl_geo_point (struct mtproto_connection *mtp, struct tl_geo_point *R);
+void fetch_tl_photo (struct mtproto_connection *mtp, struct tl_photo *R);
+void fetch_tl_video (struct mtproto_connection *mtp, struct tl_video *R);
+void fetch_tl_audio (struct mtproto_connection *mtp, struct tl_audio *R);
+void fetch_tl_document (struct mtproto_connection *mtp, struct tl_document *R);
+void fetch_tl_message_action (struct mtproto_connection *mtp, struct tl_message_action *R);
+void fetch_tl_message_media (struct mtproto_connection *mtp, struct tl_message_media *R);
+void fetch_tl_encrypted_file (struct mtproto_connection *mtp, struct tl_encrypted_file *R);
+void fetch_tl_decrypted_message_media (struct mtproto_connection *mtp, struct tl_decrypted_message_media *R);
+void fetch_tl_decrypted_message_action (struct mtproto_connection *mtp, struct tl_decrypted_message_action *R);
+
+#endif
@@ -39,8 +39,6 @@ int used_blocks;
 int free_blocks_cnt;
 #endif
 
-extern int verbosity;
-
 long long total_allocated_bytes;
 
 static void out_of_memory (void) {
@@ -205,9 +203,6 @@ int tinflate (void *input, int ilen, void *output, int olen) {
   int err = inflate (&strm, Z_FINISH), total_out = 0;
   if (err == Z_OK || err == Z_STREAM_END) {
     total_out = (int) strm.total_out;
-    if (err == Z_STREAM_END && verbosity >= 2) {
-      debug ( "inflated %d bytes\n", (int) strm.total_out);
-    }
   }
   if (err != Z_STREAM_END) {
     debug ( "inflate error = %d\n", err);
@@ -217,6 +212,25 @@ int tinflate (void *input, int ilen, void *output, int olen) {
   return total_out;
 }
 
+/**
+ * Compress input into a gzip stream, returns 0 if it does not fit into olen bytes
+ */
+int tdeflate (void *input, int ilen, void *output, int olen, int level) {
+  z_stream strm;
+  memset (&strm, 0, sizeof (strm));
+  assert (deflateInit2 (&strm, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  strm.avail_in = ilen;
+  strm.next_in = input;
+  strm.avail_out = olen;
+  strm.next_out = output;
+  int err = deflate (&strm, Z_FINISH), total_out = 0;
+  if (err == Z_STREAM_END) {
+    total_out = (int) strm.total_out;
+  }
+  deflateEnd (&strm);
+  return total_out;
+}
+
 #ifdef DEBUG
 void tcheck (void) {
   int i;
@@ -26,6 +26,7 @@ char *tstrdup (const char *s);
 char *tstrndup (const char *s, size_t n);
 //char *stradd(const char *, ...);
 int tinflate (void *input, int ilen, void *output, int olen);
+int tdeflate (void *input, int ilen, void *output, int olen, int level);
 void ensure (int r);
 void ensure_ptr (void *p);
 